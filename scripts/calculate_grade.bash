@@ -10,8 +10,10 @@ c=64
 o=0.3
 r=$(od -An -N4 -tu4 < /dev/urandom)
 num_bins=10
+quantile=0
+approx=''
 
-while getopts "ds:p:f:c:o:r:b:" opt; do
+while getopts "ds:p:f:c:o:r:b:qa:" opt; do
     case ${opt} in
         s )
             s=${OPTARG}
@@ -34,6 +36,12 @@ while getopts "ds:p:f:c:o:r:b:" opt; do
         b )
             num_bins=${OPTARG}
             ;;
+        q )
+            quantile=1
+            ;;
+        a )
+            approx=${OPTARG}
+            ;;
         \? )
             echo "Usage: $0 [options] <data_directory>"
             echo "Options:"
@@ -44,6 +52,8 @@ while getopts "ds:p:f:c:o:r:b:" opt; do
             echo "  -o <output_weight>       Output weight (default: 0.3)"
             echo "  -r <seed>                Random seed (default: 0)"
             echo "  -b <num_bins>            Number of bins (default: 10)"
+    echo "  -q                       Bin at quantiles instead of uniformly"
+    echo "  -a <rows>                Estimate the grade from <rows> rows per class"
             exit 1
             ;;
     esac
@@ -61,34 +71,52 @@ if [ -z "$data_dir" ]; then
     echo "  -o <output_weight>       Output weight (default: 0.3)"
     echo "  -r <seed>                Random seed (default: 0)"
     echo "  -b <num_bins>            Number of bins (default: 10)"
+    echo "  -q                       Bin at quantiles instead of uniformly"
+    echo "  -a <rows>                Estimate the grade from <rows> rows per class"
     exit 1
 fi
 
 cpu_threads=$(nproc)
-data_range=$(bin/data_preprocessing <${data_dir}/data.csv)
-num_features=$(grep 'Num' <<<${data_range} | awk '{print $2}')
+# Converted once, later runs map it and reuse its precomputed ranges
+data_bin="${data_dir}"/data.bin
+if [ ! -f "${data_bin}" ] || [ "${data_dir}"/data.csv -nt "${data_bin}" ] ||
+    [ "${data_dir}"/labels.csv -nt "${data_bin}" ]; then
+    bin/convert_dataset "${data_dir}"/data.csv "${data_dir}"/labels.csv "${data_bin}"
+fi
+
+edges=''
+if [ ${quantile} -eq 1 ]; then
+    edges="${data_dir}"/edges_${num_bins}.txt
+    data_range=$(bin/data_preprocessing -q ${num_bins} -o "${edges}" "${data_bin}")
+    num_inputs=$(grep 'Inputs' <<<${data_range} | awk '{print $2}')
+else
+    data_range=$(bin/data_preprocessing "${data_bin}")
+    num_features=$(grep 'Num' <<<${data_range} | awk '{print $2}')
+    num_inputs=$((num_bins * num_features))
+fi
 label_count=$(sort -n <${data_dir}/labels.csv | uniq | wc -l)
 
 if [ ${f} -eq -1 ]; then
-    f=$((num_bins * num_features))
+    f=${num_inputs}
 fi
 
 echo ${s} ${p} ${f} ${c} ${o} ${r} ${num_bins} ${data_dir}
 
 bin/generate_reservoir \
+    --json \
     -s ${s} \
     -p ${p} \
     -f ${f} \
     -c ${c} \
     -o ${o} \
-    -r ${r} | framework-open/bin/network_tool >out.json
+    -r ${r} >out.json
 
-bin/grade \
+bin/grade ${edges:+--bin-edges "${edges}"} ${approx:+--approx "${approx}"} \
     out.json \
-    "${data_dir}"/data.csv \
-    "${data_dir}"/labels.csv \
+    "${data_bin}" \
+    - \
     ${cpu_threads} \
-    $(grep 'Min' <<<${data_range} | awk '{print $2}') \
-    $(grep 'Max' <<<${data_range} | awk '{print $2}') \
+    - \
+    - \
     ${num_bins} \
     ${label_count}
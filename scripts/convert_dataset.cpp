@@ -0,0 +1,37 @@
+#include "dataset.hpp"
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <unistd.h>
+
+int main(int argc, char* argv[]) {
+    if (argc != 4) {
+        fprintf(stderr,
+                "usage: %s data.csv labels.csv out.bin\n"
+                "Writes a binary dataset with the per-feature ranges "
+                "precomputed, which\n"
+                "classify, grade and predict map directly. labels.csv may be "
+                "- for unlabeled\n"
+                "data\n",
+                argv[0]);
+        exit(1);
+    }
+
+    const size_t num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    Dataset data;
+    std::string error;
+    if (!dataset_load(argv[1], argv[2], num_threads, data, error)) {
+        fprintf(stderr, "%s: main: %s\n", __FILE__, error.c_str());
+        exit(1);
+    }
+
+    if (!dataset_store(argv[3], data)) {
+        fprintf(stderr, "%s: main: Unable to write %s\n", __FILE__, argv[3]);
+        exit(1);
+    }
+
+    fprintf(stderr, "Wrote %zu rows of %zu features and %zu classes to %s\n",
+            data.rows, data.cols, data.num_classes, argv[3]);
+}
@@ -0,0 +1,169 @@
+#include "dataset.hpp"
+#include "encoder.hpp"
+#include "quantile_sketch.hpp"
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <getopt.h>
+#include <pthread.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+struct SketchChunk {
+    const Dataset* data;
+    size_t begin;
+    size_t end;
+    std::vector<QuantileSketch> sketches;
+};
+
+// Sketches every feature over one chunk of rows
+void* sketch_worker(void* arg) {
+    SketchChunk* c = (SketchChunk*)arg;
+
+    c->sketches.resize(c->data->cols);
+    for (size_t r = c->begin; r < c->end; r++) {
+        const double* row = c->data->row(r);
+        for (size_t i = 0; i < c->data->cols; i++) {
+            c->sketches[i].add(row[i]);
+        }
+    }
+
+    return nullptr;
+}
+
+void usage(const char* prog) {
+    fprintf(stderr,
+            "usage: %s [options] [data.csv] (default: stdin)\n"
+            "data.csv may also be a dataset written by convert_dataset\n"
+            "options:\n"
+            "  -q, --quantiles <num_bins>\n"
+            "                         Also split every feature into up to "
+            "num_bins bins of\n"
+            "                         equal mass, dropping constant features, "
+            "and print the\n"
+            "                         resulting number of input neurons\n"
+            "  -o, --edges <file>     Where -q writes the bin edges, for the "
+            "--bin-edges\n"
+            "                         option of classify and grade\n",
+            prog);
+    exit(1);
+}
+
+int main(int argc, char* argv[]) {
+    const char* prog = argv[0];
+    size_t quantile_bins = 0;
+    std::string edges_path;
+
+    static struct option long_options[] = {
+        {"quantiles", required_argument, 0, 'q'},
+        {"edges", required_argument, 0, 'o'},
+        {0, 0, 0, 0},
+    };
+
+    int c;
+    while ((c = getopt_long(argc, argv, "q:o:", long_options, nullptr)) != -1) {
+        switch (c) {
+        case 'q':
+            if (sscanf(optarg, "%zu", &quantile_bins) != 1 ||
+                quantile_bins == 0) {
+                usage(prog);
+            }
+            break;
+        case 'o':
+            edges_path = optarg;
+            break;
+        default:
+            usage(prog);
+        }
+    }
+
+    if (argc - optind > 1 || (quantile_bins != 0) != !edges_path.empty()) {
+        usage(prog);
+    }
+
+    const size_t num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    Dataset data;
+    std::string error;
+    bool ok;
+    if (argc - optind == 1) {
+        ok = dataset_load(argv[optind], "-", num_threads, data, error);
+    } else {
+        ok = csv_load_fd(STDIN_FILENO, num_threads, data.csv, error);
+        if (ok) {
+            dataset_adopt_csv(data);
+        }
+    }
+
+    if (!ok) {
+        fprintf(stderr, "%s: main: %s\n", __FILE__, error.c_str());
+        exit(1);
+    }
+
+    const size_t features = data.cols;
+    const double* mins = data.d_min;
+    const double* maxes = data.d_max;
+
+    printf("Min: [");
+    for (size_t i = 0; i < features; i++) {
+        printf("%f", mins[i]);
+
+        if (i != features - 1) {
+            printf(",");
+        }
+    }
+    printf("]\n");
+
+    printf("Max: [");
+    for (size_t i = 0; i < features; i++) {
+        printf("%f", maxes[i]);
+
+        if (i != features - 1) {
+            printf(",");
+        }
+    }
+    printf("]\n");
+
+    printf("Num: %zu\n", features);
+
+    if (quantile_bins == 0) {
+        return 0;
+    }
+
+    // One sketch per feature per chunk of rows, merged in chunk order so the
+    // edges do not depend on scheduling
+    const size_t num_chunks = std::max<size_t>(
+        1, std::min(num_threads, data.rows / 4096));
+    std::vector<SketchChunk> chunks(num_chunks);
+    std::vector<pthread_t> threads(num_chunks);
+    for (size_t t = 0; t < num_chunks; t++) {
+        chunks[t].data = &data;
+        chunks[t].begin = (data.rows * t) / num_chunks;
+        chunks[t].end = (data.rows * (t + 1)) / num_chunks;
+        pthread_create(&threads[t], nullptr, sketch_worker, &chunks[t]);
+    }
+
+    for (size_t t = 0; t < num_chunks; t++) {
+        pthread_join(threads[t], nullptr);
+    }
+
+    std::vector<std::vector<double>> edges(features);
+    for (size_t i = 0; i < features; i++) {
+        QuantileSketch& s = chunks[0].sketches[i];
+        for (size_t t = 1; t < num_chunks; t++) {
+            s.merge(chunks[t].sketches[i]);
+        }
+        edges[i] = s.edges(quantile_bins);
+    }
+
+    if (!encoder_edges_store(edges_path, edges)) {
+        fprintf(stderr, "%s: main: Unable to write %s\n", __FILE__,
+                edges_path.c_str());
+        exit(1);
+    }
+
+    const SpikeEncoder encoder(edges);
+    printf("Inputs: %zu\n", encoder.num_inputs());
+    printf("Dropped: %zu\n", features - encoder.width());
+}
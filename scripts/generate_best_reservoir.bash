@@ -8,10 +8,13 @@ p="0.025"
 c="64"
 o="0.3"
 N=10
-num_bins="-b 10"
+num_bins=10
 output_file="best_reservoir.json"
+quantile=0
+tune=''
+refine=''
 
-while getopts "s:p:f:c:o:b:n:w:" opt; do
+while getopts "s:p:f:c:o:b:n:w:qt:m:" opt; do
     case ${opt} in
     s)
         s="${OPTARG}"
@@ -34,6 +37,15 @@ while getopts "s:p:f:c:o:b:n:w:" opt; do
     w)
         output_file="${OPTARG}"
         ;;
+    q)
+        quantile=1
+        ;;
+    t)
+        tune="${OPTARG}"
+        ;;
+    m)
+        refine="${OPTARG}"
+        ;;
     \?)
         echo "Usage: $0 [options] <data_directory>"
         echo "Options:"
@@ -45,6 +57,9 @@ while getopts "s:p:f:c:o:b:n:w:" opt; do
         echo "  -b <num_bins>                Number of bins"
         echo "  -n <num_tests>               Number of reservoirs to generate (default: 10)"
         echo "  -w <output_file>             Output file for best reservoir (default: best_reservoir.json)"
+        echo "  -q                           Bin at quantiles instead of uniformly"
+        echo "  -t <configs>                 Also tune -s, -p, -c, -o and -b from this many configurations"
+        echo "  -m <rounds>                  Refine the best reservoir by this many rounds of mutations"
         exit 1
         ;;
     esac
@@ -61,54 +76,47 @@ if [ -z "$data_dir" ]; then
     echo "  -o <output_weight>           Output weight"
     echo "  -b <num_bins>                Number of bins"
     echo "  -n <num_tests>               Number of reservoirs to generate (default: 10)"
+    echo "  -q                           Bin at quantiles instead of uniformly"
+    echo "  -t <configs>                 Also tune -s, -p, -c, -o and -b from this many configurations"
+    echo "  -m <rounds>                  Refine the best reservoir by this many rounds of mutations"
     exit 1
 fi
 
-data_range=$(bin/data_preprocessing <${data_dir}/data.csv)
-num_features=$(grep 'Num' <<<${data_range} | awk '{print $2}')
-label_count=$(sort -n <${data_dir}/labels.csv | uniq | wc -l)
-
-best_seed=-1
-deltas=()
-best_min=0
-for i in $(seq 1 $N); do
-    seed=$((RANDOM % 65563))
-
-    printf '\0331\rGenerating Reservoir %d/%d' $((i)) $((N))
-    out=$(bash ./scripts/calculate_grade.bash -s "${s}" -p "${p}" -f $((num_features * num_bins)) -c "${c}" -o "${o}" -b "${num_bins}" -r ${seed} ${data_dir})
-
-    if ! grep -q "INVALID" <<<"$out"; then
-        if [[ $best_seed -eq -1 ]]; then
-            best_seed=${seed}
-            deltas=($(awk '{print $5}' <<<"$(tail -n $label_count <<<"$out")"))
-            best_min=$(awk 'BEGIN {min = 1.0} {if ($5 < min) { min = $5 }} END {print min}' <<<"$(tail -n "${label_count}" <<<"${out}")")
-        else
-            tmp_deltas=($(awk '{print $5}' <<<"$(tail -n $label_count <<<"$out")"))
-            tmp_min=$(awk 'BEGIN {min = 1.0} {if ($5 < min) { min = $5 }} END {print min}' <<<"$(tail -n "${label_count}" <<<"${out}")")
-            if (($(bc -l <<<"$tmp_min > $best_min"))); then
-                best_seed=${seed}
-                deltas=(${tmp_deltas[@]})
-            fi
-        fi
-
-    fi
-done
-
-printf '\n'
+# Converted once, later runs map it and reuse its precomputed ranges
+data_bin="${data_dir}"/data.bin
+if [ ! -f "${data_bin}" ] || [ "${data_dir}"/data.csv -nt "${data_bin}" ] ||
+    [ "${data_dir}"/labels.csv -nt "${data_bin}" ]; then
+    bin/convert_dataset "${data_dir}"/data.csv "${data_dir}"/labels.csv "${data_bin}"
+fi
 
-if [[ $best_seed -eq -1 ]]; then
-    echo "No valid reservoir generated in $N tests."
-    exit 1
+edges=''
+if [ ${quantile} -eq 1 ]; then
+    edges="${data_dir}"/edges_${num_bins}.txt
+    bin/data_preprocessing -q ${num_bins} -o "${edges}" "${data_bin}" >/dev/null
 fi
 
-echo ""
-echo "Best seed: $best_seed"
-echo ""
-echo "Smallest Deltas:"
-for i in $(seq 0 $((label_count - 1))); do
-    echo "Class $i: ${deltas[i]}"
-done
-echo ""
+label_count=$(sort -n <${data_dir}/labels.csv | uniq | wc -l)
+
+# Every seed is generated, simulated and graded inside bin/search, which
+# ranks them all in the report, or with -t lists the Pareto front of the
+# configurations it tried
+report="${output_file%.json}.report"
+bin/search ${edges:+--bin-edges "${edges}"} \
+    ${tune:+--tune ${tune}} \
+    ${refine:+--refine ${refine}} \
+    -n ${N} \
+    -r $((RANDOM % 65563)) \
+    -s ${s} \
+    -p ${p} \
+    -c ${c} \
+    -o ${o} \
+    -w "${output_file}" \
+    "${data_bin}" \
+    - \
+    $(nproc) \
+    - \
+    - \
+    ${num_bins} \
+    ${label_count} >"${report}"
 
-rm out.json
-bin/generate_reservoir -s ${s} -p ${p} -f $((num_features * num_bins)) -c ${c} -o ${o} -r $best_seed | framework-open/bin/network_tool >${output_file}
+echo "Report written to ${report}"
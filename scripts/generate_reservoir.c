@@ -1,12 +1,17 @@
 // Generates a resevoir in 2D space allowing us to consider distance between
-// neurons Then the network representation is converted to a TENNLab network
+// neurons Then the network representation is converted to a TENNLab network,
+// either as network_tool commands or, with --json, as the network JSON itself
 
+#include "generator_core.h"
 #include <getopt.h>
 #include <math.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <unistd.h>
 
 #define log_fatal(fmt, ...)                                                    \
     do {                                                                       \
@@ -14,30 +19,130 @@
         exit(1);                                                               \
     } while (false)
 
-typedef struct Neuron {
-    double x;
-    double y;
-    size_t* connections;
-    size_t num_connections;
-    size_t cap_connections;
-} Neuron;
-
-const char* empty_network =
-    "{\"Associated_Data\":{\"other\":{\"proc_name\":\"risp\"},\"proc_params\":{"
-    "\"discrete\":true,\"leak_mode\":\"configurable\",\"spike_value_factor\":"
-    "255,\"max_delay\":15,\"max_"
-    "threshold\":255,\"max_weight\":255,\"min_potential\":-255,"
-    "\"min_threshold\":"
-    "1,\"min_weight\":-255}},\"Edges\":[],\"Inputs\":[],\"Network_Values\":[],"
-    "\"Nodes\":[],\"Outputs\":[],\"Properties\":{\"edge_properties\":[{"
-    "\"index\":1,\"max_value\":15,\"min_value\":1,\"name\":\"Delay\",\"size\":"
-    "1,\"type\":73},{\"index\":0,\"max_value\":255,\"min_value\":-255,\"name\":"
-    "\"Weight\",\"size\":1,\"type\":73}],\"network_properties\":[],\"node_"
-    "properties\":[{\"index\":0,\"max_value\":255,\"min_value\":1,"
-    "\"name\":"
-    "\"Threshold\",\"size\":1,\"type\":73},{\"index\":1,\"max_value\":1,\"min_"
-    "value\":0,\"name\":"
-    "\"Leak\",\"size\":1,\"type\":66}]}}";
+const char* empty_network = NETWORK_EMPTY;
+
+bool json_output = false;
+size_t nodes_written = 0;
+size_t edges_written = 0;
+
+// Writes the ids first to last - 1 as a JSON list or a command's arguments
+void emit_range(size_t first, size_t last) {
+    for (size_t i = first; i < last; i++) {
+        if (json_output) {
+            printf(i == first ? "%zu" : ",%zu", i);
+        } else {
+            printf("%zu ", i);
+        }
+    }
+}
+
+// Starts the network: the JSON up to its first node, or the commands that load
+// the network and add every node, input and output
+void begin_network(const char* filename, size_t feature_neurons,
+                   size_t class_start, size_t num_nodes) {
+    // Several MB of output for large reservoirs
+    setvbuf(stdout, nullptr, _IOFBF, 1 << 20);
+
+    if (json_output) {
+        printf("{" NETWORK_PROPERTIES ",\n\"Nodes\":[");
+        return;
+    }
+
+    if (filename) {
+        printf("FJ %s\n", filename);
+    } else {
+        printf("FJ\n");
+        printf("%s\n", empty_network);
+    }
+
+    // Add network inputs
+    printf("AN ");
+    emit_range(0, feature_neurons);
+    printf("\n");
+
+    printf("AI ");
+    emit_range(0, feature_neurons);
+    printf("\n");
+
+    // Build resevoir
+    printf("AN ");
+    emit_range(feature_neurons, class_start);
+    printf("\n");
+
+    // Add network outputs
+    printf("AN ");
+    emit_range(class_start, num_nodes);
+    printf("\n");
+
+    printf("AO ");
+    emit_range(class_start, num_nodes);
+    printf("\n");
+
+    printf("SNP_ALL Leak 1\n");
+}
+
+// Nodes must be written in id order, all of them before any edge
+void write_node(size_t id, int threshold, int leak) {
+    if (json_output) {
+        printf("%s\n{\"id\":%zu,\"values\":[%d,%d]}",
+               nodes_written++ ? "," : "", id, threshold, leak);
+        return;
+    }
+
+    printf("SNP %zu Threshold %d\n", id, threshold);
+    if (leak != 1) {
+        printf("SNP %zu Leak %d\n", id, leak);
+    }
+}
+
+void write_edge(size_t pre, size_t post, int weight, int delay) {
+    if (json_output) {
+        printf("%s%s\n{\"from\":%zu,\"to\":%zu,\"values\":[%d,%d]}",
+               edges_written ? "" : "],\n\"Edges\":[",
+               edges_written ? "," : "", pre, post, weight, delay);
+        edges_written++;
+        return;
+    }
+
+    printf("AE %zu %zu\n", pre, post);
+    printf("SEP %zu %zu Weight %d\n", pre, post, weight);
+    printf("SEP %zu %zu Delay %d\n", pre, post, delay);
+}
+
+void end_network(size_t feature_neurons, size_t class_start, size_t num_nodes) {
+    if (!json_output) {
+        printf("TJ\n");
+        return;
+    }
+
+    printf("%s],\n\"Inputs\":[", edges_written ? "" : "],\n\"Edges\":[");
+    emit_range(0, feature_neurons);
+    printf("],\n\"Outputs\":[");
+    emit_range(class_start, num_nodes);
+    printf("],\n\"Network_Values\":[],\n" NETWORK_ASSOCIATED_DATA "}\n");
+}
+
+// The network goes to stdout, the sink's context is the network file given
+static int sink_rand(void* ctx) {
+    (void)ctx;
+    return rand();
+}
+
+static void sink_begin(void* ctx, size_t feature_neurons, size_t class_start,
+                       size_t num_nodes) {
+    begin_network((const char*)ctx, feature_neurons, class_start, num_nodes);
+}
+
+static void sink_node(void* ctx, size_t id, int threshold, int leak) {
+    (void)ctx;
+    write_node(id, threshold, leak);
+}
+
+static void sink_edge(void* ctx, size_t pre, size_t post, int weight,
+                      int delay) {
+    (void)ctx;
+    write_edge(pre, post, weight, delay);
+}
 
 int main(int argc, char* argv[]) {
     size_t resevoir_size = 100;
@@ -47,6 +152,9 @@ int main(int argc, char* argv[]) {
     size_t feature_neurons = 16;
     size_t class_neurons = 3;
     char* filename = nullptr;
+    bool grid = false;
+    double radius = INFINITY;
+    size_t num_threads = sysconf(_SC_NPROCESSORS_ONLN);
 
     unsigned int seed;
     FILE* rng = fopen("/dev/random", "r");
@@ -67,10 +175,14 @@ int main(int argc, char* argv[]) {
             {"feature_neurons", required_argument, 0, 'f'},
             {"class_neurons", required_argument, 0, 'c'},
             {"seed", required_argument, 0, 'r'},
+            {"json", no_argument, 0, 'j'},
+            {"grid", no_argument, 0, 'g'},
+            {"radius", required_argument, 0, 'R'},
+            {"threads", required_argument, 0, 't'},
             {0, 0, 0, 0},
         };
 
-        c = getopt_long(argc, argv, "s:i:o:p:f:c:r:", long_options,
+        c = getopt_long(argc, argv, "s:i:o:p:f:c:r:j", long_options,
                         &option_index);
 
         if (c == -1) {
@@ -119,6 +231,24 @@ int main(int argc, char* argv[]) {
         case 'r':
             seed = strtoul(optarg, nullptr, 0);
             break;
+        case 'j':
+            json_output = true;
+            break;
+        case 'g':
+            grid = true;
+            break;
+        case 'R':
+            radius = strtod(optarg, nullptr);
+            if (radius <= 0.0) {
+                log_fatal("Radius must be greater than 0\n");
+            }
+            break;
+        case 't':
+            num_threads = strtoull(optarg, nullptr, 0);
+            if (num_threads == 0) {
+                log_fatal("Need at least 1 thread\n");
+            }
+            break;
         case '?':
             break;
         default:
@@ -135,142 +265,37 @@ int main(int argc, char* argv[]) {
         }
 
         filename = argv[optind];
-    }
-
-    Neuron* neurons = calloc(resevoir_size, sizeof(Neuron));
-    size_t input_neurons = 0;
-    size_t output_neurons = 0;
-
-    for (size_t i = 0; i < resevoir_size; i++) {
-        neurons[i] = (Neuron){.x = rand() / (double)RAND_MAX,
-                              .y = rand() / (double)RAND_MAX,
-                              .connections = calloc(20, sizeof(size_t)),
-                              .num_connections = 0,
-                              .cap_connections = 20};
-        if (neurons[i].y < input_percent) {
-            input_neurons++;
-        }
-        if (neurons[i].y > output_percent) {
-            output_neurons++;
+        if (json_output) {
+            log_fatal("--json always starts from the empty network, it cannot "
+                      "read %s\n",
+                      filename);
         }
     }
 
-    for (size_t i = 0; i < resevoir_size; i++) {
-        for (size_t j = 0; j < resevoir_size; j++) {
-            // Calculate distance to the other neuron
-            double distance = sqrt(pow(neurons[i].x - neurons[j].x, 2) +
-                                   pow(neurons[i].y - neurons[j].y, 2));
-
-            // We'll use the distance to determine how likely a connection is
-            if ((double)rand() / RAND_MAX < connection_chance * distance) {
-                if (neurons[i].num_connections >= neurons[i].cap_connections) {
-                    // Realloc
-                    neurons[i].connections = realloc(
-                        neurons[i].connections,
-                        (neurons[i].cap_connections * 2) * sizeof(size_t));
-                    neurons[i].cap_connections *= 2;
-                }
-
-                neurons[i].connections[neurons[i].num_connections++] = j;
-            }
-        }
+    if (!grid && radius != INFINITY) {
+        log_fatal("--radius only applies to --grid\n");
     }
 
-    if (filename) {
-        printf("FJ %s\n", filename);
-    } else {
-        printf("FJ\n");
-        printf("%s\n", empty_network);
-    }
-
-    // Add network inputs
-    printf("AN ");
-    for (size_t i = 0; i < feature_neurons; i++) {
-        printf("%zu ", i);
-    }
-    printf("\n");
-
-    printf("AI ");
-    for (size_t i = 0; i < feature_neurons; i++) {
-        printf("%zu ", i);
-    }
-    printf("\n");
-
-    // Build resevoir
-    printf("AN ");
-    for (size_t i = feature_neurons; i < feature_neurons + resevoir_size; i++) {
-        printf("%zu ", i);
-    }
-    printf("\n");
-
-    // Add network outputs
-    printf("AN ");
-    for (size_t i = feature_neurons + resevoir_size;
-         i < feature_neurons + resevoir_size + class_neurons; i++) {
-        printf("%zu ", i);
-    }
-    printf("\n");
-
-    printf("AO ");
-    for (size_t i = feature_neurons + resevoir_size;
-         i < feature_neurons + resevoir_size + class_neurons; i++) {
-        printf("%zu ", i);
-    }
-    printf("\n");
-
-    printf("SNP_ALL Leak 1\n");
-
-    for (size_t i = 0; i < feature_neurons + resevoir_size; i++) {
-        printf("SNP %zu Threshold %d\n", i, rand() % 255 + 1);
-    }
-    for (size_t i = feature_neurons + resevoir_size;
-         i < feature_neurons + resevoir_size + class_neurons; i++) {
-        printf("SNP %zu Threshold %d\n", i, rand() % 255 + 1);
-        printf("SNP %zu Leak %d\n", i, 0);
-    }
-
-    // Connect feature neurons to input
-    for (size_t i = 0; i < feature_neurons; i++) {
-        for (size_t j = 0; j < resevoir_size; j++) {
-            if (neurons[j].y >= input_percent) {
-                continue;
-            }
-
-            printf("AE %zu %zu\n", i, feature_neurons + j);
-            printf("SEP %zu %zu Weight %d\n", i, feature_neurons + j,
-                   (((rand() % 2) * 2) - 1) * rand() % 256);
-            printf("SEP %zu %zu Delay %d\n", i, feature_neurons + j,
-                   rand() % 15 + 1);
-        }
-    }
-
-    // Connect resevoir neurons to each other
-    for (size_t i = 0; i < resevoir_size; i++) {
-        for (size_t j = 0; j < neurons[i].num_connections; j++) {
-            size_t pre = feature_neurons + i;
-            size_t post = feature_neurons + neurons[i].connections[j];
-            printf("AE %zu %zu\n", pre, post);
-            printf("SEP %zu %zu Weight %d\n", pre, post,
-                   (((rand() % 2) * 2) - 1) * rand() % 256);
-            printf("SEP %zu %zu Delay %d\n", pre, post, rand() % 15 + 1);
-        }
-    }
-
-    // Connect output resevoir neurons to class neurons
-    for (size_t i = feature_neurons + resevoir_size;
-         i < feature_neurons + resevoir_size + class_neurons; i++) {
-        for (size_t j = 0; j < resevoir_size; j++) {
-            if (neurons[j].y <= output_percent) {
-                continue;
-            }
-
-            printf("AE %zu %zu\n", feature_neurons + j, i);
-            printf("SEP %zu %zu Weight %d\n", feature_neurons + j, i,
-                   (((rand() % 2) * 2) - 1) * rand() % 256);
-            printf("SEP %zu %zu Delay %d\n", feature_neurons + j, i,
-                   rand() % 15 + 1);
-        }
+    if (grid && (resevoir_size == 0 || resevoir_size > UINT32_MAX)) {
+        log_fatal("--grid needs a reservoir of 1 to %u neurons\n", UINT32_MAX);
     }
 
-    printf("TJ\n");
+    const GeneratorParams params = {.size = resevoir_size,
+                                    .input_percent = input_percent,
+                                    .output_percent = output_percent,
+                                    .connection_chance = connection_chance,
+                                    .feature_neurons = feature_neurons,
+                                    .class_neurons = class_neurons,
+                                    .grid = grid,
+                                    .radius = radius,
+                                    .num_threads = num_threads};
+    const GeneratorSink sink = {.ctx = filename,
+                                .rand = sink_rand,
+                                .begin = sink_begin,
+                                .node = sink_node,
+                                .edge = sink_edge};
+    generator_run(&params, seed, &sink);
+
+    const size_t class_start = feature_neurons + resevoir_size;
+    end_network(feature_neurons, class_start, class_start + class_neurons);
 }
@@ -9,8 +9,11 @@ epochs=1000000
 lambda=0.00000001
 num_bins=10
 input_file="best_reservoir.json"
+cache_dir=""
+solver="sgd"
+quantile=0
 
-while getopts "r:t:e:l:b:i:" opt; do
+while getopts "r:t:e:l:b:i:c:s:q" opt; do
     case ${opt} in
     r)
         learning_rate=${OPTARG}
@@ -30,6 +33,15 @@ while getopts "r:t:e:l:b:i:" opt; do
     i)
         input_file=${OPTARG}
         ;;
+    c)
+        cache_dir=${OPTARG}
+        ;;
+    s)
+        solver=${OPTARG}
+        ;;
+    q)
+        quantile=1
+        ;;
     \?)
         echo "Usage: $0 [options] <data_directory>"
         echo "Options:"
@@ -39,6 +51,9 @@ while getopts "r:t:e:l:b:i:" opt; do
         echo "  -l <lambda>            Regularization parameter (default: 0.00000001)"
         echo "  -b <num_bins>          Number of bins (default: 10)"
         echo "  -i <input_file>        Input file (default: best_reservoir.json)"
+        echo "  -c <cache_dir>         Reuse reservoir features cached in <cache_dir>"
+        echo "  -s <solver>            Readout solver, sgd or ridge (default: sgd)"
+        echo "  -q                     Bin at quantiles instead of uniformly"
         exit 1
         ;;
     esac
@@ -55,18 +70,36 @@ if [ -z "$data_dir" ]; then
     echo "  -l <lambda>            Regularization parameter (default: 0.00000001)"
     echo "  -b <num_bins>          Number of bins (default: 10)"
     echo "  -i <input_file>        Input file (default: best_reservoir.json)"
+    echo "  -c <cache_dir>         Reuse reservoir features cached in <cache_dir>"
+    echo "  -s <solver>            Readout solver, sgd or ridge (default: sgd)"
+    echo "  -q                     Bin at quantiles instead of uniformly"
     exit 1
 fi
 
-data_range=$(bin/data_preprocessing <${data_dir}/data.csv)
+# Converted once, later runs map it and reuse its precomputed ranges
+data_bin="${data_dir}"/data.bin
+if [ ! -f "${data_bin}" ] || [ "${data_dir}"/data.csv -nt "${data_bin}" ] ||
+    [ "${data_dir}"/labels.csv -nt "${data_bin}" ]; then
+    bin/convert_dataset "${data_dir}"/data.csv "${data_dir}"/labels.csv "${data_bin}"
+fi
+
+# The same edges calculate_grade.bash -q sized the reservoir for
+edges=''
+if [ ${quantile} -eq 1 ]; then
+    edges="${data_dir}"/edges_${num_bins}.txt
+    bin/data_preprocessing -q ${num_bins} -o "${edges}" "${data_bin}" >/dev/null
+fi
+
 label_count=$(sort -n <${data_dir}/labels.csv | uniq | wc -l)
-bin/classify $input_file \
-    "${data_dir}"/data.csv \
-    "${data_dir}"/labels.csv \
+bin/classify ${cache_dir:+--cache-dir "${cache_dir}"} --solver "${solver}" \
+    ${edges:+--bin-edges "${edges}"} \
+    $input_file \
+    "${data_bin}" \
+    - \
     ${learning_rate} \
     ${cpu_threads} \
     ${epochs} \
     ${lambda} \
-    $(grep 'Min' <<<${data_range} | awk '{print $2}') \
-    $(grep 'Max' <<<${data_range} | awk '{print $2}') \
+    - \
+    - \
     ${num_bins} "${label_count}"
@@ -0,0 +1,324 @@
+#pragma once
+
+// Dataset loader shared by classify, grade, predict and data_preprocessing.
+// The file is mapped rather than read, split into one chunk of whole lines per
+// thread, and every chunk is parsed with from_chars straight into its place in
+// a single contiguous row-major matrix. Values may be separated by commas,
+// spaces or tabs, blank lines are skipped and every other line must have the
+// same number of values.
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+struct CsvMatrix {
+    size_t rows = 0;
+    size_t cols = 0;
+    std::vector<double> values;
+
+    double* row(size_t i) { return values.data() + (i * cols); }
+    const double* row(size_t i) const { return values.data() + (i * cols); }
+};
+
+static inline bool csv_is_separator(char c) {
+    return c == ',' || c == ' ' || c == '\t' || c == '\r';
+}
+
+// Parses the values in [p, end) into `out`, returning how many there were, or
+// SIZE_MAX if something other than a number was found. At most `capacity`
+// values are written but all of them are counted
+static inline size_t csv_parse_line(const char* p, const char* end,
+                                    double* out, size_t capacity) {
+    size_t n = 0;
+    while (true) {
+        while (p < end && csv_is_separator(*p)) {
+            p++;
+        }
+        if (p == end) {
+            return n;
+        }
+
+        double v;
+        std::from_chars_result r = std::from_chars(p, end, v);
+        if (r.ec != std::errc() || (r.ptr < end && !csv_is_separator(*r.ptr))) {
+            return SIZE_MAX;
+        }
+
+        if (n < capacity) {
+            out[n] = v;
+        }
+        n++;
+        p = r.ptr;
+    }
+}
+
+static inline bool csv_parse_line(const char* p, const char* end,
+                                  std::vector<double>& out) {
+    const size_t n = csv_parse_line(p, end, nullptr, 0);
+    if (n == SIZE_MAX) {
+        out.clear();
+        return false;
+    }
+
+    out.resize(n);
+    csv_parse_line(p, end, out.data(), out.size());
+    return true;
+}
+
+static inline bool csv_is_blank(const char* p, const char* end) {
+    for (; p < end; p++) {
+        if (!csv_is_separator(*p)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+struct CsvChunk {
+    const char* begin;
+    const char* end;
+    size_t first_row;
+    size_t rows;
+    CsvMatrix* m;
+    // First line in this chunk that failed to parse, or SIZE_MAX
+    size_t bad_row;
+};
+
+static inline void* csv_count_worker(void* arg) {
+    CsvChunk* c = (CsvChunk*)arg;
+
+    c->rows = 0;
+    for (const char* p = c->begin; p < c->end;) {
+        const char* nl = (const char*)memchr(p, '\n', c->end - p);
+        const char* eol = nl ? nl : c->end;
+        c->rows += !csv_is_blank(p, eol);
+        p = eol + 1;
+    }
+
+    return nullptr;
+}
+
+static inline void* csv_parse_worker(void* arg) {
+    CsvChunk* c = (CsvChunk*)arg;
+    const size_t cols = c->m->cols;
+
+    size_t row = c->first_row;
+    c->bad_row = SIZE_MAX;
+    for (const char* p = c->begin; p < c->end;) {
+        const char* nl = (const char*)memchr(p, '\n', c->end - p);
+        const char* eol = nl ? nl : c->end;
+        if (!csv_is_blank(p, eol)) {
+            if (csv_parse_line(p, eol, c->m->row(row), cols) != cols) {
+                c->bad_row = row;
+                break;
+            }
+            row++;
+        }
+        p = eol + 1;
+    }
+
+    return nullptr;
+}
+
+// Runs `fn` over every chunk, on the calling thread when there is only one
+static inline void csv_run(std::vector<CsvChunk>& chunks, void* (*fn)(void*)) {
+    std::vector<pthread_t> threads(chunks.size());
+    for (size_t i = 1; i < chunks.size(); i++) {
+        pthread_create(&threads[i], nullptr, fn, &chunks[i]);
+    }
+
+    fn(&chunks[0]);
+
+    for (size_t i = 1; i < chunks.size(); i++) {
+        pthread_join(threads[i], nullptr);
+    }
+}
+
+static inline bool csv_parse(const char* data, size_t size, size_t num_threads,
+                             CsvMatrix& m, std::string& error) {
+    const char* end = data + size;
+    m.rows = 0;
+    m.cols = 0;
+    m.values.clear();
+
+    // The first non-blank line decides how many columns there are
+    for (const char* p = data; p < end;) {
+        const char* nl = (const char*)memchr(p, '\n', end - p);
+        const char* eol = nl ? nl : end;
+        if (!csv_is_blank(p, eol)) {
+            m.cols = csv_parse_line(p, eol, nullptr, 0);
+            break;
+        }
+        p = eol + 1;
+    }
+
+    if (m.cols == 0) {
+        return true;
+    }
+    if (m.cols == SIZE_MAX) {
+        m.cols = 0;
+        error = "row 1 is not numeric";
+        return false;
+    }
+
+    // Chunks end on a line boundary so no line is split between threads
+    num_threads = std::max<size_t>(1, std::min(num_threads, size / 65536 + 1));
+    std::vector<CsvChunk> chunks(num_threads);
+    const char* p = data;
+    for (size_t i = 0; i < num_threads; i++) {
+        const char* e = i == num_threads - 1 ? end : data + (size * (i + 1)) /
+                                                                num_threads;
+        e = std::max(e, p);
+        if (e < end) {
+            const char* nl = (const char*)memchr(e, '\n', end - e);
+            e = nl ? nl + 1 : end;
+        }
+
+        chunks[i].begin = p;
+        chunks[i].end = e;
+        chunks[i].m = &m;
+        p = e;
+    }
+
+    csv_run(chunks, csv_count_worker);
+
+    for (CsvChunk& c : chunks) {
+        c.first_row = m.rows;
+        m.rows += c.rows;
+    }
+
+    m.values.resize(m.rows * m.cols);
+    csv_run(chunks, csv_parse_worker);
+
+    for (const CsvChunk& c : chunks) {
+        if (c.bad_row != SIZE_MAX) {
+            error = "row " + std::to_string(c.bad_row + 1) + " does not have " +
+                    std::to_string(m.cols) + " numeric values";
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Loads an already open file, which may also be a pipe (e.g. stdin)
+static inline bool csv_load_fd(int fd, size_t num_threads, CsvMatrix& m,
+                               std::string& error) {
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        error = strerror(errno);
+        return false;
+    }
+
+    if (S_ISREG(st.st_mode)) {
+        if (st.st_size == 0) {
+            return csv_parse(nullptr, 0, num_threads, m, error);
+        }
+
+        void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            error = strerror(errno);
+            return false;
+        }
+
+        // Every chunk is read at once, so ask for all of it up front
+        madvise(map, st.st_size, MADV_WILLNEED);
+        const bool ok =
+            csv_parse((const char*)map, st.st_size, num_threads, m, error);
+        munmap(map, st.st_size);
+        return ok;
+    }
+
+    std::vector<char> buf;
+    char block[65536];
+    ssize_t n;
+    while ((n = read(fd, block, sizeof(block))) > 0) {
+        buf.insert(buf.end(), block, block + n);
+    }
+    if (n < 0) {
+        error = strerror(errno);
+        return false;
+    }
+
+    return csv_parse(buf.data(), buf.size(), num_threads, m, error);
+}
+
+static inline bool csv_load(const std::string& path, size_t num_threads,
+                            CsvMatrix& m, std::string& error) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        error = path + ": " + strerror(errno);
+        return false;
+    }
+
+    const bool ok = csv_load_fd(fd, num_threads, m, error);
+    close(fd);
+    if (!ok) {
+        error = path + ": " + error;
+    }
+
+    return ok;
+}
+
+// One non-negative integer label per line
+static inline bool csv_load_labels(const std::string& path, size_t num_threads,
+                                   std::vector<int32_t>& labels,
+                                   std::string& error) {
+    CsvMatrix m;
+    if (!csv_load(path, num_threads, m, error)) {
+        return false;
+    }
+
+    if (m.rows > 0 && m.cols != 1) {
+        error = path + ": expected one label per line";
+        return false;
+    }
+
+    labels.resize(m.rows);
+    for (size_t i = 0; i < m.rows; i++) {
+        const double v = m.values[i];
+        if (!(v >= 0 && v <= INT32_MAX && v == std::floor(v))) {
+            error = path + ": line " + std::to_string(i + 1) + ": label " +
+                    std::to_string(v) + " is not a non-negative integer";
+            return false;
+        }
+        labels[i] = (int32_t)v;
+    }
+
+    return true;
+}
+
+// Loads a data file and its labels, which must have one line per row
+static inline bool csv_load_dataset(const std::string& data_path,
+                                    const std::string& labels_path,
+                                    size_t num_threads, CsvMatrix& m,
+                                    std::vector<int32_t>& labels,
+                                    std::string& error) {
+    if (!csv_load(data_path, num_threads, m, error) ||
+        !csv_load_labels(labels_path, num_threads, labels, error)) {
+        return false;
+    }
+
+    if (labels.size() != m.rows) {
+        error = data_path + " has " + std::to_string(m.rows) + " rows but " +
+                labels_path + " has " + std::to_string(labels.size()) +
+                " labels";
+        return false;
+    }
+
+    return true;
+}
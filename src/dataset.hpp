@@ -0,0 +1,280 @@
+#pragma once
+
+// Binary dataset files written by convert_dataset, and a loader that accepts
+// either those or a data.csv/labels.csv pair. A binary file is mapped and used
+// in place, and carries the per-feature ranges the encoders need, so neither
+// the text nor the ranges have to be parsed again on every run.
+//
+// File layout (native endianness):
+//   DatasetHeader
+//   double  d_min[cols]
+//   double  d_max[cols]
+//   double  x[rows * cols]   row-major, one observation per row
+//   int32_t y[num_labels]    num_labels is either rows or 0
+
+#include "csv.hpp"
+#include <cfloat>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+static const char dataset_magic[8] = {'P', 'D', 'L', 'D', 'A', 'T', 'A', '1'};
+
+struct DatasetHeader {
+    char magic[8];
+    uint64_t rows;
+    uint64_t cols;
+    uint64_t num_labels;
+    // One more than the largest label, 0 without labels
+    uint64_t num_classes;
+};
+
+struct Dataset {
+    size_t rows = 0;
+    size_t cols = 0;
+    size_t num_classes = 0;
+    const double* x = nullptr;
+    // nullptr when the dataset has no labels
+    const int32_t* y = nullptr;
+    const double* d_min = nullptr;
+    const double* d_max = nullptr;
+
+    Dataset() = default;
+    Dataset(const Dataset&) = delete;
+    Dataset& operator=(const Dataset&) = delete;
+    ~Dataset() { release(); }
+
+    const double* row(size_t i) const { return x + (i * cols); }
+
+    void release() {
+        if (map) {
+            munmap(map, map_size);
+        }
+
+        map = nullptr;
+        map_size = 0;
+        csv = CsvMatrix();
+        labels.clear();
+        mins.clear();
+        maxes.clear();
+        x = nullptr;
+        y = nullptr;
+        d_min = nullptr;
+        d_max = nullptr;
+        rows = 0;
+        cols = 0;
+        num_classes = 0;
+    }
+
+    // Backing storage for datasets loaded from text
+    CsvMatrix csv;
+    std::vector<int32_t> labels;
+    std::vector<double> mins;
+    std::vector<double> maxes;
+
+    void* map = nullptr;
+    size_t map_size = 0;
+};
+
+static inline bool dataset_is_binary(const std::string& path) {
+    char magic[sizeof(dataset_magic)];
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f) {
+        return false;
+    }
+
+    const bool binary = fread(magic, sizeof(magic), 1, f) == 1 &&
+                        memcmp(magic, dataset_magic, sizeof(magic)) == 0;
+    fclose(f);
+    return binary;
+}
+
+// Labels must be non-negative, as csv_load_labels and dataset_map make sure
+static inline void dataset_set_labels(Dataset& d, std::vector<int32_t>& labels) {
+    d.labels.swap(labels);
+    d.y = d.labels.data();
+    d.num_classes = 0;
+    for (int32_t l : d.labels) {
+        d.num_classes = std::max(d.num_classes, (size_t)l + 1);
+    }
+}
+
+static inline bool dataset_map(const std::string& path, Dataset& d,
+                               std::string& error) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        error = path + ": " + strerror(errno);
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(DatasetHeader)) {
+        close(fd);
+        error = path + ": truncated dataset";
+        return false;
+    }
+
+    void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        error = path + ": " + strerror(errno);
+        return false;
+    }
+
+    const DatasetHeader* h = (const DatasetHeader*)map;
+    const size_t expected = sizeof(*h) + (2 * h->cols * sizeof(double)) +
+                            (h->rows * h->cols * sizeof(double)) +
+                            (h->num_labels * sizeof(int32_t));
+    if (memcmp(h->magic, dataset_magic, sizeof(h->magic)) != 0 ||
+        (h->num_labels != 0 && h->num_labels != h->rows) ||
+        (size_t)st.st_size != expected) {
+        munmap(map, st.st_size);
+        error = path + ": not a valid dataset";
+        return false;
+    }
+
+    d.map = map;
+    d.map_size = st.st_size;
+    d.rows = h->rows;
+    d.cols = h->cols;
+    d.num_classes = h->num_classes;
+    d.d_min = (const double*)((const char*)map + sizeof(*h));
+    d.d_max = d.d_min + d.cols;
+    d.x = d.d_max + d.cols;
+    d.y = h->num_labels ? (const int32_t*)(d.x + (d.rows * d.cols)) : nullptr;
+
+    for (size_t i = 0; d.y && i < d.rows; i++) {
+        if (d.y[i] < 0 || (uint64_t)d.y[i] >= d.num_classes) {
+            error = path + ": label " + std::to_string(d.y[i]) + " of row " +
+                    std::to_string(i + 1) + " is not a class below " +
+                    std::to_string(d.num_classes);
+            d.release();
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Points `d` at the matrix already parsed into d.csv and computes its ranges
+static inline void dataset_adopt_csv(Dataset& d) {
+    d.rows = d.csv.rows;
+    d.cols = d.csv.cols;
+    d.x = d.csv.values.data();
+
+    d.mins.assign(d.cols, DBL_MAX);
+    d.maxes.assign(d.cols, -DBL_MAX);
+    for (size_t r = 0; r < d.rows; r++) {
+        const double* row = d.row(r);
+        for (size_t i = 0; i < d.cols; i++) {
+            d.mins[i] = std::min(d.mins[i], row[i]);
+            d.maxes[i] = std::max(d.maxes[i], row[i]);
+        }
+    }
+    d.d_min = d.mins.data();
+    d.d_max = d.maxes.data();
+}
+
+// Loads `data_path`, which is either a binary dataset or a CSV file. Labels
+// come from `labels_path` unless it is empty or "-", in which case a binary
+// dataset's own labels are used and a CSV file has none.
+static inline bool dataset_load(const std::string& data_path,
+                                const std::string& labels_path,
+                                size_t num_threads, Dataset& d,
+                                std::string& error) {
+    d.release();
+
+    const bool have_labels = !labels_path.empty() && labels_path != "-";
+
+    if (dataset_is_binary(data_path)) {
+        if (!dataset_map(data_path, d, error)) {
+            return false;
+        }
+    } else {
+        if (!csv_load(data_path, num_threads, d.csv, error)) {
+            return false;
+        }
+
+        dataset_adopt_csv(d);
+    }
+
+    if (have_labels) {
+        std::vector<int32_t> labels;
+        if (!csv_load_labels(labels_path, num_threads, labels, error)) {
+            return false;
+        }
+
+        if (labels.size() != d.rows) {
+            error = data_path + " has " + std::to_string(d.rows) +
+                    " rows but " + labels_path + " has " +
+                    std::to_string(labels.size()) + " labels";
+            return false;
+        }
+
+        dataset_set_labels(d, labels);
+    }
+
+    return true;
+}
+
+static inline bool dataset_store(const std::string& path, const Dataset& d) {
+    const std::string tmp = path + ".tmp." + std::to_string(getpid());
+    FILE* f = fopen(tmp.c_str(), "wb");
+    if (!f) {
+        return false;
+    }
+
+    DatasetHeader h;
+    memcpy(h.magic, dataset_magic, sizeof(h.magic));
+    h.rows = d.rows;
+    h.cols = d.cols;
+    h.num_labels = d.y ? d.rows : 0;
+    h.num_classes = d.num_classes;
+
+    bool ok = fwrite(&h, sizeof(h), 1, f) == 1;
+    ok = ok && fwrite(d.d_min, sizeof(double), d.cols, f) == d.cols;
+    ok = ok && fwrite(d.d_max, sizeof(double), d.cols, f) == d.cols;
+    ok = ok && fwrite(d.x, sizeof(double), d.rows * d.cols, f) ==
+                   d.rows * d.cols;
+    ok = ok && fwrite(d.y, sizeof(int32_t), h.num_labels, f) == h.num_labels;
+    ok = (fclose(f) == 0) && ok;
+
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        unlink(tmp.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+// Reads the encoder range argument shared by classify and grade: either a
+// JSON style array such as [0.5,1,2] or "-" to use the dataset's own ranges
+static inline bool dataset_parse_range(const char* arg, const double* stats,
+                                       size_t cols, std::vector<double>& out) {
+    if (strcmp(arg, "-") == 0) {
+        out.assign(stats, stats + cols);
+        return true;
+    }
+
+    std::string s(arg);
+    for (char& c : s) {
+        if (c == '[' || c == ']') {
+            c = ' ';
+        }
+    }
+
+    if (!csv_parse_line(s.data(), s.data() + s.size(), out) ||
+        out.size() < cols) {
+        return false;
+    }
+
+    out.resize(cols);
+    return true;
+}
@@ -0,0 +1,216 @@
+#pragma once
+
+// Binning spike encoder shared by classify, grade, predict, serve and control.
+// Every observation becomes one input spike per feature, on the neuron for the
+// bin its value falls in. Everything that only depends on the bins is computed
+// once here so encoding a row is a single pass, and a whole dataset can be
+// binned up front into a compact uint16 index matrix.
+//
+// Two layouts are supported:
+//   uniform   Feature i uses neurons num_bins * i + bin, where bin is which of
+//             num_bins equal-width bins between d_min[i] and d_max[i] the
+//             value falls in.
+//   quantile  Feature i uses edges[i].size() + 1 bins split at the given
+//             edges, usually of equal mass (see data_preprocessing -q), and
+//             the features' neurons are packed one after another. Features
+//             without edges carry no information and get no neurons or
+//             spikes at all.
+
+#include "csv.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+class SpikeEncoder {
+  public:
+    // Input neuron indices have to fit in a uint16_t
+    static const size_t max_inputs = 65536;
+
+    SpikeEncoder() = default;
+
+    SpikeEncoder(const double* d_min, const double* d_max, size_t num_features,
+                 size_t num_bins)
+        : features(num_features), bins(num_bins),
+          inputs(num_features * num_bins), offset(num_features),
+          step(num_features), base(num_features) {
+        for (size_t i = 0; i < num_features; i++) {
+            offset[i] = d_min[i];
+            step[i] = (d_max[i] - d_min[i]) / num_bins;
+            base[i] = num_bins * i;
+        }
+    }
+
+    explicit SpikeEncoder(const std::vector<std::vector<double>>& bin_edges)
+        : features(bin_edges.size()), quantile(true), edges(bin_edges) {
+        for (size_t i = 0; i < features; i++) {
+            if (edges[i].empty()) {
+                continue;
+            }
+
+            active.push_back(i);
+            base.push_back(inputs);
+            inputs += edges[i].size() + 1;
+            bins = std::max(bins, edges[i].size() + 1);
+        }
+    }
+
+    size_t num_features() const { return features; }
+    // Largest number of bins of any feature
+    size_t num_bins() const { return bins; }
+    size_t num_inputs() const { return inputs; }
+    // Spikes produced per observation
+    size_t width() const { return quantile ? active.size() : features; }
+    bool fits() const { return num_inputs() <= max_inputs; }
+    bool is_quantile() const { return quantile; }
+    const std::vector<std::vector<double>>& bin_edges() const { return edges; }
+
+    // Bins one observation of num_features() values into width() spikes.
+    // Values outside the binned range (and NaNs) land in the nearest end bin,
+    // and a uniform feature whose range is empty always uses its first bin
+    void encode(const double* x, uint16_t* spikes) const {
+        if (quantile) {
+            for (size_t j = 0; j < active.size(); j++) {
+                const std::vector<double>& e = edges[active[j]];
+                spikes[j] = base[j] + (std::upper_bound(e.begin(), e.end(),
+                                                        x[active[j]]) -
+                                       e.begin());
+            }
+            return;
+        }
+
+        const double top = (double)bins - 1;
+        const double* o = offset.data();
+        const double* w = step.data();
+        const uint16_t* b = base.data();
+
+#pragma omp simd
+        for (size_t i = 0; i < features; i++) {
+            double bin = floor((x[i] - o[i]) / w[i]);
+            bin = bin >= 0 ? bin : 0;
+            bin = bin <= top ? bin : top;
+            bin = w[i] == 0 ? 0 : bin;
+            spikes[i] = b[i] + (uint16_t)bin;
+        }
+    }
+
+    // Bins `rows` row-major observations into a rows x width() matrix
+    void encode(const double* x, size_t rows, uint16_t* spikes) const {
+        for (size_t r = 0; r < rows; r++) {
+            encode(x + (r * features), spikes + (r * width()));
+        }
+    }
+
+    std::vector<uint16_t> encode(const double* x, size_t rows) const {
+        std::vector<uint16_t> spikes(rows * width());
+        encode(x, rows, spikes.data());
+        return spikes;
+    }
+
+  private:
+    size_t features = 0;
+    size_t bins = 0;
+    size_t inputs = 0;
+    bool quantile = false;
+
+    // Uniform bins
+    std::vector<double> offset;
+    std::vector<double> step;
+
+    // Quantile bins, and the features that have any
+    std::vector<std::vector<double>> edges;
+    std::vector<size_t> active;
+
+    std::vector<uint16_t> base;
+};
+
+// Bin edge files hold one line of comma separated edges per feature, an empty
+// line for a feature that is dropped
+static inline bool encoder_edges_store(const std::string& path,
+                                       const std::vector<std::vector<double>>&
+                                           edges) {
+    FILE* f = fopen(path.c_str(), "w");
+    if (!f) {
+        return false;
+    }
+
+    for (const std::vector<double>& e : edges) {
+        for (size_t j = 0; j < e.size(); j++) {
+            fprintf(f, j == 0 ? "%.17g" : ",%.17g", e[j]);
+        }
+        fprintf(f, "\n");
+    }
+
+    return fclose(f) == 0;
+}
+
+static inline bool encoder_edges_load(const std::string& path,
+                                      std::vector<std::vector<double>>& edges,
+                                      std::string& error) {
+    FILE* f = fopen(path.c_str(), "r");
+    if (!f) {
+        error = path + ": " + strerror(errno);
+        return false;
+    }
+
+    edges.clear();
+    char* line = nullptr;
+    size_t capacity = 0;
+    ssize_t length;
+    bool ok = true;
+    while ((length = getline(&line, &capacity, f)) > 0) {
+        edges.emplace_back();
+        if (!csv_parse_line(line, line + length - (line[length - 1] == '\n'),
+                            edges.back()) ||
+            !std::is_sorted(edges.back().begin(), edges.back().end())) {
+            error = path + ": line " + std::to_string(edges.size()) +
+                    " is not a sorted list of edges";
+            ok = false;
+            break;
+        }
+    }
+
+    free(line);
+    fclose(f);
+    return ok;
+}
+
+// Builds the encoder for `num_features` features: quantile bins read from
+// `edges_path` if it is set, uniform bins between d_min and d_max otherwise
+static inline bool encoder_make(const std::string& edges_path,
+                                const double* d_min, const double* d_max,
+                                size_t num_features, size_t num_bins,
+                                SpikeEncoder& encoder, std::string& error) {
+    if (edges_path.empty()) {
+        encoder = SpikeEncoder(d_min, d_max, num_features, num_bins);
+    } else {
+        std::vector<std::vector<double>> edges;
+        if (!encoder_edges_load(edges_path, edges, error)) {
+            return false;
+        }
+
+        if (edges.size() != num_features) {
+            error = edges_path + " has edges for " +
+                    std::to_string(edges.size()) + " features, not " +
+                    std::to_string(num_features);
+            return false;
+        }
+
+        encoder = SpikeEncoder(edges);
+    }
+
+    if (!encoder.fits()) {
+        error = std::to_string(encoder.num_inputs()) +
+                " input neurons is more than " +
+                std::to_string(SpikeEncoder::max_inputs);
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,208 @@
+#pragma once
+
+// Persistent cache of the reservoir feature matrix produced by classify's
+// preprocessing pass. Files are keyed by a hash of everything that affects the
+// simulation (network, dataset, encoder parameters) and are laid out so they
+// can be mmap'd and used in place on later runs.
+//
+// File layout (native endianness):
+//   FeatureCacheHeader
+//   double  x[rows * cols]   row-major, column 0 is the bias term
+//   int32_t y[rows]
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+static const char feature_cache_magic[8] = {'P', 'D', 'L', 'F',
+                                            'E', 'A', 'T', '1'};
+
+struct FeatureCacheHeader {
+    char magic[8];
+    uint64_t key;
+    uint64_t rows;
+    uint64_t cols;
+};
+
+// Row-major feature matrix, either heap allocated or mapped from a cache file
+struct FeatureMatrix {
+    size_t rows = 0;
+    size_t cols = 0;
+    double* x = nullptr;
+    int32_t* y = nullptr;
+
+    FeatureMatrix() = default;
+    FeatureMatrix(const FeatureMatrix&) = delete;
+    FeatureMatrix& operator=(const FeatureMatrix&) = delete;
+    ~FeatureMatrix() { release(); }
+
+    void allocate(size_t rows, size_t cols) {
+        release();
+        this->rows = rows;
+        this->cols = cols;
+        x = (double*)calloc(rows * cols, sizeof(*x));
+        y = (int32_t*)calloc(rows, sizeof(*y));
+    }
+
+    void release() {
+        if (map) {
+            munmap(map, map_size);
+        } else {
+            free(x);
+            free(y);
+        }
+
+        map = nullptr;
+        map_size = 0;
+        x = nullptr;
+        y = nullptr;
+        rows = 0;
+        cols = 0;
+    }
+
+    double* row(size_t i) { return x + (i * cols); }
+    const double* row(size_t i) const { return x + (i * cols); }
+
+    void* map = nullptr;
+    size_t map_size = 0;
+};
+
+static inline uint64_t fnv1a(uint64_t h, const void* data, size_t len) {
+    const unsigned char* p = (const unsigned char*)data;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+
+    return h;
+}
+
+// Hashes the contents of every file followed by `params`, returns 0 if any
+// file could not be read
+static inline uint64_t feature_cache_key(const std::vector<std::string>& files,
+                                         const std::string& params) {
+    uint64_t h = 14695981039346656037ULL;
+
+    for (const std::string& file : files) {
+        int fd = open(file.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return 0;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) < 0) {
+            close(fd);
+            return 0;
+        }
+
+        if (st.st_size > 0) {
+            void* m = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (m == MAP_FAILED) {
+                close(fd);
+                return 0;
+            }
+
+            madvise(m, st.st_size, MADV_SEQUENTIAL);
+            h = fnv1a(h, m, st.st_size);
+            munmap(m, st.st_size);
+        }
+
+        // Separate files so moving bytes between them changes the key
+        h = fnv1a(h, &st.st_size, sizeof(st.st_size));
+        close(fd);
+    }
+
+    return fnv1a(h, params.data(), params.size());
+}
+
+static inline std::string feature_cache_path(const std::string& dir,
+                                             uint64_t key) {
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.feat", (unsigned long long)key);
+
+    return dir + "/" + name;
+}
+
+// Maps a previously stored cache file into `m` without copying, returns false
+// if the file does not exist or does not match `key`
+static inline bool feature_cache_load(const std::string& path, uint64_t key,
+                                      FeatureMatrix& m) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(FeatureCacheHeader)) {
+        close(fd);
+        return false;
+    }
+
+    // Private + writable so the pages are shared with the page cache until
+    // someone writes to them
+    void* map = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                     fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+
+    const FeatureCacheHeader* h = (const FeatureCacheHeader*)map;
+    const size_t expected = sizeof(*h) + (h->rows * h->cols * sizeof(double)) +
+                            (h->rows * sizeof(int32_t));
+    if (memcmp(h->magic, feature_cache_magic, sizeof(h->magic)) != 0 ||
+        h->key != key || (size_t)st.st_size != expected) {
+        munmap(map, st.st_size);
+        return false;
+    }
+
+    m.release();
+    m.map = map;
+    m.map_size = st.st_size;
+    m.rows = h->rows;
+    m.cols = h->cols;
+    m.x = (double*)((char*)map + sizeof(*h));
+    m.y = (int32_t*)(m.x + (m.rows * m.cols));
+
+    return true;
+}
+
+// Writes `m` to `path` atomically so concurrent runs never observe a partial
+// file
+static inline bool feature_cache_store(const std::string& dir,
+                                       const std::string& path, uint64_t key,
+                                       const FeatureMatrix& m) {
+    mkdir(dir.c_str(), 0755);
+
+    const std::string tmp = path + ".tmp." + std::to_string(getpid());
+    FILE* f = fopen(tmp.c_str(), "wb");
+    if (!f) {
+        return false;
+    }
+
+    FeatureCacheHeader h;
+    memcpy(h.magic, feature_cache_magic, sizeof(h.magic));
+    h.key = key;
+    h.rows = m.rows;
+    h.cols = m.cols;
+
+    bool ok = fwrite(&h, sizeof(h), 1, f) == 1;
+    ok = ok && fwrite(m.x, sizeof(*m.x), m.rows * m.cols, f) == m.rows * m.cols;
+    ok = ok && fwrite(m.y, sizeof(*m.y), m.rows, f) == m.rows;
+    ok = (fclose(f) == 0) && ok;
+
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        unlink(tmp.c_str());
+        return false;
+    }
+
+    return true;
+}
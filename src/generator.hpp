@@ -0,0 +1,237 @@
+#pragma once
+
+// In-memory version of scripts/generate_reservoir.c for tools that need many
+// candidate networks. Both run the model of generator_core.h, so a seed gives
+// the same reservoir as `bin/generate_reservoir -r <seed>`, with or without
+// --grid, but each generator has its own random state and the network is built
+// directly instead of through JSON.
+
+#include "framework.hpp"
+#include "generator_core.h"
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+static const char* reservoir_empty_network = NETWORK_EMPTY;
+
+// glibc's rand() with private state: the same sequence as srand(seed)
+// followed by rand() calls, but safe to use from many threads at once
+class ReservoirRand {
+  public:
+    explicit ReservoirRand(unsigned seed) {
+        memset(&data, 0, sizeof(data));
+        initstate_r(seed, state, sizeof(state), &data);
+    }
+
+    // `data` points into `state`
+    ReservoirRand(const ReservoirRand&) = delete;
+    ReservoirRand& operator=(const ReservoirRand&) = delete;
+
+    int operator()() {
+        int32_t r;
+        random_r(&data, &r);
+        return r;
+    }
+
+  private:
+    // 128 bytes selects the same generator as the default rand() state
+    char state[128];
+    struct random_data data;
+};
+
+// Options of generate_reservoir
+struct ReservoirParams {
+    size_t size = 100;
+    // Reservoir neurons below this height take the features
+    double input_percent = 0.20;
+    // Reservoir neurons above this height feed the class neurons. Note that
+    // generate_reservoir -o x sets this to 1 - x
+    double output_height = 0.20;
+    double connection_chance = 0.50;
+    size_t feature_neurons = 16;
+    size_t class_neurons = 3;
+    // Counter-based generation of --grid, with neurons only connecting up to
+    // --radius apart
+    bool grid = false;
+    double radius = INFINITY;
+};
+
+struct ReservoirEdge {
+    uint32_t from;
+    uint32_t to;
+    int weight;
+    int delay;
+};
+
+// Node ids are the feature neurons, then the reservoir, then the class
+// neurons. Features are the inputs and class neurons the outputs, in order
+struct Reservoir {
+    size_t feature_neurons = 0;
+    size_t size = 0;
+    size_t class_neurons = 0;
+    std::vector<int> threshold;
+    std::vector<int> leak;
+    std::vector<ReservoirEdge> edges;
+
+    size_t num_nodes() const { return feature_neurons + size + class_neurons; }
+};
+
+// State of the GeneratorSink that fills a Reservoir
+struct ReservoirSink {
+    ReservoirRand rng;
+    Reservoir* r;
+
+    ReservoirSink(unsigned seed, Reservoir* r) : rng(seed), r(r) {}
+
+    static int rand(void* ctx) { return ((ReservoirSink*)ctx)->rng(); }
+
+    static void begin(void* ctx, size_t feature_neurons, size_t class_start,
+                      size_t num_nodes) {
+        Reservoir* r = ((ReservoirSink*)ctx)->r;
+        r->feature_neurons = feature_neurons;
+        r->size = class_start - feature_neurons;
+        r->class_neurons = num_nodes - class_start;
+        r->threshold.resize(num_nodes);
+        r->leak.resize(num_nodes);
+        r->edges.clear();
+    }
+
+    static void node(void* ctx, size_t id, int threshold, int leak) {
+        Reservoir* r = ((ReservoirSink*)ctx)->r;
+        r->threshold[id] = threshold;
+        r->leak[id] = leak;
+    }
+
+    static void edge(void* ctx, size_t pre, size_t post, int weight,
+                     int delay) {
+        ReservoirEdge e;
+        e.from = pre;
+        e.to = post;
+        e.weight = weight;
+        e.delay = delay;
+        ((ReservoirSink*)ctx)->r->edges.push_back(e);
+    }
+};
+
+// Callers already generate many reservoirs at once, so --grid runs on the
+// calling thread
+static inline void reservoir_generate(const ReservoirParams& params,
+                                      unsigned seed, Reservoir& r) {
+    GeneratorParams p;
+    p.size = params.size;
+    p.input_percent = params.input_percent;
+    p.output_percent = params.output_height;
+    p.connection_chance = params.connection_chance;
+    p.feature_neurons = params.feature_neurons;
+    p.class_neurons = params.class_neurons;
+    p.grid = params.grid;
+    p.radius = params.radius;
+    p.num_threads = 1;
+
+    ReservoirSink ctx(seed, &r);
+    GeneratorSink s;
+    s.ctx = &ctx;
+    s.rand = ReservoirSink::rand;
+    s.begin = ReservoirSink::begin;
+    s.node = ReservoirSink::node;
+    s.edge = ReservoirSink::edge;
+    generator_run(&p, seed, &s);
+}
+
+// Builds `r` into `n`, which gets the properties and processor settings of
+// generate_reservoir's empty network
+static inline void reservoir_to_network(const Reservoir& r, neuro::Network& n) {
+    n.from_json(nlohmann::json::parse(reservoir_empty_network));
+    const int threshold_idx = n.get_node_property("Threshold")->index;
+    const int leak_idx = n.get_node_property("Leak")->index;
+    const int weight_idx = n.get_edge_property("Weight")->index;
+    const int delay_idx = n.get_edge_property("Delay")->index;
+
+    for (size_t i = 0; i < r.num_nodes(); i++) {
+        neuro::Node* node = n.add_node(i);
+        node->values[threshold_idx] = r.threshold[i];
+        node->values[leak_idx] = r.leak[i];
+    }
+
+    for (size_t i = 0; i < r.feature_neurons; i++) {
+        n.add_input(i);
+    }
+    for (size_t i = r.feature_neurons + r.size; i < r.num_nodes(); i++) {
+        n.add_output(i);
+    }
+
+    for (const ReservoirEdge& e : r.edges) {
+        neuro::Edge* edge = n.add_edge(e.from, e.to);
+        edge->values[weight_idx] = e.weight;
+        edge->values[delay_idx] = e.delay;
+    }
+}
+
+// Makes one random change to `r`: adds or removes an edge, or nudges the
+// weight or delay of an edge or the threshold of a neuron. New edges follow
+// the layout of reservoir_generate, from a feature or reservoir neuron into
+// the reservoir or from the reservoir to a class neuron, and values stay within
+// the ranges of reservoir_empty_network
+static inline void reservoir_mutate(Reservoir& r, std::mt19937_64& rng) {
+    const size_t f = r.feature_neurons;
+    const size_t class_start = f + r.size;
+    const auto pick = [&](size_t n) { return (size_t)(rng() % n); };
+    const auto clamp = [](int v, int lo, int hi) {
+        return v < lo ? lo : (v > hi ? hi : v);
+    };
+
+    switch (r.edges.empty() ? 0 : pick(5)) {
+    case 0:
+        // A few tries at a pair that is not connected yet
+        for (int attempt = 0; attempt < 16; attempt++) {
+            ReservoirEdge e;
+            e.from = pick(class_start);
+            e.to = f + pick(r.size + r.class_neurons);
+            if (e.from == e.to || (e.from < f && e.to >= class_start)) {
+                continue;
+            }
+
+            bool exists = false;
+            for (const ReservoirEdge& other : r.edges) {
+                if (other.from == e.from && other.to == e.to) {
+                    exists = true;
+                    break;
+                }
+            }
+            if (exists) {
+                continue;
+            }
+
+            e.weight = (pick(2) ? 1 : -1) * (int)pick(256);
+            e.delay = pick(15) + 1;
+            r.edges.push_back(e);
+            break;
+        }
+        break;
+    case 1: {
+        const size_t k = pick(r.edges.size());
+        r.edges[k] = r.edges.back();
+        r.edges.pop_back();
+        break;
+    }
+    case 2: {
+        ReservoirEdge& e = r.edges[pick(r.edges.size())];
+        e.weight = clamp(e.weight + (int)pick(65) - 32, -255, 255);
+        break;
+    }
+    case 3: {
+        ReservoirEdge& e = r.edges[pick(r.edges.size())];
+        e.delay = clamp(e.delay + (int)pick(7) - 3, 1, 15);
+        break;
+    }
+    default: {
+        int& threshold = r.threshold[pick(r.num_nodes())];
+        threshold = clamp(threshold + (int)pick(65) - 32, 1, 255);
+        break;
+    }
+    }
+}
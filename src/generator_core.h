@@ -0,0 +1,460 @@
+#pragma once
+
+// The reservoir model of scripts/generate_reservoir.c, shared with
+// src/generator.hpp so that a seed gives the same network from either. It is
+// written in the subset of C and C++ that both compile, and hands every node
+// and edge to a GeneratorSink as soon as it is drawn.
+//
+// Neurons are placed uniformly in the unit square. Reservoir neurons connect
+// with chance connection_chance * distance, feature neurons connect to the
+// reservoir neurons below input_percent, and those above output_percent
+// connect to the class neurons. Node ids are the feature neurons, then the
+// reservoir, then the class neurons.
+
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The parts of the network JSON that do not depend on the reservoir. Node
+// values are [Threshold, Leak] and edge values [Weight, Delay]
+#define NETWORK_ASSOCIATED_DATA                                                \
+    "\"Associated_Data\":{\"other\":{\"proc_name\":\"risp\"},\"proc_p"         \
+    "arams\":{\"discrete\":true,\"leak_mode\":\"configurable\",\"spik"         \
+    "e_value_factor\":255,\"max_delay\":15,\"max_threshold\":255,\"ma"         \
+    "x_weight\":255,\"min_potential\":-255,\"min_threshold\":1,\"min_"         \
+    "weight\":-255}}"
+#define NETWORK_PROPERTIES                                                     \
+    "\"Properties\":{\"edge_properties\":[{\"index\":1,\"max_value\":"         \
+    "15,\"min_value\":1,\"name\":\"Delay\",\"size\":1,\"type\":73},{"          \
+    "\"index\":0,\"max_value\":255,\"min_value\":-255,\"name\":\"Weig"         \
+    "ht\",\"size\":1,\"type\":73}],\"network_properties\":[],\"node_p"         \
+    "roperties\":[{\"index\":0,\"max_value\":255,\"min_value\":1,\"na"         \
+    "me\":\"Threshold\",\"size\":1,\"type\":73},{\"index\":1,\"max_va"         \
+    "lue\":1,\"min_value\":0,\"name\":\"Leak\",\"size\":1,\"type\":66"         \
+    "}]}"
+#define NETWORK_EMPTY                                                          \
+    "{" NETWORK_ASSOCIATED_DATA                                                \
+    ",\"Edges\":[],\"Inputs\":[],\"Network_Values\":[],"                       \
+    "\"Nodes\":[],\"Outputs\":[]," NETWORK_PROPERTIES "}"
+
+typedef struct GeneratorParams {
+    size_t size;
+    double input_percent;
+    // Reservoir neurons above this height feed the class neurons. Note that
+    // generate_reservoir -o x sets this to 1 - x
+    double output_percent;
+    double connection_chance;
+    size_t feature_neurons;
+    size_t class_neurons;
+    // --grid, its --radius (INFINITY for none) and the threads it uses
+    bool grid;
+    double radius;
+    size_t num_threads;
+} GeneratorParams;
+
+// Where the network goes. Without --grid every draw comes from rand(ctx),
+// which must give the sequence rand() does after srand(seed). begin is called
+// once before the first node, nodes come in id order and all of them come
+// before any edge
+typedef struct GeneratorSink {
+    void* ctx;
+    int (*rand)(void* ctx);
+    void (*begin)(void* ctx, size_t feature_neurons, size_t class_start,
+                  size_t num_nodes);
+    void (*node)(void* ctx, size_t id, int threshold, int leak);
+    void (*edge)(void* ctx, size_t pre, size_t post, int weight, int delay);
+} GeneratorSink;
+
+// Draws an edge's weight and delay, the sign before the magnitude
+static inline void generator_edge(const GeneratorSink* s, size_t pre,
+                                  size_t post) {
+    const int sign = ((s->rand(s->ctx) % 2) * 2) - 1;
+    const int weight = sign * s->rand(s->ctx) % 256;
+    const int delay = s->rand(s->ctx) % 15 + 1;
+    s->edge(s->ctx, pre, post, weight, delay);
+}
+
+// Every pair of reservoir neurons is tried, so this is for reservoirs of up to
+// a few thousand neurons
+static inline void generator_plain(const GeneratorParams* p,
+                                   const GeneratorSink* s) {
+    const size_t size = p->size;
+    const size_t f = p->feature_neurons;
+    double* x = (double*)malloc(size * sizeof(double));
+    double* y = (double*)malloc(size * sizeof(double));
+    for (size_t i = 0; i < size; i++) {
+        x[i] = s->rand(s->ctx) / (double)RAND_MAX;
+        y[i] = s->rand(s->ctx) / (double)RAND_MAX;
+    }
+
+    // The connections of neuron i are targets[start[i]] up to start[i + 1]
+    size_t* start = (size_t*)malloc((size + 1) * sizeof(size_t));
+    size_t num_targets = 0;
+    size_t cap_targets = 1024;
+    uint32_t* targets = (uint32_t*)malloc(cap_targets * sizeof(uint32_t));
+    for (size_t i = 0; i < size; i++) {
+        start[i] = num_targets;
+        for (size_t j = 0; j < size; j++) {
+            // Connections get more likely with distance
+            const double distance = sqrt(pow(x[i] - x[j], 2) +
+                                         pow(y[i] - y[j], 2));
+            if ((double)s->rand(s->ctx) / RAND_MAX <
+                p->connection_chance * distance) {
+                if (num_targets == cap_targets) {
+                    cap_targets *= 2;
+                    targets = (uint32_t*)realloc(
+                        targets, cap_targets * sizeof(uint32_t));
+                }
+                targets[num_targets++] = j;
+            }
+        }
+    }
+    start[size] = num_targets;
+
+    const size_t class_start = f + size;
+    const size_t num_nodes = class_start + p->class_neurons;
+    s->begin(s->ctx, f, class_start, num_nodes);
+
+    for (size_t i = 0; i < class_start; i++) {
+        s->node(s->ctx, i, s->rand(s->ctx) % 255 + 1, 1);
+    }
+    for (size_t i = class_start; i < num_nodes; i++) {
+        s->node(s->ctx, i, s->rand(s->ctx) % 255 + 1, 0);
+    }
+
+    // Connect feature neurons to input
+    for (size_t i = 0; i < f; i++) {
+        for (size_t j = 0; j < size; j++) {
+            if (y[j] < p->input_percent) {
+                generator_edge(s, i, f + j);
+            }
+        }
+    }
+
+    // Connect resevoir neurons to each other
+    for (size_t i = 0; i < size; i++) {
+        for (size_t k = start[i]; k < start[i + 1]; k++) {
+            generator_edge(s, f + i, f + targets[k]);
+        }
+    }
+
+    // Connect output resevoir neurons to class neurons
+    for (size_t i = class_start; i < num_nodes; i++) {
+        for (size_t j = 0; j < size; j++) {
+            if (y[j] > p->output_percent) {
+                generator_edge(s, f + j, i);
+            }
+        }
+    }
+
+    free(targets);
+    free(start);
+    free(x);
+    free(y);
+}
+
+// --grid generates reservoirs far past the size the all-pairs loop above can
+// handle. Every random number is a hash of the seed, what it is for and a
+// counter, so the network depends on the seed alone and not on the number of
+// threads or the order they run in. It follows the same model, but with
+// different draws, so a seed gives a different network than without --grid.
+// Reservoir neurons only connect up to --radius if one is given.
+// Connections are sampled per source neuron over a grid of cells. Within a cell
+// every neuron is at most its farthest corner away, so each cell is visited
+// with that chance as a bound, skipping geometrically from one candidate to the
+// next, and each candidate is kept with the rest of its chance. Cells entirely
+// beyond the radius are never visited, which makes the work proportional to
+// the number of edges rather than to the square of the number of neurons.
+// Farthest apart two neurons in the unit square can be. A radius at least this
+// long does not rule out any pair. M_SQRT2 is not defined under strict C
+#define GRID_DIAGONAL 1.4142135623730951
+
+enum {
+    STREAM_POSITION,
+    STREAM_THRESHOLD,
+    STREAM_CONNECTION,
+    STREAM_INPUT_EDGE,
+    STREAM_EDGE,
+    STREAM_OUTPUT_EDGE,
+};
+
+static inline uint64_t mix64(uint64_t z) {
+    // splitmix64's finalizer
+    z += 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// Draw `counter` of the `stream` for `index`, e.g. a neuron id
+static inline uint64_t counter_rand(uint64_t seed, uint64_t stream,
+                                    uint64_t index, uint64_t counter) {
+    return mix64(mix64(mix64(seed ^ (stream << 56)) ^ index) + counter);
+}
+
+// Uniform in (0, 1), never exactly 0 so it can be logged
+static inline double counter_uniform(uint64_t seed, uint64_t stream,
+                                     uint64_t index, uint64_t counter) {
+    return ((counter_rand(seed, stream, index, counter) >> 11) + 0.5) *
+           0x1.0p-53;
+}
+
+static inline void counter_edge(uint64_t seed, uint64_t stream, uint64_t index,
+                                uint64_t counter, int* weight, int* delay) {
+    const uint64_t r = counter_rand(seed, stream, index, 2 * counter);
+    *weight = (r & 1 ? 1 : -1) * (int)((r >> 1) % 256);
+    *delay = counter_rand(seed, stream, index, 2 * counter + 1) % 15 + 1;
+}
+
+typedef struct Grid {
+    uint64_t seed;
+    size_t size;
+    double connection_chance;
+    double radius;
+    const double* x;
+    const double* y;
+
+    // Cells per side, and the reservoir neurons of cell (cx, cy) in id order
+    // at neurons[start[cy * side + cx]] up to the start of the next cell
+    size_t side;
+    size_t* start;
+    uint32_t* neurons;
+} Grid;
+
+// The reservoir connections of sources first to last - 1, in source order
+typedef struct GridJob {
+    const Grid* grid;
+    size_t first;
+    size_t last;
+    size_t* counts;
+    uint32_t* targets;
+    size_t num_targets;
+    size_t cap_targets;
+} GridJob;
+
+static inline void* grid_worker(void* arg) {
+    GridJob* job = (GridJob*)arg;
+    const Grid* g = job->grid;
+    const double cell = 1.0 / g->side;
+
+    for (size_t i = job->first; i < job->last; i++) {
+        const double xi = g->x[i];
+        const double yi = g->y[i];
+        const size_t before = job->num_targets;
+        uint64_t counter = 0;
+
+        // Only the cells that overlap the square around the radius
+        size_t cx0 = 0, cx1 = g->side, cy0 = 0, cy1 = g->side;
+        if (g->radius < GRID_DIAGONAL) {
+            cx0 = fmax(0, floor((xi - g->radius) / cell));
+            cx1 = fmin(g->side, floor((xi + g->radius) / cell) + 1);
+            cy0 = fmax(0, floor((yi - g->radius) / cell));
+            cy1 = fmin(g->side, floor((yi + g->radius) / cell) + 1);
+        }
+
+        for (size_t cy = cy0; cy < cy1; cy++) {
+            for (size_t cx = cx0; cx < cx1; cx++) {
+                const double lx = cx * cell, hx = lx + cell;
+                const double ly = cy * cell, hy = ly + cell;
+                const double near = hypot(fmax(0, fmax(lx - xi, xi - hx)),
+                                          fmax(0, fmax(ly - yi, yi - hy)));
+                if (near > g->radius) {
+                    continue;
+                }
+
+                const double far =
+                    fmin(g->radius, hypot(fmax(xi - lx, hx - xi),
+                                          fmax(yi - ly, hy - yi)));
+                const double bound = fmin(1, g->connection_chance * far);
+                if (bound <= 0) {
+                    continue;
+                }
+
+                const size_t c = cy * g->side + cx;
+                const double log_miss = log1p(-bound);
+                for (size_t k = g->start[c];; k++) {
+                    if (bound < 1) {
+                        // Neurons passed over before the next candidate
+                        const double u = counter_uniform(
+                            g->seed, STREAM_CONNECTION, i, counter++);
+                        const double skip = floor(log(u) / log_miss);
+                        if (skip >= g->start[c + 1] - k) {
+                            break;
+                        }
+                        k += skip;
+                    } else if (k >= g->start[c + 1]) {
+                        break;
+                    }
+
+                    const uint32_t j = g->neurons[k];
+                    const double distance =
+                        hypot(g->x[j] - xi, g->y[j] - yi);
+                    const double u = counter_uniform(
+                        g->seed, STREAM_CONNECTION, i, counter++);
+                    if (distance > g->radius ||
+                        u * bound >= g->connection_chance * distance) {
+                        continue;
+                    }
+
+                    if (job->num_targets == job->cap_targets) {
+                        job->cap_targets = job->cap_targets * 2 + 1024;
+                        job->targets = (uint32_t*)realloc(
+                            job->targets, job->cap_targets * sizeof(uint32_t));
+                    }
+                    job->targets[job->num_targets++] = j;
+                }
+            }
+        }
+
+        job->counts[i] = job->num_targets - before;
+    }
+
+    return NULL;
+}
+
+// Needs a reservoir of 1 to UINT32_MAX neurons
+static inline void generator_grid(const GeneratorParams* p, uint64_t seed,
+                                  const GeneratorSink* s) {
+    const size_t size = p->size;
+    const size_t f = p->feature_neurons;
+    const double radius = p->radius;
+
+    Grid g;
+    memset(&g, 0, sizeof(g));
+    g.seed = seed;
+    g.size = size;
+    g.connection_chance = p->connection_chance;
+    g.radius = radius;
+    double* x = (double*)malloc(size * sizeof(double));
+    double* y = (double*)malloc(size * sizeof(double));
+    for (size_t i = 0; i < size; i++) {
+        x[i] = counter_uniform(seed, STREAM_POSITION, i, 0);
+        y[i] = counter_uniform(seed, STREAM_POSITION, i, 1);
+    }
+    g.x = x;
+    g.y = y;
+
+    // Cells half the radius wide keep the visited area close to the circle,
+    // with a few neurons per cell at least. Without a radius every neuron is a
+    // candidate and one cell does
+    g.side = 1;
+    if (radius < GRID_DIAGONAL) {
+        g.side = fmax(1, fmin(ceil(2 / radius), floor(sqrt(size / 4))));
+    }
+
+    const size_t num_cells = g.side * g.side;
+    g.start = (size_t*)calloc(num_cells + 1, sizeof(size_t));
+    g.neurons = (uint32_t*)malloc(size * sizeof(uint32_t));
+    size_t* cell_of = (size_t*)malloc(size * sizeof(size_t));
+    for (size_t i = 0; i < size; i++) {
+        const size_t cx = fmin(g.side - 1, floor(x[i] * g.side));
+        const size_t cy = fmin(g.side - 1, floor(y[i] * g.side));
+        cell_of[i] = cy * g.side + cx;
+        g.start[cell_of[i] + 1]++;
+    }
+    for (size_t c = 0; c < num_cells; c++) {
+        g.start[c + 1] += g.start[c];
+    }
+    size_t* fill = (size_t*)malloc(num_cells * sizeof(size_t));
+    memcpy(fill, g.start, num_cells * sizeof(size_t));
+    for (size_t i = 0; i < size; i++) {
+        g.neurons[fill[cell_of[i]]++] = i;
+    }
+    free(fill);
+    free(cell_of);
+
+    // Sources are split into contiguous ranges, so the CSR edge array is the
+    // threads' targets one after another
+    size_t num_threads = p->num_threads < 1 ? 1 : p->num_threads;
+    if (num_threads > size) {
+        num_threads = size;
+    }
+    size_t* counts = (size_t*)malloc(size * sizeof(size_t));
+    GridJob* jobs = (GridJob*)calloc(num_threads, sizeof(GridJob));
+    pthread_t* threads = (pthread_t*)malloc(num_threads * sizeof(pthread_t));
+    for (size_t t = 0; t < num_threads; t++) {
+        jobs[t].grid = &g;
+        jobs[t].first = size * t / num_threads;
+        jobs[t].last = size * (t + 1) / num_threads;
+        jobs[t].counts = counts;
+        pthread_create(&threads[t], NULL, grid_worker, &jobs[t]);
+    }
+
+    size_t* offsets = (size_t*)malloc((size + 1) * sizeof(size_t));
+    offsets[0] = 0;
+    for (size_t t = 0; t < num_threads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    for (size_t i = 0; i < size; i++) {
+        offsets[i + 1] = offsets[i] + counts[i];
+    }
+
+    uint32_t* targets =
+        (uint32_t*)malloc((offsets[size] + 1) * sizeof(uint32_t));
+    for (size_t t = 0; t < num_threads; t++) {
+        memcpy(&targets[offsets[jobs[t].first]], jobs[t].targets,
+               jobs[t].num_targets * sizeof(uint32_t));
+        free(jobs[t].targets);
+    }
+    free(jobs);
+    free(threads);
+    free(counts);
+
+    const size_t class_start = f + size;
+    const size_t num_nodes = class_start + p->class_neurons;
+    s->begin(s->ctx, f, class_start, num_nodes);
+
+    for (size_t i = 0; i < num_nodes; i++) {
+        s->node(s->ctx, i,
+                counter_rand(seed, STREAM_THRESHOLD, i, 0) % 255 + 1,
+                i < class_start);
+    }
+
+    int weight, delay;
+    for (size_t i = 0; i < f; i++) {
+        for (size_t j = 0; j < size; j++) {
+            if (y[j] < p->input_percent) {
+                counter_edge(seed, STREAM_INPUT_EDGE, i, j, &weight, &delay);
+                s->edge(s->ctx, i, f + j, weight, delay);
+            }
+        }
+    }
+
+    for (size_t i = 0; i < size; i++) {
+        for (size_t k = offsets[i]; k < offsets[i + 1]; k++) {
+            counter_edge(seed, STREAM_EDGE, i, k - offsets[i], &weight, &delay);
+            s->edge(s->ctx, f + i, f + targets[k], weight, delay);
+        }
+    }
+
+    for (size_t i = class_start; i < num_nodes; i++) {
+        for (size_t j = 0; j < size; j++) {
+            if (y[j] > p->output_percent) {
+                counter_edge(seed, STREAM_OUTPUT_EDGE, j, i - class_start,
+                             &weight, &delay);
+                s->edge(s->ctx, f + j, i, weight, delay);
+            }
+        }
+    }
+
+    free(targets);
+    free(offsets);
+    free(g.start);
+    free(g.neurons);
+    free(x);
+    free(y);
+}
+
+// Generates the reservoir of `seed` into `s`, with or without --grid
+static inline void generator_run(const GeneratorParams* p, uint64_t seed,
+                                 const GeneratorSink* s) {
+    if (p->grid) {
+        generator_grid(p, seed, s);
+    } else {
+        generator_plain(p, s);
+    }
+}
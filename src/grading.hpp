@@ -0,0 +1,766 @@
+#pragma once
+
+// Pairwise angle grading of a reservoir: for every ordered pair of distinct
+// observations (i, j) whose first output vector is not all zeros, the angle
+// between their output counts is added to cell [label i][label j]. Identical
+// vectors count as 0 and an all-zero second vector as 1.
+//
+// The output counts are held as one contiguous row-major matrix with the
+// columns grouped by label, and each row's squared norm and its square root
+// are computed once. Rows are processed in blocks: first every thread takes
+// tiles of (a few rows x a cache sized run of columns) and fills in the
+// block's angles with a SIMD dot product, then every thread takes cells of
+// the table and adds the block's angles to them. Counts are integers, so the
+// dot products and norms are exact in any order, and every cell still adds
+// its angles in the original i-major, j-minor order, which keeps the table
+// bit-for-bit identical to a plain double loop over all pairs.
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <pthread.h>
+#include <random>
+#include <string>
+#include <vector>
+
+struct GradeCell {
+    double total = 0;
+    double count = 0;
+};
+
+typedef std::vector<std::vector<GradeCell>> GradeTable;
+
+// Continued fraction of the regularized incomplete beta function, evaluated
+// with Lentz's method
+static inline double grade_beta_cf(double a, double b, double x) {
+    const double tiny = 1e-300;
+    const auto clamp = [&](double v) { return std::abs(v) < tiny ? tiny : v; };
+
+    double c = 1;
+    double d = 1 / clamp(1 - ((a + b) * x / (a + 1)));
+    double h = d;
+    for (int m = 1; m <= 1000; m++) {
+        const double even =
+            m * (b - m) * x / ((a + (2 * m) - 1) * (a + (2 * m)));
+        d = 1 / clamp(1 + (even * d));
+        c = clamp(1 + (even / c));
+        h *= d * c;
+
+        const double odd =
+            -(a + m) * (a + b + m) * x / ((a + (2 * m)) * (a + (2 * m) + 1));
+        d = 1 / clamp(1 + (odd * d));
+        c = clamp(1 + (odd / c));
+        h *= d * c;
+
+        if (std::abs((d * c) - 1) < 1e-15) {
+            break;
+        }
+    }
+
+    return h;
+}
+
+// Regularized incomplete beta function I_x(a, b)
+static inline double grade_beta_inc(double a, double b, double x) {
+    if (x <= 0) {
+        return 0;
+    }
+    if (x >= 1) {
+        return 1;
+    }
+
+    const double front = exp(lgamma(a + b) - lgamma(a) - lgamma(b) +
+                             (a * log(x)) + (b * log1p(-x)));
+    if (x < (a + 1) / (a + b + 2)) {
+        return front * grade_beta_cf(a, b, x) / a;
+    }
+    return 1 - (front * grade_beta_cf(b, a, 1 - x) / b);
+}
+
+// The t with P(T > t) = p, for p below 1/2, of Student's t distribution
+// with `dof` degrees of freedom
+static inline double grade_t_quantile(double p, double dof) {
+    if (dof < 1) {
+        return INFINITY;
+    }
+
+    const auto tail = [&](double t) {
+        return grade_beta_inc(dof / 2, 0.5, dof / (dof + (t * t))) / 2;
+    };
+
+    double lo = 0;
+    double hi = 1;
+    while (tail(hi) > p) {
+        lo = hi;
+        hi *= 2;
+    }
+    for (int i = 0; i < 100; i++) {
+        const double mid = (lo + hi) / 2;
+        (tail(mid) > p ? lo : hi) = mid;
+    }
+
+    return hi;
+}
+
+// Clopper-Pearson lower bound on a proportion with `k` successes out of `n`:
+// the true proportion is below it with probability at most p
+static inline double grade_proportion_lower(size_t k, size_t n, double p) {
+    if (k == 0) {
+        return 0;
+    }
+
+    // P(X >= k) for X ~ Binomial(n, q) is I_q(k, n - k + 1), increasing in q
+    double lo = 0;
+    double hi = (double)k / n;
+    for (int i = 0; i < 100; i++) {
+        const double mid = (lo + hi) / 2;
+        (grade_beta_inc(k, n - k + 1, mid) < p ? lo : hi) = mid;
+    }
+
+    return lo;
+}
+
+class PairwiseGrader {
+  public:
+    // Rows per block, rows per tile and columns per tile
+    static const size_t block_rows = 64;
+    static const size_t tile_rows = 8;
+    static const size_t tile_cols = 256;
+
+    // `counts` is rows x cols, `labels` has one label below num_classes per row
+    PairwiseGrader(const double* counts, const int32_t* labels, size_t rows,
+                   size_t cols, size_t num_classes)
+        : rows(rows), cols(cols), classes(num_classes), labels(labels),
+          pos(rows), class_begin(num_classes + 1), x(rows * cols),
+          norm(rows), root(rows) {
+        // Stable counting sort of the rows by label
+        for (size_t i = 0; i < rows; i++) {
+            class_begin[labels[i] + 1]++;
+        }
+        for (size_t c = 0; c < classes; c++) {
+            class_begin[c + 1] += class_begin[c];
+        }
+
+        std::vector<size_t> next(class_begin.begin(), class_begin.end() - 1);
+        for (size_t i = 0; i < rows; i++) {
+            const size_t p = next[labels[i]]++;
+            pos[i] = p;
+
+            const double* src = counts + (i * cols);
+            double* dst = &x[p * cols];
+            double n2 = 0;
+            for (size_t k = 0; k < cols; k++) {
+                dst[k] = src[k];
+                n2 += src[k] * src[k];
+            }
+            norm[p] = n2;
+            root[p] = sqrt(n2);
+
+            if (n2 == 0) {
+                num_zeros++;
+            } else {
+                active.push_back(i);
+            }
+        }
+    }
+
+    // Rows whose output vector is all zeros. They are still graded against,
+    // but contribute no pairs of their own
+    size_t zeros() const { return num_zeros; }
+
+    GradeTable grade(size_t num_threads) {
+        table.assign(classes, std::vector<GradeCell>(classes));
+        angles.resize(block_rows * rows);
+
+        num_threads = std::max<size_t>(num_threads, 1);
+        pthread_barrier_init(&barrier, nullptr, num_threads);
+        next_tile = 0;
+        next_cell = 0;
+
+        std::vector<pthread_t> threads(num_threads);
+        for (size_t t = 0; t < num_threads; t++) {
+            pthread_create(&threads[t], nullptr, worker, this);
+        }
+        for (size_t t = 0; t < num_threads; t++) {
+            pthread_join(threads[t], nullptr);
+        }
+
+        pthread_barrier_destroy(&barrier);
+        angles.clear();
+        angles.shrink_to_fit();
+        return table;
+    }
+
+  private:
+    // Angle between the rows at sorted positions p and q
+    double angle(size_t p, size_t q) const {
+        const double* a = &x[p * cols];
+        const double* b = &x[q * cols];
+        double dot = 0;
+
+#pragma omp simd reduction(+ : dot)
+        for (size_t k = 0; k < cols; k++) {
+            dot += a[k] * b[k];
+        }
+
+        // |a - b|^2 = |a|^2 + |b|^2 - 2 a.b is exact for integer counts
+        if (2 * dot == norm[p] + norm[q]) {
+            return 0;
+        }
+        if (norm[q] == 0) {
+            return 1;
+        }
+
+        return acos(dot / (root[p] * root[q]));
+    }
+
+    // Fills in the angles of rows [r_begin, r_end) of the block starting at
+    // active[block] against columns [c_begin, c_end)
+    void fill_tile(size_t block, size_t r_begin, size_t r_end, size_t c_begin,
+                   size_t c_end) {
+        for (size_t r = r_begin; r < r_end; r++) {
+            const size_t p = pos[active[block + r]];
+            double* out = &angles[r * rows];
+            for (size_t q = c_begin; q < c_end; q++) {
+                out[q] = angle(p, q);
+            }
+        }
+    }
+
+    // Adds the block's angles to cell [a][b]
+    void reduce_cell(size_t block, size_t block_size, size_t a, size_t b) {
+        GradeCell& cell = table[a][b];
+        const size_t begin = class_begin[b];
+        const size_t end = class_begin[b + 1];
+
+        for (size_t r = 0; r < block_size; r++) {
+            const size_t i = active[block + r];
+            if ((size_t)labels[i] != a) {
+                continue;
+            }
+
+            const size_t self = pos[i];
+            const double* in = &angles[r * rows];
+            double total = cell.total;
+            for (size_t q = begin; q < end; q++) {
+                if (q != self) {
+                    total += in[q];
+                }
+            }
+
+            cell.total = total;
+            cell.count += (end - begin) - (a == b);
+        }
+    }
+
+    static void* worker(void* arg) {
+        PairwiseGrader* g = (PairwiseGrader*)arg;
+        const size_t row_tiles = (block_rows + tile_rows - 1) / tile_rows;
+        const size_t col_tiles = (g->rows + tile_cols - 1) / tile_cols;
+        const size_t cells = g->classes * g->classes;
+
+        for (size_t block = 0; block < g->active.size(); block += block_rows) {
+            const size_t block_size =
+                std::min(block_rows, g->active.size() - block);
+
+            size_t t;
+            while ((t = g->next_tile++) < row_tiles * col_tiles) {
+                const size_t r_begin = (t / col_tiles) * tile_rows;
+                const size_t c_begin = (t % col_tiles) * tile_cols;
+                if (r_begin < block_size) {
+                    g->fill_tile(block, r_begin,
+                                 std::min(r_begin + tile_rows, block_size),
+                                 c_begin,
+                                 std::min(c_begin + tile_cols, g->rows));
+                }
+            }
+
+            // Each counter is only reset once everyone is done with it, and
+            // only used again after the next barrier
+            if (pthread_barrier_wait(&g->barrier) ==
+                PTHREAD_BARRIER_SERIAL_THREAD) {
+                g->next_tile = 0;
+            }
+
+            size_t c;
+            while ((c = g->next_cell++) < cells) {
+                g->reduce_cell(block, block_size, c / g->classes,
+                               c % g->classes);
+            }
+
+            if (pthread_barrier_wait(&g->barrier) ==
+                PTHREAD_BARRIER_SERIAL_THREAD) {
+                g->next_cell = 0;
+            }
+        }
+
+        return nullptr;
+    }
+
+    size_t rows;
+    size_t cols;
+    size_t classes;
+    const int32_t* labels;
+
+    // Sorted position of every row, and where each label's rows start
+    std::vector<size_t> pos;
+    std::vector<size_t> class_begin;
+    // Counts, squared norms and norms in sorted order
+    std::vector<double> x;
+    std::vector<double> norm;
+    std::vector<double> root;
+
+    // Rows that are not all zeros, in their original order
+    std::vector<size_t> active;
+    size_t num_zeros = 0;
+
+    // block_rows x rows angles of the current block, in sorted column order
+    std::vector<double> angles;
+    GradeTable table;
+    pthread_barrier_t barrier;
+    std::atomic_size_t next_tile;
+    std::atomic_size_t next_cell;
+};
+
+// Approximate grading in one streaming pass. Up to `rows_per_class` rows of
+// every class are picked at random up front and their outputs kept as they
+// are simulated; every other row only adds its unit output vector to a sum
+// per class. Each cell's mean angle is estimated from independent pairs of
+// kept rows, using the cosine of each pair as a control variate: the class
+// sums give the exact mean cosine of every cell, u_a . u_b over all pairs,
+// and the angle of a pair is almost a function of its cosine, so correcting
+// the sampled mean by how far the sampled cosines are off removes most of
+// the sampling error. Memory and work are O(rows) plus O(classes^2 x
+// rows_per_class), however many rows there are.
+class SampledGrader {
+  public:
+    // Per-thread sums, merged once the thread is done
+    struct Sums {
+        // classes x cols sums of unit vectors in fixed point, which adds up
+        // exactly in any order
+        std::vector<int64_t> unit;
+        std::vector<size_t> zeros;
+    };
+
+    // Most rows the fixed point sums can take: every row adds at most
+    // unit_scale to each of them
+    static const size_t max_rows = (size_t)1 << 32;
+
+    SampledGrader(const int32_t* labels, size_t rows, size_t cols,
+                  size_t num_classes, size_t rows_per_class, uint64_t seed)
+        : labels(labels), cols(cols), classes(num_classes),
+          slot(rows, unsampled), sample_begin(num_classes + 1),
+          class_rows(num_classes), totals(make_sums()) {
+        std::vector<std::vector<size_t>> members(classes);
+        for (size_t i = 0; i < rows; i++) {
+            members[labels[i]].push_back(i);
+        }
+
+        // The first rows_per_class of a partial shuffle of each class
+        std::mt19937_64 rng(seed);
+        for (size_t c = 0; c < classes; c++) {
+            std::vector<size_t>& m = members[c];
+            const size_t n = std::min(rows_per_class, m.size());
+            for (size_t k = 0; k < n; k++) {
+                std::uniform_int_distribution<size_t> pick(k, m.size() - 1);
+                std::swap(m[k], m[pick(rng)]);
+                slot[m[k]] = sample_begin[c] + k;
+            }
+
+            sample_begin[c + 1] = sample_begin[c] + n;
+            class_rows[c] = m.size();
+        }
+
+        samples.resize(sample_begin[classes] * cols);
+        pthread_mutex_init(&lock, nullptr);
+    }
+
+    ~SampledGrader() { pthread_mutex_destroy(&lock); }
+
+    Sums make_sums() const {
+        Sums s;
+        s.unit.assign(classes * cols, 0);
+        s.zeros.assign(classes, 0);
+        return s;
+    }
+
+    // Records the output counts of `row`. Safe to call from any thread as
+    // long as each thread has its own `sums`
+    void add(size_t row, const std::vector<int>& counts, Sums& sums) {
+        const size_t c = labels[row];
+        double n2 = 0;
+        for (int v : counts) {
+            n2 += (double)v * v;
+        }
+
+        if (slot[row] != unsampled) {
+            std::copy(counts.begin(), counts.end(), &samples[slot[row] * cols]);
+        }
+
+        if (n2 == 0) {
+            sums.zeros[c]++;
+            return;
+        }
+
+        const double scale = unit_scale / sqrt(n2);
+        int64_t* u = &sums.unit[c * cols];
+        for (size_t k = 0; k < cols; k++) {
+            u[k] += llround(counts[k] * scale);
+        }
+    }
+
+    void merge(const Sums& sums) {
+        pthread_mutex_lock(&lock);
+        for (size_t i = 0; i < totals.unit.size(); i++) {
+            totals.unit[i] += sums.unit[i];
+        }
+        for (size_t c = 0; c < classes; c++) {
+            totals.zeros[c] += sums.zeros[c];
+        }
+        pthread_mutex_unlock(&lock);
+    }
+
+    size_t zeros() const {
+        size_t z = 0;
+        for (size_t c : totals.zeros) {
+            z += c;
+        }
+        return z;
+    }
+
+    // Estimated mean angle of every cell, in `errors` the standard error of
+    // each estimate and in `pairs`, if given, how many pairs it is from.
+    // Cells without any pairs are NaN. The control variate only helps when
+    // the rows given are all the rows the estimate is about; without it the
+    // pairs are simply a random sample of every pair the rows were drawn from
+    std::vector<std::vector<double>>
+    grade(std::vector<std::vector<double>>& errors, bool control_variate = true,
+          std::vector<std::vector<size_t>>* pairs = nullptr) const {
+        std::vector<std::vector<double>> means(
+            classes, std::vector<double>(classes, NAN));
+        errors.assign(classes, std::vector<double>(classes, NAN));
+        if (pairs) {
+            pairs->assign(classes, std::vector<size_t>(classes, 0));
+        }
+
+        for (size_t a = 0; a < classes; a++) {
+            for (size_t b = 0; b < classes; b++) {
+                size_t m;
+                estimate(a, b, control_variate, means[a][b], errors[a][b], m);
+                if (pairs) {
+                    (*pairs)[a][b] = m;
+                }
+            }
+        }
+
+        return means;
+    }
+
+  private:
+    // 2^-30 resolution per component, while max_rows rows still add up to
+    // less than 2^63
+    static constexpr double unit_scale = (double)(1ULL << 30);
+    // Fewest pairs a cell is corrected with the control variate on
+    static const size_t cv_min_pairs = 60;
+    static const size_t unsampled = SIZE_MAX;
+
+    // Mean cosine over all pairs of cell [a][b], from the class sums
+    double mean_cosine(size_t a, size_t b) const {
+        const int64_t* ua = &totals.unit[a * cols];
+        const int64_t* ub = &totals.unit[b * cols];
+        double dot = 0;
+        for (size_t k = 0; k < cols; k++) {
+            dot += ((double)ua[k] / unit_scale) * ((double)ub[k] / unit_scale);
+        }
+
+        // Every non-zero row paired with itself adds 1 to u_a . u_a
+        const double nonzero = class_rows[a] - totals.zeros[a];
+        const double pairs = nonzero * (class_rows[b] - (a == b));
+        if (a == b) {
+            dot -= nonzero;
+        }
+
+        return dot / pairs;
+    }
+
+    // Least squares slope of the angles on the cosines of pairs
+    // `half`, `half` + 2, ...
+    static double fit_beta(const std::vector<double>& theta,
+                           const std::vector<double>& cosine, size_t half) {
+        double mt = 0;
+        double mc = 0;
+        size_t n = 0;
+        for (size_t k = half; k < theta.size(); k += 2) {
+            mt += theta[k];
+            mc += cosine[k];
+            n++;
+        }
+        mt /= n;
+        mc /= n;
+
+        double var_c = 0;
+        double cov = 0;
+        for (size_t k = half; k < theta.size(); k += 2) {
+            var_c += (cosine[k] - mc) * (cosine[k] - mc);
+            cov += (theta[k] - mt) * (cosine[k] - mc);
+        }
+
+        return var_c > 0 ? cov / var_c : 0;
+    }
+
+    void estimate(size_t a, size_t b, bool control_variate, double& mean,
+                  double& error, size_t& m) const {
+        // Pairs (first[k], second[k]) use every kept row at most once, so
+        // they are independent. Within a class, the first rows come from one
+        // half of the kept rows and the second ones from the other
+        size_t first_end = sample_begin[a + 1];
+        size_t second = sample_begin[b];
+        const size_t second_end = sample_begin[b + 1];
+        if (a == b) {
+            first_end = sample_begin[a] + (second_end - second) / 2;
+            second = first_end;
+        }
+
+        std::vector<double> theta;
+        std::vector<double> cosine;
+        for (size_t i = sample_begin[a]; i < first_end && second < second_end;
+             i++) {
+            const double* x = &samples[i * cols];
+            const double* y = &samples[second * cols];
+            double dot = 0;
+            double nx = 0;
+            double ny = 0;
+            for (size_t k = 0; k < cols; k++) {
+                dot += x[k] * y[k];
+                nx += x[k] * x[k];
+                ny += y[k] * y[k];
+            }
+
+            if (nx == 0) {
+                continue;
+            }
+
+            second++;
+            if (2 * dot == nx + ny) {
+                theta.push_back(0);
+                cosine.push_back(1);
+            } else if (ny == 0) {
+                theta.push_back(1);
+                cosine.push_back(0);
+            } else {
+                const double c = dot / (sqrt(nx) * sqrt(ny));
+                theta.push_back(acos(c));
+                cosine.push_back(c);
+            }
+        }
+
+        m = theta.size();
+        if (m == 0) {
+            return;
+        }
+
+        // Without the control variate a pair contributes its angle. With it,
+        // the pairs are split in two halves, beta is fitted on each and used
+        // to correct the other, so that no pair is corrected by a beta fitted
+        // on itself: fitting and correcting on the same pairs biases the
+        // estimate by about as much as its standard error. The angle is a
+        // skewed function of the cosine, so with few pairs the corrected
+        // angles' spread is underestimated, and they are only used with
+        // enough of them
+        std::vector<double> r(theta);
+        if (control_variate && m >= cv_min_pairs) {
+            const double target = mean_cosine(a, b);
+            const double beta_fit[2] = {fit_beta(theta, cosine, 1),
+                                        fit_beta(theta, cosine, 0)};
+            for (size_t k = 0; k < m; k++) {
+                r[k] -= beta_fit[k % 2] * (cosine[k] - target);
+            }
+        }
+
+        mean = 0;
+        for (size_t k = 0; k < m; k++) {
+            mean += r[k];
+        }
+        mean /= m;
+
+        double var = 0;
+        for (size_t k = 0; k < m; k++) {
+            var += (r[k] - mean) * (r[k] - mean);
+        }
+        error = m > 1 ? sqrt(var / (m - 1) / m) : INFINITY;
+    }
+
+    const int32_t* labels;
+    size_t cols;
+    size_t classes;
+
+    // Where each row's outputs are kept, or unsampled
+    std::vector<size_t> slot;
+    std::vector<size_t> sample_begin;
+    std::vector<size_t> class_rows;
+    std::vector<double> samples;
+
+    Sums totals;
+    pthread_mutex_t lock;
+};
+
+// Smallest difference between each class's mean angle to itself and its mean
+// angle to any other class, capped at 1 radian. `nearest`, when given, gets
+// the other class it was measured against, or the class itself for the cap.
+// A class without angles of its own, because its outputs are all zeros, gets
+// a delta of 0 rather than the cap
+static inline std::vector<double>
+grade_deltas(const std::vector<std::vector<double>>& means,
+             std::vector<size_t>* nearest = nullptr) {
+    std::vector<double> deltas(means.size());
+    if (nearest) {
+        nearest->resize(means.size());
+    }
+
+    for (size_t i = 0; i < means.size(); i++) {
+        double smallest = std::isnan(means[i][i]) ? 0 : 1;
+        size_t closest = i;
+        for (size_t j = 0; j < means.size(); j++) {
+            if (i != j && std::abs(means[i][i] - means[i][j]) < smallest) {
+                smallest = std::abs(means[i][i] - means[i][j]);
+                closest = j;
+            }
+        }
+
+        deltas[i] = smallest;
+        if (nearest) {
+            (*nearest)[i] = closest;
+        }
+    }
+
+    return deltas;
+}
+
+// Limits a candidate can be rejected by before all of its rows are graded
+struct GradeLimits {
+    // The smallest delta, in radians, it has to be able to beat
+    double min_delta = 0;
+    // The largest fraction of all-zero output vectors it may have
+    double max_zeros = 1;
+
+    bool any() const { return min_delta > 0 || max_zeros < 1; }
+};
+
+// Largest chance each of the bounds below wrongly rejects a candidate, over
+// all of its checkpoints together
+static const double grade_bound_alpha = 0.001;
+// Fewest pairs a cell needs before its mean is used to bound a delta
+static const size_t grade_bound_min_pairs = 30;
+// Rows per class a partial grade samples pairs from
+static const size_t grade_bound_rows = 4096;
+// Fewest rows a partial grade is checked on
+static const size_t grade_bound_min_rows = 64;
+
+// Fractions of the rows after which a partial grade is checked
+static const double grade_checkpoints[] = {1.0 / 16, 1.0 / 8, 1.0 / 4, 1.0 / 2};
+
+// Where the stages of a graded candidate end when it may be rejected early:
+// at each checkpoint with enough rows, then at the last row
+static inline std::vector<size_t> grade_stage_ends(size_t rows,
+                                                   const GradeLimits& limits) {
+    std::vector<size_t> ends;
+    if (limits.any()) {
+        for (double f : grade_checkpoints) {
+            const size_t end = rows * f;
+            if (end >= grade_bound_min_rows &&
+                (ends.empty() || end > ends.back())) {
+                ends.push_back(end);
+            }
+        }
+    }
+
+    ends.push_back(rows);
+    return ends;
+}
+
+// Whether a candidate can be rejected after grading rows order[0..done), a
+// uniformly random subset of its rows. `row_counts(i)` gives the output counts
+// of row i. Rejects, and describes why in `reason`, when
+//   - the Clopper-Pearson lower bound on its fraction of all-zero outputs is
+//     above limits.max_zeros, or
+//   - an upper bound on its smallest delta is below limits.min_delta. Each
+//     cell with at least grade_bound_min_pairs pairs bounds the delta with a
+//     one-sided t interval, Bonferroni corrected over every cell and
+//     checkpoint.
+// Each bound is at level grade_bound_alpha / checkpoints, so either one
+// rejects a candidate that would have met its limit with probability at most
+// grade_bound_alpha
+template <class RowCounts>
+static inline bool grade_reject_partial(const GradeLimits& limits,
+                                        const int32_t* labels,
+                                        const std::vector<size_t>& order,
+                                        size_t done, RowCounts row_counts,
+                                        size_t cols, size_t num_classes,
+                                        std::string& reason) {
+    std::vector<int32_t> sub_labels(done);
+    for (size_t k = 0; k < done; k++) {
+        sub_labels[k] = labels[order[k]];
+    }
+
+    SampledGrader sampler(sub_labels.data(), done, cols, num_classes,
+                          grade_bound_rows, 0);
+    SampledGrader::Sums sums = sampler.make_sums();
+    std::vector<int> v(cols);
+    for (size_t k = 0; k < done; k++) {
+        const auto* counts = row_counts(order[k]);
+        v.assign(counts, counts + cols);
+        sampler.add(k, v, sums);
+    }
+    sampler.merge(sums);
+
+    const double checkpoints =
+        sizeof(grade_checkpoints) / sizeof(*grade_checkpoints);
+    const double alpha = grade_bound_alpha / checkpoints;
+
+    const double zeros_low =
+        grade_proportion_lower(sampler.zeros(), done, alpha);
+    if (zeros_low > limits.max_zeros) {
+        reason = "at least " + std::to_string(zeros_low) +
+                 " of the outputs are all zeros";
+        return true;
+    }
+
+    if (limits.min_delta <= 0) {
+        return false;
+    }
+
+    // Each class's delta is at most its distance to any one other class
+    std::vector<std::vector<double>> errors;
+    std::vector<std::vector<size_t>> pairs;
+    const std::vector<std::vector<double>> means =
+        sampler.grade(errors, false, &pairs);
+    const double cell_alpha = alpha / (num_classes * (num_classes - 1));
+    double bound = 1;
+    for (size_t i = 0; i < num_classes; i++) {
+        for (size_t j = 0; j < num_classes; j++) {
+            const size_t m = std::min(pairs[i][i], pairs[i][j]);
+            if (i == j || m < grade_bound_min_pairs) {
+                continue;
+            }
+
+            const double error = sqrt((errors[i][i] * errors[i][i]) +
+                                      (errors[i][j] * errors[i][j]));
+            const double upper =
+                std::abs(means[i][i] - means[i][j]) +
+                (grade_t_quantile(cell_alpha, m - 1) * error);
+            if (std::isfinite(upper)) {
+                bound = std::min(bound, upper);
+            }
+        }
+    }
+
+    if (bound < limits.min_delta) {
+        reason = "its smallest delta is at most " +
+                 std::to_string(bound * 180 / M_PI);
+        return true;
+    }
+
+    return false;
+}
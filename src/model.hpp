@@ -0,0 +1,169 @@
+#pragma once
+
+// Trained classifier saved by classify and loaded by predict: the readout
+// weights, the encoder parameters used to bin the inputs, and a reference to
+// the reservoir network they were trained against.
+//
+// File layout (native endianness):
+//   ModelHeader
+//   char   network_path[network_path_len]
+//   double d_min[num_inputs]
+//   double d_max[num_inputs]
+//   uint64_t edge_counts[num_inputs]        only for quantile bins
+//   double edges[num_edges]                 only for quantile bins
+//   double w[num_classes * num_features]   row-major, column 0 is the bias
+
+#include "encoder.hpp"
+#include "feature_cache.hpp"
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+static const char model_magic[8] = {'P', 'D', 'L', 'M', 'O', 'D', 'L', '2'};
+
+struct ModelHeader {
+    char magic[8];
+    uint64_t num_classes;
+    uint64_t num_features;
+    uint64_t num_inputs;
+    uint64_t num_bins;
+    uint64_t network_hash;
+    uint64_t network_path_len;
+    // Non-zero when the inputs were binned at quantile edges
+    uint64_t quantile;
+    uint64_t num_edges;
+};
+
+struct Model {
+    std::string network_path;
+    // feature_cache_key() of the network file when the model was saved
+    uint64_t network_hash = 0;
+
+    size_t num_bins = 0;
+    std::vector<double> d_min;
+    std::vector<double> d_max;
+    // Per-feature quantile bin edges, empty for uniform bins
+    std::vector<std::vector<double>> edges;
+
+    size_t num_classes = 0;
+    size_t num_features = 0;
+    std::vector<double> w;
+};
+
+static inline uint64_t network_file_hash(const std::string& path) {
+    return feature_cache_key({path}, "");
+}
+
+static inline bool model_save(const std::string& path, const Model& m) {
+    FILE* f = fopen(path.c_str(), "wb");
+    if (!f) {
+        return false;
+    }
+
+    // Store an absolute path so the model can be used from anywhere
+    char resolved[PATH_MAX];
+    const std::string network_path =
+        realpath(m.network_path.c_str(), resolved) ? resolved : m.network_path;
+
+    ModelHeader h;
+    memcpy(h.magic, model_magic, sizeof(h.magic));
+    h.num_classes = m.num_classes;
+    h.num_features = m.num_features;
+    h.num_inputs = m.d_min.size();
+    h.num_bins = m.num_bins;
+    h.network_hash = m.network_hash;
+    h.network_path_len = network_path.size();
+    h.quantile = !m.edges.empty();
+    h.num_edges = 0;
+
+    std::vector<uint64_t> edge_counts;
+    std::vector<double> edges;
+    for (const std::vector<double>& e : m.edges) {
+        edge_counts.push_back(e.size());
+        edges.insert(edges.end(), e.begin(), e.end());
+        h.num_edges += e.size();
+    }
+
+    bool ok = fwrite(&h, sizeof(h), 1, f) == 1;
+    ok = ok && fwrite(network_path.data(), 1, network_path.size(), f) ==
+                   network_path.size();
+    ok = ok && fwrite(m.d_min.data(), sizeof(double), m.d_min.size(), f) ==
+                   m.d_min.size();
+    ok = ok && fwrite(m.d_max.data(), sizeof(double), m.d_max.size(), f) ==
+                   m.d_max.size();
+    ok = ok && fwrite(edge_counts.data(), sizeof(uint64_t),
+                      edge_counts.size(), f) == edge_counts.size();
+    ok = ok && fwrite(edges.data(), sizeof(double), edges.size(), f) ==
+                   edges.size();
+    ok = ok && fwrite(m.w.data(), sizeof(double), m.w.size(), f) == m.w.size();
+
+    return (fclose(f) == 0) && ok;
+}
+
+static inline bool model_load(const std::string& path, Model& m) {
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f) {
+        return false;
+    }
+
+    ModelHeader h;
+    if (fread(&h, sizeof(h), 1, f) != 1 ||
+        memcmp(h.magic, model_magic, sizeof(h.magic)) != 0 ||
+        h.network_path_len > PATH_MAX) {
+        fclose(f);
+        return false;
+    }
+
+    m.num_classes = h.num_classes;
+    m.num_features = h.num_features;
+    m.num_bins = h.num_bins;
+    m.network_hash = h.network_hash;
+    m.network_path.resize(h.network_path_len);
+    m.d_min.resize(h.num_inputs);
+    m.d_max.resize(h.num_inputs);
+    m.w.resize(h.num_classes * h.num_features);
+
+    bool ok = fread(&m.network_path[0], 1, h.network_path_len, f) ==
+              h.network_path_len;
+    ok = ok && fread(m.d_min.data(), sizeof(double), m.d_min.size(), f) ==
+                   m.d_min.size();
+    ok = ok && fread(m.d_max.data(), sizeof(double), m.d_max.size(), f) ==
+                   m.d_max.size();
+
+    std::vector<uint64_t> edge_counts(h.quantile ? h.num_inputs : 0);
+    std::vector<double> edges(h.num_edges);
+    ok = ok && fread(edge_counts.data(), sizeof(uint64_t), edge_counts.size(),
+                     f) == edge_counts.size();
+    ok = ok && fread(edges.data(), sizeof(double), edges.size(), f) ==
+                   edges.size();
+
+    m.edges.clear();
+    size_t next = 0;
+    for (size_t i = 0; ok && i < edge_counts.size(); i++) {
+        ok = next + edge_counts[i] <= edges.size();
+        if (ok) {
+            m.edges.emplace_back(edges.begin() + next,
+                                 edges.begin() + next + edge_counts[i]);
+            next += edge_counts[i];
+        }
+    }
+
+    ok = ok && fread(m.w.data(), sizeof(double), m.w.size(), f) == m.w.size();
+
+    fclose(f);
+    return ok;
+}
+
+// The encoder the model was trained with
+static inline SpikeEncoder model_encoder(const Model& m) {
+    if (!m.edges.empty()) {
+        return SpikeEncoder(m.edges);
+    }
+
+    return SpikeEncoder(m.d_min.data(), m.d_max.data(), m.d_min.size(),
+                        m.num_bins);
+}
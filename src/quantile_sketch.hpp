@@ -0,0 +1,123 @@
+#pragma once
+
+// Mergeable streaming quantile sketch used to pick equal-mass bin edges.
+// Values are kept in levels of at most `k` items, an item on level h standing
+// for 2^h of the values seen. When a level fills up it is sorted and every
+// other item is promoted to the next level, so memory stays O(k log(n / k))
+// and the rank error of a query is about log2(n / k) / k of n. Up to k values
+// are kept exactly. Compaction alternates deterministically between odd and
+// even items, so feeding and merging sketches in the same order always gives
+// the same edges.
+
+#include <algorithm>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+class QuantileSketch {
+  public:
+    explicit QuantileSketch(size_t k = 512) : k(k), levels(1) {}
+
+    void add(double v) {
+        levels[0].push_back(v);
+        n++;
+        if (levels[0].size() >= k) {
+            compress();
+        }
+    }
+
+    void merge(const QuantileSketch& other) {
+        if (levels.size() < other.levels.size()) {
+            levels.resize(other.levels.size());
+        }
+
+        for (size_t h = 0; h < other.levels.size(); h++) {
+            levels[h].insert(levels[h].end(), other.levels[h].begin(),
+                             other.levels[h].end());
+        }
+
+        n += other.n;
+        compress();
+    }
+
+    size_t count() const { return n; }
+
+    // Interior edges splitting the values into num_bins bins of about equal
+    // mass, where a value x falls in bin upper_bound(edges, x). Edges that
+    // would only create empty bins (repeats, or at or below the smallest
+    // value) are left out, so heavily tied features get fewer bins and a
+    // constant feature gets none.
+    std::vector<double> edges(size_t num_bins) const {
+        std::vector<std::pair<double, size_t>> items;
+        for (size_t h = 0; h < levels.size(); h++) {
+            for (double v : levels[h]) {
+                items.push_back({v, (size_t)1 << h});
+            }
+        }
+
+        std::vector<double> result;
+        if (items.empty() || num_bins < 2) {
+            return result;
+        }
+
+        std::sort(items.begin(), items.end());
+
+        size_t total = 0;
+        for (const auto& item : items) {
+            total += item.second;
+        }
+
+        // Edge j is the first value with at least j / num_bins of the mass
+        // strictly below it
+        size_t below = 0;
+        size_t j = 1;
+        for (size_t i = 0; i < items.size() && j < num_bins; i++) {
+            while (j < num_bins && below * num_bins >= j * total) {
+                if (items[i].first > items[0].first &&
+                    (result.empty() || items[i].first > result.back())) {
+                    result.push_back(items[i].first);
+                }
+                j++;
+            }
+            below += items[i].second;
+        }
+
+        return result;
+    }
+
+  private:
+    void compress() {
+        for (size_t h = 0; h < levels.size(); h++) {
+            if (levels[h].size() < k) {
+                continue;
+            }
+
+            if (h + 1 == levels.size()) {
+                levels.emplace_back();
+            }
+
+            std::vector<double>& level = levels[h];
+            std::sort(level.begin(), level.end());
+
+            // An odd item out stays behind at this level
+            const size_t pairs = level.size() / 2;
+            const size_t offset = flip ? 1 : 0;
+            flip = !flip;
+            for (size_t i = 0; i < pairs; i++) {
+                levels[h + 1].push_back(level[(2 * i) + offset]);
+            }
+
+            if (level.size() % 2 == 1) {
+                level[0] = level.back();
+                level.resize(1);
+            } else {
+                level.clear();
+            }
+        }
+    }
+
+    size_t k;
+    size_t n = 0;
+    std::vector<std::vector<double>> levels;
+    bool flip = false;
+};
@@ -0,0 +1,452 @@
+#pragma once
+
+// Training routines for the linear readout that sits on top of the reservoir.
+
+#include "feature_cache.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// In place Cholesky factorization of the symmetric positive definite n x n
+// matrix `a` (row-major, lower triangle used). Returns false if a pivot is not
+// positive.
+static inline bool cholesky(std::vector<double>& a, size_t n) {
+    for (size_t j = 0; j < n; j++) {
+        double d = a[(j * n) + j];
+        for (size_t k = 0; k < j; k++) {
+            d -= a[(j * n) + k] * a[(j * n) + k];
+        }
+
+        if (!(d > 0)) {
+            return false;
+        }
+
+        d = sqrt(d);
+        a[(j * n) + j] = d;
+
+        for (size_t i = j + 1; i < n; i++) {
+            double s = a[(i * n) + j];
+            for (size_t k = 0; k < j; k++) {
+                s -= a[(i * n) + k] * a[(j * n) + k];
+            }
+            a[(i * n) + j] = s / d;
+        }
+    }
+
+    return true;
+}
+
+// Solves L L^T x = b in place given the factor from cholesky()
+static inline void cholesky_solve(const std::vector<double>& l, size_t n,
+                                  double* b) {
+    for (size_t i = 0; i < n; i++) {
+        double s = b[i];
+        for (size_t k = 0; k < i; k++) {
+            s -= l[(i * n) + k] * b[k];
+        }
+        b[i] = s / l[(i * n) + i];
+    }
+
+    for (size_t i = n; i-- > 0;) {
+        double s = b[i];
+        for (size_t k = i + 1; k < n; k++) {
+            s -= l[(k * n) + i] * b[k];
+        }
+        b[i] = s / l[(i * n) + i];
+    }
+}
+
+// One-vs-rest ridge regression on one-hot targets, i.e. the minimizer of
+//   (1/N) ||XW^T - Y||^2 + lambda ||W||^2
+// found through the normal equations (X^T X + N lambda I) W^T = X^T Y.
+// Writes `w` as a row-major class x feature matrix, returns false if the
+// system is singular. Only the given `rows` are fit when they are set, so that
+// rows held out for validation stay unseen.
+static inline bool ridge_solve(const FeatureMatrix& m, size_t num_classes,
+                               double lambda, std::vector<double>& w,
+                               const std::vector<size_t>* rows = nullptr) {
+    const size_t n = m.cols;
+    const size_t num_rows = rows ? rows->size() : m.rows;
+    std::vector<double> a(n * n, 0);
+    std::vector<double> b(num_classes * n, 0);
+
+    // Only the lower triangle of X^T X is needed by the factorization
+    for (size_t k = 0; k < num_rows; k++) {
+        const size_t r = rows ? (*rows)[k] : k;
+        const double* x = m.row(r);
+
+        for (size_t i = 0; i < n; i++) {
+            const double xi = x[i];
+            if (xi == 0) {
+                continue;
+            }
+
+            double* a_row = &a[i * n];
+            for (size_t j = 0; j <= i; j++) {
+                a_row[j] += xi * x[j];
+            }
+        }
+
+        if (m.y[r] >= 0 && (size_t)m.y[r] < num_classes) {
+            double* b_row = &b[m.y[r] * n];
+            for (size_t j = 0; j < n; j++) {
+                b_row[j] += x[j];
+            }
+        }
+    }
+
+    double trace = 0;
+    for (size_t i = 0; i < n; i++) {
+        a[(i * n) + i] += lambda * num_rows;
+        trace += a[(i * n) + i];
+    }
+
+    // Output neurons that never fire leave empty rows behind, so with a tiny
+    // lambda the system can still be numerically singular. Add just enough
+    // jitter to make it factor.
+    std::vector<double> l = a;
+    double jitter = 1e-12 * (trace / n);
+    while (!cholesky(l, n)) {
+        if (!(jitter > 0) || jitter > trace) {
+            return false;
+        }
+
+        l = a;
+        for (size_t i = 0; i < n; i++) {
+            l[(i * n) + i] += jitter;
+        }
+        jitter *= 10;
+    }
+
+    for (size_t c = 0; c < num_classes; c++) {
+        cholesky_solve(l, n, &b[c * n]);
+    }
+    w = b;
+
+    return true;
+}
+
+// Per-thread scratch space and prediction statistics for Readout::gradient()
+template <typename T> struct ReadoutWorkspace {
+    ReadoutWorkspace(size_t num_classes, size_t num_features)
+        : grad(num_classes * num_features),
+          conf(num_classes, std::vector<int>(num_classes, 0)) {}
+
+    void clear_grad() { std::fill(grad.begin(), grad.end(), 0); }
+
+    void clear_stats() {
+        loss = 0;
+        correct = 0;
+        total = 0;
+        for (std::vector<int>& row : conf) {
+            std::fill(row.begin(), row.end(), 0);
+        }
+    }
+
+    std::vector<T> batch;
+    std::vector<T> probs;
+    std::vector<T> grad;
+
+    double loss = 0;
+    size_t correct = 0;
+    size_t total = 0;
+    std::vector<std::vector<int>> conf;
+};
+
+// Softmax regression readout over `num_features` inputs (bias included).
+// Weights are a single row-major num_classes x num_features matrix and every
+// mini-batch is evaluated as a pair of small matrix-matrix products, logits =
+// X W^T and gradient = (P - Y)^T X, over a packed copy of the batch rows.
+// T is float or double.
+template <typename T> class Readout {
+  public:
+    Readout(size_t num_classes, size_t num_features)
+        : num_classes(num_classes), num_features(num_features),
+          w(num_classes * num_features) {}
+
+    // Writes softmax probabilities for `rows` contiguous samples into `p`
+    // (rows x num_classes)
+    void forward(const T* x, size_t rows, T* p) const {
+        logits(x, rows, p);
+        for (size_t b = 0; b < rows; b++) {
+            softmax_row(p + (b * num_classes));
+        }
+    }
+
+    // Adds the gradient of the cross entropy over the rows of `data` selected
+    // by `idx` to ws.grad, and records the predictions in ws's statistics.
+    // Only reads the weights, so several threads may call it at once.
+    void gradient(ReadoutWorkspace<T>& ws, const T* data,
+                  const int32_t* labels, const size_t* idx, size_t n) const {
+        ws.batch.resize(n * num_features);
+        ws.probs.resize(n * num_classes);
+
+        for (size_t b = 0; b < n; b++) {
+            const T* src = data + (idx[b] * num_features);
+            std::copy(src, src + num_features, &ws.batch[b * num_features]);
+        }
+
+        forward(ws.batch.data(), n, ws.probs.data());
+
+        // probs becomes dL/dlogits = P - Y
+        for (size_t b = 0; b < n; b++) {
+            T* p = &ws.probs[b * num_classes];
+            const int32_t label = labels[idx[b]];
+            const size_t predicted = std::max_element(p, p + num_classes) - p;
+
+            ws.loss += -log((double)p[label]);
+            ws.correct += predicted == (size_t)label;
+            ws.conf[label][predicted]++;
+
+            p[label] -= 1;
+        }
+        ws.total += n;
+
+        // grad += (P - Y)^T X, one axpy per (sample, class)
+        for (size_t c = 0; c < num_classes; c++) {
+            T* g = &ws.grad[c * num_features];
+            for (size_t b = 0; b < n; b++) {
+                const T d = ws.probs[(b * num_classes) + c];
+                const T* x = &ws.batch[b * num_features];
+#pragma omp simd
+                for (size_t j = 0; j < num_features; j++) {
+                    g[j] += d * x[j];
+                }
+            }
+        }
+    }
+
+    size_t num_classes;
+    size_t num_features;
+    std::vector<T> w;
+
+  private:
+    // Column block size for the logits kernel, keeps a block of every row in
+    // the batch resident while it is reused across classes
+    static const size_t block = 256;
+
+    // out (rows x num_classes) = x (rows x num_features) W^T
+    void logits(const T* x, size_t rows, T* out) const {
+        std::fill(out, out + (rows * num_classes), 0);
+
+        for (size_t j0 = 0; j0 < num_features; j0 += block) {
+            const size_t j1 = std::min(j0 + block, num_features);
+
+            for (size_t c = 0; c < num_classes; c++) {
+                const T* wc = &w[c * num_features];
+                size_t b = 0;
+
+                // Four rows at a time so each weight block is loaded once
+                for (; b + 4 <= rows; b += 4) {
+                    const T* x0 = x + ((b + 0) * num_features);
+                    const T* x1 = x + ((b + 1) * num_features);
+                    const T* x2 = x + ((b + 2) * num_features);
+                    const T* x3 = x + ((b + 3) * num_features);
+                    T s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+#pragma omp simd reduction(+ : s0, s1, s2, s3)
+                    for (size_t j = j0; j < j1; j++) {
+                        s0 += x0[j] * wc[j];
+                        s1 += x1[j] * wc[j];
+                        s2 += x2[j] * wc[j];
+                        s3 += x3[j] * wc[j];
+                    }
+                    out[((b + 0) * num_classes) + c] += s0;
+                    out[((b + 1) * num_classes) + c] += s1;
+                    out[((b + 2) * num_classes) + c] += s2;
+                    out[((b + 3) * num_classes) + c] += s3;
+                }
+
+                for (; b < rows; b++) {
+                    const T* xb = x + (b * num_features);
+                    T s = 0;
+#pragma omp simd reduction(+ : s)
+                    for (size_t j = j0; j < j1; j++) {
+                        s += xb[j] * wc[j];
+                    }
+                    out[(b * num_classes) + c] += s;
+                }
+            }
+        }
+    }
+
+    // Max-shifted so large logits do not overflow, especially in float
+    void softmax_row(T* z) const {
+        const T max_z = *std::max_element(z, z + num_classes);
+        T exp_sum = 0;
+        for (size_t c = 0; c < num_classes; c++) {
+            z[c] = exp(z[c] - max_z);
+            exp_sum += z[c];
+        }
+
+        for (size_t c = 0; c < num_classes; c++) {
+            z[c] /= exp_sum;
+        }
+    }
+};
+
+enum class OptimizerKind { average, sgd, momentum, nesterov, adam };
+
+struct OptimizerParams {
+    OptimizerKind kind = OptimizerKind::average;
+    double momentum = 0.9; // also Adam's beta1
+    double beta2 = 0.999;
+    double epsilon = 1e-8;
+};
+
+// Maps an --optimizer argument to its kind, returns false if unknown
+static inline bool parse_optimizer(const std::string& name,
+                                   OptimizerKind& kind) {
+    if (name == "average") {
+        kind = OptimizerKind::average;
+    } else if (name == "sgd") {
+        kind = OptimizerKind::sgd;
+    } else if (name == "momentum") {
+        kind = OptimizerKind::momentum;
+    } else if (name == "nesterov") {
+        kind = OptimizerKind::nesterov;
+    } else if (name == "adam") {
+        kind = OptimizerKind::adam;
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+// Weight update rules for the readout. Every rule also decays the weights by
+// lambda * w per step.
+//   average:  each sample contributes learning_rate * gradient + lambda * w
+//             to a running sum and the weights move by the mean of that sum
+//             over every sample seen so far (the original classify update)
+//   sgd:      w -= learning_rate * g, g being the batch mean gradient
+//   momentum: v = mu v + g, w -= learning_rate * v
+//   nesterov: v = mu v + g, w -= learning_rate * (g + mu v)
+//   adam:     bias corrected first/second moment estimates of g
+class Optimizer {
+  public:
+    Optimizer(const OptimizerParams& params, size_t num_weights)
+        : params(params), m(num_weights),
+          v(params.kind == OptimizerKind::adam ? num_weights : 0) {}
+
+    // Records that the next update covers `n` more samples
+    void advance(size_t n) {
+        update_count += n;
+        steps++;
+    }
+
+    // Applies the update for weights [k0, k1) given the summed gradient of
+    // the last `n` samples. Disjoint ranges may be applied concurrently.
+    template <typename T>
+    void apply(T* w, const T* grad, size_t n, double learning_rate,
+               double lambda, size_t k0, size_t k1) {
+        const double mu = params.momentum;
+        const double inv_n = 1.0 / n;
+
+        switch (params.kind) {
+        case OptimizerKind::average: {
+            const double inv_count = 1.0 / update_count;
+            for (size_t k = k0; k < k1; k++) {
+                m[k] -= (learning_rate * grad[k]) + (n * lambda * w[k]);
+                commit(w[k], m[k] * inv_count);
+            }
+            break;
+        }
+        case OptimizerKind::sgd:
+            for (size_t k = k0; k < k1; k++) {
+                commit(w[k],
+                       -(learning_rate * grad[k] * inv_n) - (lambda * w[k]));
+            }
+            break;
+        case OptimizerKind::momentum:
+        case OptimizerKind::nesterov: {
+            const bool nesterov = params.kind == OptimizerKind::nesterov;
+            for (size_t k = k0; k < k1; k++) {
+                const double g = grad[k] * inv_n;
+                m[k] = (mu * m[k]) + g;
+                const double step = nesterov ? g + (mu * m[k]) : m[k];
+                commit(w[k], -(learning_rate * step) - (lambda * w[k]));
+            }
+            break;
+        }
+        case OptimizerKind::adam: {
+            const double b1 = mu;
+            const double b2 = params.beta2;
+            const double c1 = 1 - pow(b1, (double)steps);
+            const double c2 = 1 - pow(b2, (double)steps);
+            for (size_t k = k0; k < k1; k++) {
+                const double g = grad[k] * inv_n;
+                m[k] = (b1 * m[k]) + ((1 - b1) * g);
+                v[k] = (b2 * v[k]) + ((1 - b2) * g * g);
+                const double step =
+                    (m[k] / c1) / (sqrt(v[k] / c2) + params.epsilon);
+                commit(w[k], -(learning_rate * step) - (lambda * w[k]));
+            }
+            break;
+        }
+        }
+    }
+
+  private:
+    template <typename T> static void commit(T& w, double update) {
+        // Prevent adding nan or infinity
+        if (std::isnormal(update)) {
+            w += update;
+        }
+    }
+
+    OptimizerParams params;
+    std::vector<double> m;
+    std::vector<double> v;
+    size_t update_count = 0;
+    size_t steps = 0;
+};
+
+enum class LrSchedule { constant, step, exponential, cosine };
+
+struct LrScheduleParams {
+    LrSchedule schedule = LrSchedule::constant;
+    double decay = 0.5;
+    size_t step = 100;
+};
+
+// Maps an --lr-schedule argument to its schedule, returns false if unknown
+static inline bool parse_lr_schedule(const std::string& name,
+                                     LrSchedule& schedule) {
+    if (name == "constant") {
+        schedule = LrSchedule::constant;
+    } else if (name == "step") {
+        schedule = LrSchedule::step;
+    } else if (name == "exp") {
+        schedule = LrSchedule::exponential;
+    } else if (name == "cosine") {
+        schedule = LrSchedule::cosine;
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+// Learning rate to use during `epoch` out of `total_epochs`
+//   step:   multiplied by decay every `step` epochs
+//   exp:    multiplied by decay every epoch
+//   cosine: annealed from the base rate to 0 over total_epochs
+static inline double scheduled_learning_rate(const LrScheduleParams& p,
+                                             double base, size_t epoch,
+                                             size_t total_epochs) {
+    switch (p.schedule) {
+    case LrSchedule::step:
+        return base * pow(p.decay, (double)(epoch / std::max(p.step, (size_t)1)));
+    case LrSchedule::exponential:
+        return base * pow(p.decay, (double)epoch);
+    case LrSchedule::cosine:
+        return base * 0.5 *
+               (1 + cos(M_PI * epoch / (double)std::max(total_epochs, (size_t)1)));
+    case LrSchedule::constant:
+    default:
+        return base;
+    }
+}
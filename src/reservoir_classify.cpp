@@ -1,4 +1,12 @@
+#include "dataset.hpp"
+#include "encoder.hpp"
+#include "feature_cache.hpp"
 #include "framework.hpp"
+#include "grading.hpp"
+#include "model.hpp"
+#include "readout.hpp"
+#include "simulation.hpp"
+#include "spike_cache.hpp"
 #include <algorithm>
 #include <atomic>
 #include <cassert>
@@ -6,7 +14,9 @@
 #include <cstddef>
 #include <cstdlib>
 #include <fstream>
+#include <getopt.h>
 #include <iostream>
+#include <numeric>
 #include <pthread.h>
 #include <stddef.h>
 #include <string>
@@ -17,42 +27,90 @@ using namespace std;
 using namespace neuro;
 using nlohmann::json;
 
-struct Observation {
-    vector<double> x;
-    int y;
+struct TrainOptions {
+    double learning_rate;
+    double lambda;
+    size_t total_epochs;
+    size_t batch_size;
+    size_t train_threads;
+    bool hogwild;
+    unsigned seed;
+    bool verbose;
+
+    // Fraction of the rows held out for early stopping, 0 disables it
+    double validation;
+    size_t patience;
+    double min_delta;
+
+    OptimizerParams optimizer;
+    LrScheduleParams schedule;
+    FILE* log;
 };
 
-void softmax(vector<double>& x) {
-    double exp_sum = 0;
-    for (double a : x) {
-        exp_sum += exp(a);
-    }
-
-    for (double& a : x) {
-        a = exp(a) / exp_sum;
+void print_confusion(const vector<vector<int>>& conf) {
+    printf("CONFUSION MATRIX:\n");
+    for (size_t i = 0; i < conf.size(); i++) {
+        for (size_t j = 0; j < conf[i].size(); j++) {
+            printf("%4d ", conf[i][j]);
+        }
+        puts("");
     }
+    puts("");
 }
 
-int max_idx(const vector<double>& x) {
-    double max_elem = -1;
-    int max_idx = 0;
+// Runs the readout over every row without updating it
+template <typename T>
+void evaluate(const Readout<T>& r, const T* x, const int32_t* y, size_t rows,
+              vector<vector<int>>& conf, double& loss, size_t& correct) {
+    const size_t chunk = 256;
+    vector<T> probs(chunk * r.num_classes);
+
+    loss = 0;
+    correct = 0;
+
+    for (size_t start = 0; start < rows; start += chunk) {
+        const size_t n = min(chunk, rows - start);
+        r.forward(x + (start * r.num_features), n, probs.data());
+
+        for (size_t b = 0; b < n; b++) {
+            const T* p = &probs[b * r.num_classes];
+            const int32_t label = y[start + b];
+            const size_t predicted = max_element(p, p + r.num_classes) - p;
 
-    for (size_t i = 0; i < x.size(); i++) {
-        if (x[i] > max_elem) {
-            max_elem = x[i];
-            max_idx = i;
+            loss += -log((double)p[label]);
+            correct += predicted == (size_t)label;
+            conf[label][predicted]++;
         }
     }
+}
+
+// The readout trains on a T copy of the features, doubles are used in place
+template <typename T>
+const T* feature_data(const FeatureMatrix& m, vector<T>& storage) {
+    storage.assign(m.x, m.x + (m.rows * m.cols));
+    return storage.data();
+}
 
-    return max_idx;
+template <>
+const double* feature_data(const FeatureMatrix& m, vector<double>&) {
+    return m.x;
 }
 
-vector<Observation> processed_data;
-vector<Observation> dataset;
+// Features of every row after each horizon's steps, just the full duration
+// unless --horizons is given
+vector<int> horizons;
+vector<FeatureMatrix> horizon_data;
+Dataset dataset;
 atomic_size_t idx = 0;
-json d_min;
-json d_max;
+vector<double> d_min;
+vector<double> d_max;
 size_t num_bins;
+SpikeEncoder encoder;
+// Input neurons of every row, encoder.width() per row
+vector<uint16_t> encoded;
+SpikeCache spike_cache;
+SimulationOptions simulation;
+StepHistogram steps(simulation.duration);
 
 void* worker(void* arg) {
     Network* n = (Network*)arg;
@@ -75,85 +133,956 @@ void* worker(void* arg) {
     while (true) {
         size_t work_idx = idx++;
 
-        if (work_idx >= dataset.size()) {
+        if (work_idx >= dataset.rows) {
             break;
         }
 
-        Observation o = dataset[work_idx];
+        const uint16_t* row = &encoded[work_idx * encoder.width()];
+        const vector<uint16_t> spikes(row, row + encoder.width());
 
-        p->clear_activity();
+        // num_outputs per horizon
+        vector<int> output_counts;
+        if (!spike_cache.lookup(spikes, output_counts)) {
+            p->clear_activity();
+            for (uint16_t s : spikes) {
+                p->apply_spike({s, 0, 255}, false);
+            }
 
-        for (size_t i = 0; i < o.x.size(); i++) {
-            const double encoder_range =
-                (double)d_max.at(i) - (double)d_min.at(i);
-            const double bin_width = encoder_range / num_bins;
-            const double bin =
-                encoder_range == 0
-                    ? 0
-                    : min(floor((o.x[i] - (double)d_min.at(i)) / bin_width),
-                          (double)num_bins - 1);
-            const int idx = (num_bins * i) + bin;
+            simulation_run(p, simulation, horizons, output_counts, &steps);
+            spike_cache.insert(spikes, output_counts);
+        }
 
-            fprintf(stderr, "Min: %f, Max: %f, X: %f, Bin: %f, idx: %d\n",
-                    (double)d_min.at(i), (double)d_max.at(i), o.x[i], bin, idx);
+        for (size_t h = 0; h < horizons.size(); h++) {
+            const int* counts = &output_counts[h * num_outputs];
 
-            p->apply_spike({idx, 0, 255}, false);
+            // 1 for bias
+            double* x = horizon_data[h].row(work_idx);
+            x[0] = 1;
+            for (size_t i = 0; i < num_outputs; i++) {
+                x[i + 1] = counts[i] / (double)horizons[h];
+            }
+
+            horizon_data[h].y[work_idx] = dataset.y[work_idx];
         }
+    }
 
-        p->run(100);
+    delete p;
 
-        // 1 for bias
-        processed_data[work_idx].x.push_back(1);
-        vector<int> output_counts = p->output_counts();
-        for (int a : output_counts) {
-            processed_data[work_idx].x.push_back(a / (double)100);
+    return nullptr;
+}
+
+// State shared by the threads training one readout
+template <typename T> struct Trainer {
+    const FeatureMatrix* data;
+    const T* x;
+    const TrainOptions* opt;
+    Readout<T>* r;
+    size_t num_threads;
+    unsigned seed;
+    // opt.batch_size, but no more than the training rows
+    size_t batch_size;
+
+    vector<size_t> order;
+    pthread_barrier_t barrier;
+    vector<ReadoutWorkspace<T>> ws;
+
+    // Synchronous mode shares one optimizer and reduces every thread's
+    // gradient into `grad`, hogwild gives each thread its own optimizer
+    vector<Optimizer> states;
+    vector<T> grad;
+
+    // Held out rows, packed, and the best weights seen on them
+    size_t val_rows = 0;
+    vector<T> val_x;
+    vector<int32_t> val_y;
+    vector<T> best_w;
+    double best_loss = INFINITY;
+    size_t best_epoch = 0;
+    size_t bad_epochs = 0;
+    bool stop = false;
+};
+
+// Scores the held out rows, keeps a copy of the weights whenever the
+// validation loss improves by more than min_delta, and returns true once it
+// has not for `patience` epochs
+template <typename T>
+bool validate(Trainer<T>& t, size_t epoch, double& loss, double& accuracy) {
+    const TrainOptions& opt = *t.opt;
+    vector<vector<int>> conf(t.r->num_classes,
+                             vector<int>(t.r->num_classes, 0));
+    size_t correct;
+
+    evaluate(*t.r, t.val_x.data(), t.val_y.data(), t.val_rows, conf, loss,
+             correct);
+    loss /= t.val_rows;
+    accuracy = correct / (double)t.val_rows;
+
+    if (t.best_loss - loss > opt.min_delta) {
+        t.best_loss = loss;
+        t.best_w = t.r->w;
+        t.best_epoch = epoch;
+        t.bad_epochs = 0;
+    } else {
+        t.bad_epochs++;
+    }
+
+    return opt.patience > 0 && t.bad_epochs >= opt.patience;
+}
+
+template <typename T> struct TrainerThread {
+    Trainer<T>* t;
+    size_t id;
+};
+
+template <typename T> void* train_worker(void* arg) {
+    TrainerThread<T>* tt = (TrainerThread<T>*)arg;
+    Trainer<T>& t = *tt->t;
+    const size_t id = tt->id;
+    const size_t nt = t.num_threads;
+    const TrainOptions& opt = *t.opt;
+    const size_t batch_size = t.batch_size;
+    const size_t num_batches = t.order.size() / batch_size;
+    const size_t num_weights = t.r->w.size();
+    ReadoutWorkspace<T>& ws = t.ws[id];
+
+    // Synchronous mode splits every batch, and the weights it reduces and
+    // updates, into fixed per-thread slices
+    const size_t b0 = (batch_size * id) / nt;
+    const size_t b1 = (batch_size * (id + 1)) / nt;
+    const size_t k0 = (num_weights * id) / nt;
+    const size_t k1 = (num_weights * (id + 1)) / nt;
+
+    // Hogwild threads' own copy of the weights, and what it was before their
+    // last update
+    Readout<T> local(t.r->num_classes, t.r->num_features);
+    vector<T> before(num_weights);
+
+    const auto start = chrono::steady_clock::now();
+
+    for (size_t epochs = 0; epochs < opt.total_epochs; epochs++) {
+        const double learning_rate = scheduled_learning_rate(
+            opt.schedule, opt.learning_rate, epochs, opt.total_epochs);
+
+        if (id == 0) {
+            if (opt.verbose) {
+                printf("Epoch %zu:\n", epochs);
+            }
+            shuffle(t.order.begin(), t.order.end(),
+                    std::default_random_engine(t.seed));
         }
+        ws.clear_stats();
+        pthread_barrier_wait(&t.barrier);
+
+        if (opt.hogwild) {
+            // Lock-free: every thread trains a snapshot of the shared weights
+            // on its own batches and adds its change back, racing with the
+            // others by design. Updates may be lost, but every access is a
+            // relaxed atomic one, so none is a data race
+            for (size_t batch = id; batch < num_batches; batch += nt) {
+                if (id == 0 && opt.verbose) {
+                    printf("\0331\rBatch: %zu/%zu", batch + 1, num_batches);
+                }
 
-        processed_data[work_idx].y = o.y;
+                for (size_t k = 0; k < num_weights; k++) {
+                    before[k] = atomic_ref<T>(t.r->w[k]).load(
+                        memory_order_relaxed);
+                }
+                copy(before.begin(), before.end(), local.w.begin());
+
+                ws.clear_grad();
+                local.gradient(ws, t.x, t.data->y,
+                               &t.order[batch * batch_size], batch_size);
+                t.states[id].advance(batch_size);
+                t.states[id].apply(local.w.data(), ws.grad.data(), batch_size,
+                                   learning_rate, opt.lambda, 0, num_weights);
+
+                for (size_t k = 0; k < num_weights; k++) {
+                    atomic_ref<T> w(t.r->w[k]);
+                    w.store(w.load(memory_order_relaxed) + local.w[k] -
+                                before[k],
+                            memory_order_relaxed);
+                }
+            }
+        } else {
+            for (size_t batch = 0; batch < num_batches; batch++) {
+                if (id == 0) {
+                    if (opt.verbose) {
+                        printf("\0331\rBatch: %zu/%zu", batch + 1,
+                               num_batches);
+                    }
+                    t.states[0].advance(batch_size);
+                }
+
+                ws.clear_grad();
+                t.r->gradient(ws, t.x, t.data->y,
+                              &t.order[(batch * batch_size) + b0], b1 - b0);
+                pthread_barrier_wait(&t.barrier);
+
+                // Always summed in thread order, so the result only depends on
+                // the seed and thread count
+                for (size_t k = k0; k < k1; k++) {
+                    T sum = 0;
+                    for (size_t i = 0; i < nt; i++) {
+                        sum += t.ws[i].grad[k];
+                    }
+                    t.grad[k] = sum;
+                }
+                t.states[0].apply(t.r->w.data(), t.grad.data(), batch_size,
+                                  learning_rate, opt.lambda, k0, k1);
+                pthread_barrier_wait(&t.barrier);
+            }
+        }
+
+        pthread_barrier_wait(&t.barrier);
+
+        double val_loss = 0;
+        double val_accuracy = 0;
+        if (id == 0 && t.val_rows > 0) {
+            t.stop = validate(t, epochs, val_loss, val_accuracy);
+        }
+
+        if (id == 0 && opt.verbose) {
+            for (size_t i = 1; i < nt; i++) {
+                ws.loss += t.ws[i].loss;
+                ws.correct += t.ws[i].correct;
+                ws.total += t.ws[i].total;
+                for (size_t c = 0; c < ws.conf.size(); c++) {
+                    for (size_t d = 0; d < ws.conf[c].size(); d++) {
+                        ws.conf[c][d] += t.ws[i].conf[c][d];
+                    }
+                }
+            }
+
+            if (epochs == opt.total_epochs - 1 || t.stop) {
+                print_confusion(ws.conf);
+            }
+
+            printf(" Accuracy: %.2f, Loss: %.2f", ws.correct / (double)ws.total,
+                   ws.loss / (double)ws.total);
+            if (t.val_rows > 0) {
+                printf(", Validation Accuracy: %.2f, Validation Loss: %.2f",
+                       val_accuracy, val_loss);
+            }
+            printf("\n");
+
+            if (opt.log) {
+                const double seconds = chrono::duration<double>(
+                                           chrono::steady_clock::now() - start)
+                                           .count();
+                fprintf(opt.log, "%zu,%f,%g,%f,%f", epochs, seconds,
+                        learning_rate, ws.loss / (double)ws.total,
+                        ws.correct / (double)ws.total);
+                if (t.val_rows > 0) {
+                    fprintf(opt.log, ",%f,%f", val_loss, val_accuracy);
+                } else {
+                    fprintf(opt.log, ",,");
+                }
+                fprintf(opt.log, "\n");
+                fflush(opt.log);
+            }
+
+            if (t.stop) {
+                printf("Early stopping after epoch %zu, no improvement since "
+                       "epoch %zu\n",
+                       epochs, t.best_epoch);
+            }
+        }
+
+        // Keep the next epoch's shuffle from racing with the stats above
+        pthread_barrier_wait(&t.barrier);
+
+        if (t.stop) {
+            break;
+        }
     }
 
-    delete p;
+    return nullptr;
+}
+
+// Puts the row indices of a `rows` row dataset in `order` and returns how many
+// of them opt.validation holds out, which come first. Indices are shuffled with
+// opt.seed rather than the rows themselves, the feature matrix may be mapped
+// straight from the cache. The ridge solution fits the same training rows as
+// SGD, so that it never sees the held out ones
+size_t validation_split(size_t rows, const TrainOptions& opt,
+                        vector<size_t>& order) {
+    order.resize(rows);
+    iota(order.begin(), order.end(), 0);
+    if (opt.validation <= 0) {
+        return 0;
+    }
+
+    shuffle(order.begin(), order.end(), std::default_random_engine(opt.seed));
+    return min((size_t)(rows * opt.validation), rows - 1);
+}
+
+// Runs opt.total_epochs epochs of SGD on `r` over the features `x`. With
+// opt.validation set, the final weights' loss and accuracy on the held out
+// rows go to `val_loss` and `val_accuracy` when given
+template <typename T>
+void fit(const FeatureMatrix& data, const T* x, Readout<T>& r,
+         const TrainOptions& opt, double* val_loss = nullptr,
+         double* val_accuracy = nullptr) {
+    const size_t num_classes = r.num_classes;
+
+    Trainer<T> t;
+    t.data = &data;
+    t.x = x;
+    t.opt = &opt;
+    t.r = &r;
+    t.num_threads = opt.train_threads;
+    t.seed = opt.seed;
+
+    t.val_rows = validation_split(data.rows, opt, t.order);
+    if (t.val_rows > 0) {
+        t.val_x.resize(t.val_rows * data.cols);
+        t.val_y.resize(t.val_rows);
+        for (size_t i = 0; i < t.val_rows; i++) {
+            const T* src = x + (t.order[i] * data.cols);
+            copy(src, src + data.cols, &t.val_x[i * data.cols]);
+            t.val_y[i] = data.y[t.order[i]];
+        }
+
+        t.order.erase(t.order.begin(), t.order.begin() + t.val_rows);
+    }
+
+    // A batch larger than the training rows would leave no whole batch to
+    // train on
+    t.batch_size = max(min(opt.batch_size, t.order.size()), (size_t)1);
+
+    t.ws.assign(t.num_threads, ReadoutWorkspace<T>(num_classes, data.cols));
+    t.states.assign(opt.hogwild ? t.num_threads : 1,
+                    Optimizer(opt.optimizer, r.w.size()));
+    t.grad.resize(r.w.size());
+    pthread_barrier_init(&t.barrier, nullptr, t.num_threads);
+
+    vector<TrainerThread<T>> args(t.num_threads);
+    vector<pthread_t> threads(t.num_threads);
+    for (size_t i = 0; i < t.num_threads; i++) {
+        args[i] = {&t, i};
+    }
+
+    // The calling thread acts as thread 0
+    for (size_t i = 1; i < t.num_threads; i++) {
+        pthread_create(&threads[i], nullptr, train_worker<T>, &args[i]);
+    }
+    train_worker<T>(&args[0]);
+    for (size_t i = 1; i < t.num_threads; i++) {
+        pthread_join(threads[i], nullptr);
+    }
+
+    pthread_barrier_destroy(&t.barrier);
+
+    if (!t.best_w.empty()) {
+        r.w = t.best_w;
+
+        if (opt.verbose) {
+            printf("Restored weights from epoch %zu (Validation Loss: %.4f)\n",
+                   t.best_epoch, t.best_loss);
+        }
+    }
+
+    if (t.val_rows > 0 && val_loss && val_accuracy) {
+        vector<vector<int>> conf(num_classes, vector<int>(num_classes, 0));
+        size_t correct;
+        evaluate(r, t.val_x.data(), t.val_y.data(), t.val_rows, conf,
+                 *val_loss, correct);
+        *val_loss /= t.val_rows;
+        *val_accuracy = correct / (double)t.val_rows;
+    }
+}
+
+// Trains and prints a readout, returning its final weights
+template <typename T>
+vector<double> train(const FeatureMatrix& data, const vector<double>& w_init,
+                     size_t num_classes, const TrainOptions& opt,
+                     bool report_initial) {
+    vector<T> storage;
+    const T* x = feature_data(data, storage);
+
+    Readout<T> r(num_classes, data.cols);
+    copy(w_init.begin(), w_init.end(), r.w.begin());
+
+    if (report_initial) {
+        vector<vector<int>> conf(num_classes, vector<int>(num_classes, 0));
+        double loss;
+        size_t correct;
+        evaluate(r, x, data.y, data.rows, conf, loss, correct);
+
+        printf("Ridge solution:\n");
+        print_confusion(conf);
+        printf(" Accuracy: %.2f, Loss: %.2f\n", correct / (double)data.rows,
+               loss / (double)data.rows);
+    }
+
+    fit(data, x, r, opt);
+
+    printf("Final weight matrix:\n");
+    for (size_t i = 0; i < r.num_classes; i++) {
+        for (size_t j = 0; j < r.num_features; j++) {
+            printf("%6.3f ", (double)r.w[(i * r.num_features) + j]);
+        }
+        printf("\n");
+    }
+
+    return vector<double>(r.w.begin(), r.w.end());
+}
+
+struct SweepResult {
+    double accuracy;
+    double loss;
+    vector<double> w;
+};
+
+// Every configuration of a sweep trains its own readout, usually against one
+// shared feature matrix. Readouts are scored on the rows --validation holds
+// out when it is set, so that picking the best one does not reward
+// overfitting, and on every row otherwise
+template <typename T> struct Sweep {
+    vector<const FeatureMatrix*> data;
+    vector<const T*> x;
+    vector<const vector<double>*> w_init;
+    size_t num_classes;
+
+    vector<TrainOptions> configs;
+    vector<SweepResult> results;
+    atomic_size_t next{0};
+};
+
+template <typename T> void* sweep_worker(void* arg) {
+    Sweep<T>& s = *(Sweep<T>*)arg;
+
+    while (true) {
+        size_t i = s.next++;
+        if (i >= s.configs.size()) {
+            break;
+        }
+
+        const FeatureMatrix& data = *s.data[i];
+        SweepResult& res = s.results[i];
+        Readout<T> r(s.num_classes, data.cols);
+        copy(s.w_init[i]->begin(), s.w_init[i]->end(), r.w.begin());
+        fit(data, s.x[i], r, s.configs[i], &res.loss, &res.accuracy);
+
+        if (s.configs[i].validation == 0) {
+            vector<vector<int>> conf(s.num_classes,
+                                     vector<int>(s.num_classes, 0));
+            size_t correct;
+            evaluate(r, s.x[i], data.y, data.rows, conf, res.loss, correct);
+            res.accuracy = correct / (double)data.rows;
+            res.loss /= data.rows;
+        }
+        res.w.assign(r.w.begin(), r.w.end());
+
+        fprintf(stderr, "\0331\rSweep: %zu/%zu", i + 1, s.configs.size());
+    }
 
     return nullptr;
 }
 
-int main(int argc, char* argv[]) {
-    if (argc != 12) {
-        fprintf(stderr,
-                "usage: %s starting_resevoir.json data.csv labels.csv "
-                "learning_rate num_threads epochs lambda [d_min] [d_max] "
-                "num_bins num_classes\n",
-                argv[0]);
-        exit(1);
+// Trains every configuration of `s` on num_threads threads
+template <typename T> void sweep_run(Sweep<T>& s, size_t num_threads) {
+    s.results.resize(s.configs.size());
+
+    fprintf(stderr, "Training %zu readouts on %zu threads\n",
+            s.configs.size(), num_threads);
+
+    pthread_t* threads = (pthread_t*)calloc(num_threads, sizeof(*threads));
+    for (size_t i = 0; i < num_threads; i++) {
+        pthread_create(threads + i, nullptr, sweep_worker<T>, &s);
     }
+    for (size_t i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], nullptr);
+    }
+    free(threads);
+    fprintf(stderr, "\n");
+}
 
-    json network_json;
-    vector<string> json_source = {argv[1]};
+// Trains every configuration from its own initial weights and reports them,
+// returning the weights of the best one
+template <typename T>
+vector<double> sweep(const FeatureMatrix& data,
+                     const vector<vector<double>>& w_init, size_t num_classes,
+                     const vector<TrainOptions>& configs,
+                     size_t num_threads) {
+    Sweep<T> s;
+    vector<T> storage;
+    s.data.assign(configs.size(), &data);
+    s.x.assign(configs.size(), feature_data(data, storage));
+    for (const vector<double>& w : w_init) {
+        s.w_init.push_back(&w);
+    }
+    s.num_classes = num_classes;
+    s.configs = configs;
+    sweep_run(s, num_threads);
+
+    const char* scored = configs[0].validation > 0 ? "Validation " : "";
+    size_t best = 0;
+    for (size_t i = 0; i < configs.size(); i++) {
+        const SweepResult& res = s.results[i];
+        printf("learning_rate %g, lambda %g, batch_size %zu: %sAccuracy: "
+               "%.4f, %sLoss: %.4f\n",
+               configs[i].learning_rate, configs[i].lambda,
+               configs[i].batch_size, scored, res.accuracy, scored, res.loss);
+
+        if (res.accuracy > s.results[best].accuracy ||
+            (res.accuracy == s.results[best].accuracy &&
+             res.loss < s.results[best].loss)) {
+            best = i;
+        }
+    }
 
-    ifstream fin(argv[1]);
-    fin >> network_json;
+    printf("\nBest configuration: learning_rate %g, lambda %g, batch_size %zu "
+           "(%sAccuracy: %.4f, %sLoss: %.4f)\n",
+           configs[best].learning_rate, configs[best].lambda,
+           configs[best].batch_size, scored, s.results[best].accuracy, scored,
+           s.results[best].loss);
+
+    return s.results[best].w;
+}
+
+// Fraction of the rows held out to score horizons on when --validation is not
+// given
+const double horizon_validation = 0.2;
+
+// Trains one readout per horizon with the same options, which hold rows out,
+// from w_init[h], and reports each one's held out accuracy next to how well
+// its features separate the classes, as bin/grade measures it, from up to
+// approx_rows rows per class if it is set. The shortest horizon that is at
+// most `tolerance` less accurate than the longest is named at the end
+template <typename T>
+void compare_horizons(const vector<vector<double>>& w_init,
+                      size_t num_classes, const TrainOptions& opt,
+                      size_t num_threads, size_t approx_rows,
+                      double tolerance) {
+    Sweep<T> s;
+    vector<vector<T>> storage(horizons.size());
+    for (size_t h = 0; h < horizons.size(); h++) {
+        s.data.push_back(&horizon_data[h]);
+        s.x.push_back(feature_data(horizon_data[h], storage[h]));
+        s.w_init.push_back(&w_init[h]);
+    }
+    s.num_classes = num_classes;
+    s.configs.assign(horizons.size(), opt);
+    for (TrainOptions& config : s.configs) {
+        config.train_threads = 1;
+        config.hogwild = false;
+        config.verbose = false;
+        config.log = nullptr;
+    }
+    sweep_run(s, num_threads);
+
+    const size_t full = horizons.size() - 1;
+    size_t shortest = full;
+    for (size_t h = 0; h < horizons.size(); h++) {
+        // The grader wants the integer counts, without the bias column
+        const FeatureMatrix& data = horizon_data[h];
+        const size_t num_outputs = data.cols - 1;
+        vector<double> counts(data.rows * num_outputs);
+        for (size_t i = 0; i < data.rows; i++) {
+            for (size_t k = 0; k < num_outputs; k++) {
+                counts[i * num_outputs + k] =
+                    round(data.row(i)[k + 1] * horizons[h]);
+            }
+        }
 
-    fstream data(argv[2]);
-    fstream labels(argv[3]);
+        vector<vector<double>> vals(num_classes, vector<double>(num_classes));
+        size_t zeros;
+        if (approx_rows) {
+            // Every horizon is graded on the same sample of rows
+            SampledGrader sampler(data.y, data.rows, num_outputs, num_classes,
+                                  approx_rows, 0);
+            SampledGrader::Sums sums = sampler.make_sums();
+            vector<int> v(num_outputs);
+            for (size_t i = 0; i < data.rows; i++) {
+                const double* row = &counts[i * num_outputs];
+                v.assign(row, row + num_outputs);
+                sampler.add(i, v, sums);
+            }
+            sampler.merge(sums);
+
+            vector<vector<double>> errors;
+            vals = sampler.grade(errors);
+            zeros = sampler.zeros();
+        } else {
+            PairwiseGrader grader(counts.data(), data.y, data.rows,
+                                  num_outputs, num_classes);
+            const GradeTable table = grader.grade(num_threads);
+            for (size_t i = 0; i < num_classes; i++) {
+                for (size_t j = 0; j < num_classes; j++) {
+                    vals[i][j] = table[i][j].total / table[i][j].count;
+                }
+            }
+            zeros = grader.zeros();
+        }
+        const vector<double> deltas = grade_deltas(vals);
+        const double smallest = *min_element(deltas.begin(), deltas.end());
+
+        const SweepResult& res = s.results[h];
+        printf("Horizon %d: Validation Accuracy: %.4f, Validation Loss: %.4f, "
+               "Smallest delta: %f, Zeros: %zu/%zu\n",
+               horizons[h], res.accuracy, res.loss, smallest * 180 / M_PI,
+               zeros, data.rows);
+
+        if (h < shortest &&
+            res.accuracy >= s.results[full].accuracy - tolerance) {
+            shortest = h;
+        }
+    }
+
+    printf("\nShortest horizon within %g accuracy of %d steps: %d\n",
+           tolerance, horizons[full], horizons[shortest]);
+}
 
-    while (!data.eof()) {
-        string line;
-        getline(data, line);
+// Parses a comma separated list of numbers
+vector<double> parse_list(const char* s) {
+    vector<double> values;
+    char* end;
 
-        double data;
-        int idx = 0;
-        if (line.length() == 0) {
+    while (*s) {
+        values.push_back(strtod(s, &end));
+        if (end == s) {
+            values.clear();
             break;
         }
-        stringstream ss(line);
-        dataset.push_back({});
-        while (ss >> data) {
-            dataset.back().x.push_back(data);
+
+        s = *end == ',' ? end + 1 : end;
+    }
+
+    return values;
+}
+
+void usage(const char* prog) {
+    fprintf(stderr,
+            "usage: %s [options] starting_resevoir.json data.csv labels.csv "
+            "learning_rate num_threads epochs lambda [d_min] [d_max] "
+            "num_bins num_classes\n"
+            "data.csv may also be a dataset written by convert_dataset, "
+            "in which case\n"
+            "labels.csv may be - to use its labels. [d_min] and [d_max] may "
+            "be - to use\n"
+            "the ranges of the dataset\n"
+            "options:\n"
+            "  -c, --cache-dir <dir>  Reuse reservoir features cached in "
+            "<dir>\n"
+            "  -s, --solver <name>    sgd (default) or ridge, ridge solves "
+            "the readout\n"
+            "                         directly and then runs `epochs` SGD "
+            "refinement epochs\n"
+            "  -f, --float            Train the readout in single "
+            "precision\n"
+            "  -b, --batch-size <n>   Mini-batch size (default: 10)\n"
+            "  -t, --train-threads <n>\n"
+            "                         Threads used for training (default: "
+            "1), each batch\n"
+            "                         is split between them and the "
+            "gradients reduced\n"
+            "      --hogwild          Let training threads update the weights "
+            "lock-free\n"
+            "                         with their own batches instead\n"
+            "      --seed <n>         Seed the initial weights and shuffling, "
+            "makes\n"
+            "                         non-hogwild training reproducible\n"
+            "      --sweep-lr <a,b,..>\n"
+            "      --sweep-lambda <a,b,..>\n"
+            "      --sweep-batch <a,b,..>\n"
+            "                         Train one readout per combination of "
+            "the listed\n"
+            "                         values (unlisted ones come from the "
+            "arguments)\n"
+            "                         on num_threads threads and report the "
+            "best\n"
+            "  -v, --validation <fraction>\n"
+            "                         Hold out this fraction of the rows, "
+            "stop training\n"
+            "                         once their loss stops improving and "
+            "keep the best\n"
+            "                         weights seen (default: 0, disabled)\n"
+            "      --patience <n>     Epochs without improvement before "
+            "stopping, 0 never\n"
+            "                         stops early (default: 10)\n"
+            "      --min-delta <d>    Smallest validation loss decrease that "
+            "counts as an\n"
+            "                         improvement (default: 0)\n"
+            "  -o, --optimizer <name> average (default) applies the running "
+            "mean of every\n"
+            "                         update so far, or one of sgd, "
+            "momentum, nesterov, adam\n"
+            "      --momentum <mu>    Momentum, or Adam's beta1 (default: "
+            "0.9)\n"
+            "      --beta2 <b>        Adam's beta2 (default: 0.999)\n"
+            "      --lr-schedule <name>\n"
+            "                         constant (default), step, exp or "
+            "cosine\n"
+            "      --lr-decay <d>     Decay factor of the step and exp "
+            "schedules (default: 0.5)\n"
+            "      --lr-step <n>      Epochs between step decays (default: "
+            "100)\n"
+            "      --log <file>       Append per-epoch timing, loss and "
+            "accuracy to <file>\n"
+            "                         as CSV\n"
+            "  -m, --save-model <file>\n"
+            "                         Save the trained readout, encoder and "
+            "network path\n"
+            "                         for bin/predict (the best one when "
+            "sweeping)\n"
+            "      --bin-edges <file> Bin at the quantile edges written by "
+            "data_preprocessing -q\n"
+            "                         instead of uniformly, [d_min], [d_max] "
+            "and num_bins\n"
+            "                         are then ignored\n"
+            "      --early-stop       Stop simulating an observation once the "
+            "network is\n"
+            "                         quiet. The features are the same as the "
+            "full run's\n"
+            "      --chunk <steps>    Steps between checks for --early-stop "
+            "(default: the\n"
+            "                         network's max_delay)\n"
+            "      --horizons <a,b,..>\n"
+            "                         Simulate every row once up to the "
+            "largest of these\n"
+            "                         step counts, snapshotting the outputs "
+            "at each, and\n"
+            "                         train and grade one readout per "
+            "horizon instead of\n"
+            "                         a single one at 100 steps. Not with "
+            "--save-model or\n"
+            "                         the sweeps. Readouts are scored on "
+            "the --validation\n"
+            "                         rows, or 20%% of them if it is not "
+            "given\n"
+            "      --tolerance <acc>  Accuracy a horizon may lose against "
+            "the longest and\n"
+            "                         still count as accurate (default: "
+            "0.01)\n"
+            "      --approx <rows>    Grade each horizon from up to rows "
+            "observations per\n"
+            "                         class in one linear pass, as bin/grade "
+            "--approx does\n",
+            prog);
+    exit(1);
+}
+
+int main(int argc, char* argv[]) {
+    const char* prog = argv[0];
+    string cache_dir;
+    string solver = "sgd";
+    bool use_float = false;
+    size_t batch_size = 10;
+    size_t train_threads = 1;
+    bool hogwild = false;
+    bool seeded = false;
+    unsigned seed = 0;
+    vector<double> sweep_lr;
+    vector<double> sweep_lambda;
+    vector<double> sweep_batch;
+    double validation = 0;
+    size_t patience = 10;
+    double min_delta = 0;
+    OptimizerParams optimizer;
+    LrScheduleParams schedule;
+    FILE* log = nullptr;
+    string model_path;
+    string edges_path;
+    double tolerance = 0.01;
+    size_t approx_rows = 0;
+
+    static struct option long_options[] = {
+        {"cache-dir", required_argument, 0, 'c'},
+        {"solver", required_argument, 0, 's'},
+        {"float", no_argument, 0, 'f'},
+        {"batch-size", required_argument, 0, 'b'},
+        {"train-threads", required_argument, 0, 't'},
+        {"hogwild", no_argument, 0, 'H'},
+        {"seed", required_argument, 0, 'S'},
+        {"sweep-lr", required_argument, 0, 'R'},
+        {"sweep-lambda", required_argument, 0, 'L'},
+        {"sweep-batch", required_argument, 0, 'B'},
+        {"validation", required_argument, 0, 'v'},
+        {"patience", required_argument, 0, 'P'},
+        {"min-delta", required_argument, 0, 'D'},
+        {"optimizer", required_argument, 0, 'o'},
+        {"momentum", required_argument, 0, 'M'},
+        {"beta2", required_argument, 0, '2'},
+        {"lr-schedule", required_argument, 0, 'G'},
+        {"lr-decay", required_argument, 0, 'Y'},
+        {"lr-step", required_argument, 0, 'T'},
+        {"log", required_argument, 0, 'l'},
+        {"save-model", required_argument, 0, 'm'},
+        {"bin-edges", required_argument, 0, 'E'},
+        {"early-stop", no_argument, 0, 'Q'},
+        {"chunk", required_argument, 0, 'C'},
+        {"horizons", required_argument, 0, 'Z'},
+        {"tolerance", required_argument, 0, 'O'},
+        {"approx", required_argument, 0, 'A'},
+        {0, 0, 0, 0},
+    };
+
+    int c;
+    while ((c = getopt_long(argc, argv, "c:s:fb:t:v:o:m:", long_options,
+                            nullptr)) != -1) {
+        switch (c) {
+        case 'c':
+            cache_dir = optarg;
+            break;
+        case 's':
+            solver = optarg;
+            if (solver != "sgd" && solver != "ridge") {
+                usage(prog);
+            }
+            break;
+        case 'f':
+            use_float = true;
+            break;
+        case 'b':
+            batch_size = strtoull(optarg, nullptr, 0);
+            if (batch_size == 0) {
+                usage(prog);
+            }
+            break;
+        case 't':
+            train_threads = strtoull(optarg, nullptr, 0);
+            if (train_threads == 0) {
+                usage(prog);
+            }
+            break;
+        case 'H':
+            hogwild = true;
+            break;
+        case 'S':
+            seed = strtoul(optarg, nullptr, 0);
+            seeded = true;
+            break;
+        case 'R':
+            sweep_lr = parse_list(optarg);
+            if (sweep_lr.empty()) {
+                usage(prog);
+            }
+            break;
+        case 'L':
+            sweep_lambda = parse_list(optarg);
+            if (sweep_lambda.empty()) {
+                usage(prog);
+            }
+            break;
+        case 'B':
+            sweep_batch = parse_list(optarg);
+            if (sweep_batch.empty()) {
+                usage(prog);
+            }
+            for (double b : sweep_batch) {
+                if (b < 1 || b != floor(b)) {
+                    usage(prog);
+                }
+            }
+            break;
+        case 'v':
+            validation = strtod(optarg, nullptr);
+            if (validation < 0 || validation >= 1) {
+                usage(prog);
+            }
+            break;
+        case 'P':
+            patience = strtoull(optarg, nullptr, 0);
+            break;
+        case 'D':
+            min_delta = strtod(optarg, nullptr);
+            break;
+        case 'o':
+            if (!parse_optimizer(optarg, optimizer.kind)) {
+                usage(prog);
+            }
+            break;
+        case 'M':
+            optimizer.momentum = strtod(optarg, nullptr);
+            break;
+        case '2':
+            optimizer.beta2 = strtod(optarg, nullptr);
+            break;
+        case 'G':
+            if (!parse_lr_schedule(optarg, schedule.schedule)) {
+                usage(prog);
+            }
+            break;
+        case 'Y':
+            schedule.decay = strtod(optarg, nullptr);
+            break;
+        case 'T':
+            schedule.step = strtoull(optarg, nullptr, 0);
+            break;
+        case 'l':
+            log = fopen(optarg, "a");
+            if (!log) {
+                fprintf(stderr, "%s: main: Unable to open %s\n", __FILE__,
+                        optarg);
+                exit(1);
+            }
+            fprintf(log, "epoch,seconds,learning_rate,loss,accuracy,"
+                         "validation_loss,validation_accuracy\n");
+            break;
+        case 'm':
+            model_path = optarg;
+            break;
+        case 'E':
+            edges_path = optarg;
+            break;
+        case 'Q':
+            simulation.early_stop = true;
+            break;
+        case 'C':
+            simulation.chunk = atoi(optarg);
+            break;
+        case 'Z':
+            for (double h : parse_list(optarg)) {
+                if (h < 1 || (!horizons.empty() && h <= horizons.back())) {
+                    usage(prog);
+                }
+                horizons.push_back(h);
+            }
+            break;
+        case 'O':
+            tolerance = strtod(optarg, nullptr);
+            if (tolerance < 0) {
+                usage(prog);
+            }
+            break;
+        case 'A':
+            if (sscanf(optarg, "%zu", &approx_rows) != 1 || approx_rows < 2) {
+                usage(prog);
+            }
+            break;
+        default:
+            usage(prog);
         }
+    }
 
-        labels >> dataset.back().y;
+    // Horizons pick the features to keep, so they do not mix with sweeps or
+    // saving the one model, and only they are graded
+    const bool multi_horizon = !horizons.empty();
+    if (argc - optind != 11 ||
+        (multi_horizon && (!model_path.empty() || !sweep_lr.empty() ||
+                           !sweep_lambda.empty() || !sweep_batch.empty())) ||
+        (!multi_horizon && approx_rows > 0)) {
+        usage(prog);
     }
 
+    if (multi_horizon) {
+        simulation.duration = horizons.back();
+        steps.reset(simulation.duration);
+    } else {
+        horizons.push_back(simulation.duration);
+    }
+    horizon_data = vector<FeatureMatrix>(horizons.size());
+
+    // Line the positional arguments back up with argv[1..]
+    argv += optind - 1;
+
+    json network_json;
+    vector<string> json_source = {argv[1]};
+
+    ifstream fin(argv[1]);
+    fin >> network_json;
+
     double learning_rate;
     sscanf(argv[4], "%lf", &learning_rate);
 
@@ -166,18 +1095,52 @@ int main(int argc, char* argv[]) {
     double lambda;
     sscanf(argv[7], "%lf", &lambda);
 
-    stringstream dmin(argv[8]);
-    dmin >> d_min;
-    stringstream dmax(argv[9]);
-    dmax >> d_max;
-
     sscanf(argv[10], "%zu", &num_bins);
 
     size_t num_classes;
     sscanf(argv[11], "%zu", &num_classes);
 
+    string error;
+    if (!dataset_load(argv[2], argv[3], num_threads, dataset, error)) {
+        fprintf(stderr, "%s: main: %s\n", __FILE__, error.c_str());
+        exit(1);
+    }
+
+    if (!dataset.y) {
+        fprintf(stderr, "%s: main: %s has no labels\n", __FILE__, argv[2]);
+        exit(1);
+    }
+
+    // The readout indexes its per-class weights and predictions by label
+    if (dataset.num_classes > num_classes) {
+        fprintf(stderr, "%s: main: %s has label %zu, but num_classes is %zu\n",
+                __FILE__, argv[2], dataset.num_classes - 1, num_classes);
+        exit(1);
+    }
+
+    if (approx_rows && dataset.rows > SampledGrader::max_rows) {
+        fprintf(stderr, "%s: main: --approx takes at most %zu rows\n",
+                __FILE__, SampledGrader::max_rows);
+        exit(1);
+    }
+
+    if (!dataset_parse_range(argv[8], dataset.d_min, dataset.cols, d_min) ||
+        !dataset_parse_range(argv[9], dataset.d_max, dataset.cols, d_max)) {
+        fprintf(stderr,
+                "%s: main: Expected %zu values in [d_min] and [d_max]\n",
+                __FILE__, dataset.cols);
+        exit(1);
+    }
+
+    if (!encoder_make(edges_path, d_min.data(), d_max.data(), dataset.cols,
+                      num_bins, encoder, error)) {
+        fprintf(stderr, "%s: main: %s\n", __FILE__, error.c_str());
+        exit(1);
+    }
+
     Network* n = new Network();
     n->from_json(network_json);
+    simulation_set_network(simulation, n);
     const int weight_idx = n->get_edge_property("Weight")->index;
 
     Processor* p = nullptr;
@@ -193,130 +1156,222 @@ int main(int argc, char* argv[]) {
     n->make_sorted_node_vector();
     const size_t num_outputs = n->num_outputs();
 
-    processed_data.resize(dataset.size());
-
-    fprintf(stderr, "Preprocessing dataset\n");
-
-    pthread_t* threads = (pthread_t*)calloc(num_threads, sizeof(*threads));
+    // Everything that changes the simulated features, but nothing that only
+    // affects training. Each horizon is cached on its own, so a horizon of
+    // 100 shares its features with a plain run
+    vector<uint64_t> cache_keys(horizons.size(), 0);
+    vector<string> cache_paths(horizons.size());
+    if (!cache_dir.empty()) {
+        vector<string> files = {argv[1], argv[2]};
+        if (strcmp(argv[3], "-") != 0) {
+            files.push_back(argv[3]);
+        }
+        if (!edges_path.empty()) {
+            files.push_back(edges_path);
+        }
 
-    for (size_t i = 0; i < num_threads; i++) {
-        pthread_create(threads + i, nullptr, worker, n);
+        string params((const char*)d_min.data(), d_min.size() * sizeof(double));
+        params.append((const char*)d_max.data(), d_max.size() * sizeof(double));
+        for (size_t h = 0; h < horizons.size(); h++) {
+            cache_keys[h] = feature_cache_key(
+                files, params + to_string(num_bins) + " run:" +
+                           to_string(horizons[h]));
+            cache_paths[h] = feature_cache_path(cache_dir, cache_keys[h]);
+        }
     }
 
-    for (size_t i = 0; i < num_threads; i++) {
-        pthread_join(threads[i], nullptr);
+    bool cached = !cache_dir.empty();
+    for (size_t h = 0; h < horizons.size() && cached; h++) {
+        cached = cache_keys[h] != 0 &&
+                 feature_cache_load(cache_paths[h], cache_keys[h],
+                                    horizon_data[h]);
     }
 
-    vector<vector<int>> conf(num_classes, vector<int>(num_classes, 0));
-    vector<vector<pair<double, int>>> desired_edge_updates(
-        num_classes, vector<pair<double, int>>(num_outputs + 1));
-
-    MOA m;
-    m.Seed(m.Seed_From_Time(), "rand");
-    vector<vector<double>> w(num_classes, vector<double>(num_outputs + 1));
-    for (size_t i = 0; i < w.size(); i++) {
-        for (size_t j = 0; j < w[i].size(); j++) {
-            w[i][j] = m.Random_Normal(0, 10);
+    if (cached) {
+        for (size_t h = 0; h < horizons.size(); h++) {
+            fprintf(stderr, "Loaded cached features from %s\n",
+                    cache_paths[h].c_str());
         }
-    }
-
-    unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
+    } else {
+        encoded = encoder.encode(dataset.x, dataset.rows);
 
-    for (size_t epochs = 0; epochs < total_epochs; epochs++) {
-        printf("Epoch %zu:\n", epochs);
-        shuffle(processed_data.begin(), processed_data.end(),
-                std::default_random_engine(seed));
+        for (size_t h = 0; h < horizons.size(); h++) {
+            horizon_data[h].allocate(dataset.rows, num_outputs + 1);
+        }
 
-        double loss = 0;
-        size_t correct = 0;
-        size_t total = 0;
+        fprintf(stderr, "Preprocessing dataset\n");
 
-        const size_t batch_size = 10;
+        pthread_t* threads =
+            (pthread_t*)calloc(num_threads, sizeof(*threads));
 
-        for (size_t batch = 0; batch < processed_data.size() / batch_size;
-             batch++) {
-            printf("\0331\rBatch: %zu/%zu", batch + 1,
-                   processed_data.size() / batch_size);
+        for (size_t i = 0; i < num_threads; i++) {
+            pthread_create(threads + i, nullptr, worker, n);
+        }
 
-            for (size_t idx = 0; idx < batch_size; idx++) {
-                size_t work_idx = (batch * batch_size) + idx;
-                Observation o = processed_data[work_idx];
+        for (size_t i = 0; i < num_threads; i++) {
+            pthread_join(threads[i], nullptr);
+        }
 
-                // Wx + b = y
-                vector<double> y(num_classes);
+        free(threads);
 
-                for (size_t i = 0; i < num_classes; i++) {
-                    for (size_t j = 0; j < num_outputs + 1; j++) {
-                        y[i] += w[i][j] * o.x[j];
-                    }
-                }
+        fprintf(stderr, "Spike cache: %zu hits, %zu misses\n",
+                spike_cache.hits(), spike_cache.misses());
+        if (simulation.early_stop) {
+            steps.print(stderr);
+        }
 
-                // Now we softmax y
-                softmax(y);
+        for (size_t h = 0; h < horizons.size(); h++) {
+            if (cache_keys[h] != 0 &&
+                !feature_cache_store(cache_dir, cache_paths[h], cache_keys[h],
+                                     horizon_data[h])) {
+                fprintf(stderr, "%s: main: Unable to write feature cache %s\n",
+                        __FILE__, cache_paths[h].c_str());
+            }
+        }
+    }
 
-                loss += -log(y[o.y]);
-                vector<double> target(num_classes);
-                target[o.y] = 1;
+    // The full duration's features, which a single readout trains on
+    const FeatureMatrix& processed_data = horizon_data.back();
 
-                if (max_idx(y) == o.y) {
-                    correct++;
-                }
-                total++;
+    if (!seeded) {
+        seed = std::chrono::system_clock::now().time_since_epoch().count();
+    }
 
-                conf[o.y][max_idx(y)]++;
+    MOA m;
+    m.Seed(seed, "rand");
+    vector<double> w(num_classes * (num_outputs + 1));
+    for (size_t i = 0; i < w.size(); i++) {
+        w[i] = m.Random_Normal(0, 10);
+    }
 
-                // Calculate weight updates
-                for (size_t i = 0; i < num_classes; i++) {
-                    for (size_t j = 0; j < num_outputs + 1; j++) {
-                        double gradient = (y[i] - target[i]) * o.x[j];
-                        desired_edge_updates[i][j].first -=
-                            learning_rate * gradient + (lambda * w[i][j]);
-                        desired_edge_updates[i][j].second++;
-                    }
-                }
-            }
+    TrainOptions opt;
+    opt.learning_rate = learning_rate;
+    opt.lambda = lambda;
+    opt.total_epochs = total_epochs;
+    opt.batch_size = batch_size;
+    opt.train_threads = train_threads;
+    opt.hogwild = hogwild;
+    opt.seed = seed;
+    opt.verbose = true;
+    opt.validation = validation;
+    opt.patience = patience;
+    opt.min_delta = min_delta;
+    opt.optimizer = optimizer;
+    opt.schedule = schedule;
+    opt.log = log;
+
+    // Horizons are always compared on held out rows
+    if (multi_horizon && opt.validation == 0) {
+        opt.validation = horizon_validation;
+    }
 
-            // Perform batchwise weight updates
-            for (size_t i = 0; i < desired_edge_updates.size(); i++) {
-                for (size_t j = 0; j < desired_edge_updates[i].size(); j++) {
-                    double update = desired_edge_updates[i][j].first /
-                                    desired_edge_updates[i][j].second;
+    // Every horizon starts from the same weights, or its own ridge solution.
+    // It only fits the rows SGD trains on, so that early stopping and the
+    // validation scores are judged on rows it has not seen
+    vector<size_t> order;
+    const size_t val_rows = validation_split(processed_data.rows, opt, order);
+    const vector<size_t> train_rows(order.begin() + val_rows, order.end());
+    vector<vector<double>> horizon_w(horizons.size(), w);
+    for (size_t h = 0; h < horizons.size(); h++) {
+        if (solver == "ridge" &&
+            !ridge_solve(horizon_data[h], num_classes, lambda, horizon_w[h],
+                         &train_rows)) {
+            fprintf(stderr, "%s: main: Unable to solve ridge system.\n",
+                    __FILE__);
+            exit(1);
+        }
+    }
+    w = horizon_w.back();
+
+    if (multi_horizon) {
+        if (use_float) {
+            compare_horizons<float>(horizon_w, num_classes, opt, num_threads,
+                                    approx_rows, tolerance);
+        } else {
+            compare_horizons<double>(horizon_w, num_classes, opt, num_threads,
+                                     approx_rows, tolerance);
+        }
+    } else if (!sweep_lr.empty() || !sweep_lambda.empty() ||
+               !sweep_batch.empty()) {
+        if (sweep_lr.empty()) {
+            sweep_lr.push_back(learning_rate);
+        }
+        if (sweep_lambda.empty()) {
+            sweep_lambda.push_back(lambda);
+        }
+        if (sweep_batch.empty()) {
+            sweep_batch.push_back(batch_size);
+        }
 
-                    // Prevent adding nan or infinity
-                    if (isnormal(update)) {
-                        w[i][j] += update;
-                    }
-                }
+        // Ridge starts every lambda from its own solution, fit to the same
+        // training rows
+        vector<vector<double>> lambda_w(sweep_lambda.size(), w);
+        for (size_t i = 0; i < sweep_lambda.size(); i++) {
+            if (solver == "ridge" &&
+                !ridge_solve(processed_data, num_classes, sweep_lambda[i],
+                             lambda_w[i], &train_rows)) {
+                fprintf(stderr, "%s: main: Unable to solve ridge system.\n",
+                        __FILE__);
+                exit(1);
             }
         }
 
-        if (epochs == total_epochs - 1) {
-            printf("CONFUSION MATRIX:\n");
-            for (size_t i = 0; i < conf.size(); i++) {
-                for (size_t j = 0; j < conf[i].size(); j++) {
-                    printf("%4d ", conf[i][j]);
-                    conf[i][j] = 0;
+        vector<TrainOptions> configs;
+        vector<vector<double>> config_w;
+        for (double lr : sweep_lr) {
+            for (size_t i = 0; i < sweep_lambda.size(); i++) {
+                for (double b : sweep_batch) {
+                    TrainOptions config = opt;
+                    config.learning_rate = lr;
+                    config.lambda = sweep_lambda[i];
+                    config.batch_size = (size_t)b;
+                    config.train_threads = 1;
+                    config.hogwild = false;
+                    config.verbose = false;
+                    config.log = nullptr;
+                    configs.push_back(config);
+                    config_w.push_back(lambda_w[i]);
                 }
-                puts("");
             }
-            puts("");
         }
 
-        for (size_t i = 0; i < conf.size(); i++) {
-            for (size_t j = 0; j < conf[i].size(); j++) {
-                conf[i][j] = 0;
-            }
+        if (use_float) {
+            w = sweep<float>(processed_data, config_w, num_classes, configs,
+                             num_threads);
+        } else {
+            w = sweep<double>(processed_data, config_w, num_classes, configs,
+                              num_threads);
         }
-
-        printf(" Accuracy: %.2f, Loss: %.2f\n", correct / (double)total,
-               loss / (double)total);
+    } else if (use_float) {
+        w = train<float>(processed_data, w, num_classes, opt,
+                         solver == "ridge");
+    } else {
+        w = train<double>(processed_data, w, num_classes, opt,
+                          solver == "ridge");
     }
 
-    printf("Final weight matrix:\n");
-    for (size_t i = 0; i < w.size(); i++) {
-        for (size_t j = 0; j < w[i].size(); j++) {
-            printf("%6.3f ", w[i][j]);
+    if (!model_path.empty()) {
+        Model model;
+        model.network_path = argv[1];
+        model.network_hash = network_file_hash(argv[1]);
+        model.num_bins = num_bins;
+        model.d_min = d_min;
+        model.d_max = d_max;
+        if (encoder.is_quantile()) {
+            model.edges = encoder.bin_edges();
         }
-        printf("\n");
+        model.num_classes = num_classes;
+        model.num_features = processed_data.cols;
+        model.w = w;
+
+        if (!model_save(model_path, model)) {
+            fprintf(stderr, "%s: main: Unable to write model %s\n", __FILE__,
+                    model_path.c_str());
+            exit(1);
+        }
+    }
+
+    if (log) {
+        fclose(log);
     }
 }
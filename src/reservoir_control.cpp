@@ -1,4 +1,7 @@
 #include "framework.hpp"
+#include "encoder.hpp"
+#include "readout.hpp"
+#include "simulation.hpp"
 #include <algorithm>
 #include <cassert>
 #include <cfloat>
@@ -6,6 +9,7 @@
 #include <cstddef>
 #include <cstdlib>
 #include <fstream>
+#include <getopt.h>
 #include <pthread.h>
 #include <stddef.h>
 #include <string>
@@ -370,28 +374,27 @@ vector<double> matrix_vector_multiply(vector<vector<double>> m,
     return result;
 }
 
-vector<double> activations(vector<double> o, Processor* p, vector<double> dmin,
-                           vector<double> dmax, size_t num_bins,
-                           size_t num_outputs) {
+SimulationOptions simulation;
+StepHistogram steps(simulation.duration);
+
+vector<double> activations(const vector<double>& o, Processor* p,
+                           const SpikeEncoder& encoder, size_t num_outputs) {
     p->clear_activity();
 
     // Encode observations
-    for (size_t ob = 0; ob < o.size(); ob++) {
-        const double encoder_range = dmax[ob] - dmin[ob];
-        const double bin_width = encoder_range / num_bins;
-        const int bin =
-            min(floor((o[ob] - dmin[ob]) / bin_width), (double)num_bins - 1);
-        const int idx = (num_bins * ob) + bin;
-
-        p->apply_spike({idx, 0, 255}, false);
+    vector<uint16_t> spikes(encoder.num_features());
+    encoder.encode(o.data(), spikes.data());
+    for (uint16_t s : spikes) {
+        p->apply_spike({s, 0, 255}, false);
     }
 
-    p->run(100);
-    const vector<int> firing_counts = p->output_counts();
+    vector<int> firing_counts;
+    simulation_run(p, simulation, firing_counts, &steps);
     vector<double> normalized(firing_counts.size() + 1);
     normalized[0] = 1;
     transform(firing_counts.begin(), firing_counts.end(),
-              normalized.begin() + 1, [](int x) { return (double)x / 100; });
+              normalized.begin() + 1,
+              [](int x) { return (double)x / simulation.duration; });
 
     return normalized;
 }
@@ -404,12 +407,13 @@ vector<double> bin_activations(vector<int> o, Processor* p, size_t num_bins) {
         p->apply_spike({(int)(ob * num_bins) + o[ob], 0, 255}, false);
     }
 
-    p->run(100);
-    const vector<int> firing_counts = p->output_counts();
+    vector<int> firing_counts;
+    simulation_run(p, simulation, firing_counts, &steps);
     vector<double> normalized(firing_counts.size() + 1);
     normalized[0] = 1;
     transform(firing_counts.begin(), firing_counts.end(),
-              normalized.begin() + 1, [](int x) { return (double)x / 100; });
+              normalized.begin() + 1,
+              [](int x) { return (double)x / simulation.duration; });
 
     return normalized;
 }
@@ -479,15 +483,96 @@ json d_min;
 json d_max;
 size_t num_bins;
 
+void usage(const char* prog) {
+    fprintf(stderr,
+            "usage: %s [options] resevoir.json learning_rate lambda epochs "
+            "num_bins\n"
+            "options:\n"
+            "  -o, --optimizer <name> sgd (default), momentum, nesterov or "
+            "adam\n"
+            "      --momentum <mu>    Momentum, or Adam's beta1 (default: "
+            "0.9)\n"
+            "      --beta2 <b>        Adam's beta2 (default: 0.999)\n"
+            "      --lr-schedule <name>\n"
+            "                         constant (default), step, exp or "
+            "cosine\n"
+            "      --lr-decay <d>     Decay factor of the step and exp "
+            "schedules (default: 0.5)\n"
+            "      --lr-step <n>      Epochs between step decays (default: "
+            "100)\n"
+            "      --early-stop       Stop simulating an observation once the "
+            "network is\n"
+            "                         quiet. The activations are the same as "
+            "the full\n"
+            "                         run's\n"
+            "      --chunk <steps>    Steps between checks for --early-stop "
+            "(default: the\n"
+            "                         network's max_delay)\n",
+            prog);
+    exit(1);
+}
+
 int main(int argc, char* argv[]) {
-    if (argc != 6) {
-        fprintf(
-            stderr,
-            "usage: %s resevoir.json learning_rate lambda epochs num_bins\n",
-            argv[0]);
-        exit(1);
+    const char* prog = argv[0];
+    OptimizerParams optimizer;
+    optimizer.kind = OptimizerKind::sgd;
+    LrScheduleParams schedule;
+
+    static struct option long_options[] = {
+        {"optimizer", required_argument, 0, 'o'},
+        {"momentum", required_argument, 0, 'M'},
+        {"beta2", required_argument, 0, '2'},
+        {"lr-schedule", required_argument, 0, 'G'},
+        {"lr-decay", required_argument, 0, 'Y'},
+        {"lr-step", required_argument, 0, 'T'},
+        {"early-stop", no_argument, 0, 'Q'},
+        {"chunk", required_argument, 0, 'C'},
+        {0, 0, 0, 0},
+    };
+
+    int c;
+    while ((c = getopt_long(argc, argv, "o:", long_options, nullptr)) != -1) {
+        switch (c) {
+        case 'o':
+            if (!parse_optimizer(optarg, optimizer.kind)) {
+                usage(prog);
+            }
+            break;
+        case 'M':
+            optimizer.momentum = strtod(optarg, nullptr);
+            break;
+        case '2':
+            optimizer.beta2 = strtod(optarg, nullptr);
+            break;
+        case 'G':
+            if (!parse_lr_schedule(optarg, schedule.schedule)) {
+                usage(prog);
+            }
+            break;
+        case 'Y':
+            schedule.decay = strtod(optarg, nullptr);
+            break;
+        case 'T':
+            schedule.step = strtoull(optarg, nullptr, 0);
+            break;
+        case 'Q':
+            simulation.early_stop = true;
+            break;
+        case 'C':
+            simulation.chunk = atoi(optarg);
+            break;
+        default:
+            usage(prog);
+        }
     }
 
+    if (argc - optind != 5) {
+        usage(prog);
+    }
+
+    // Line the positional arguments back up with argv[1..]
+    argv += optind - 1;
+
     srand(time(nullptr));
 
     json network_json;
@@ -509,6 +594,7 @@ int main(int argc, char* argv[]) {
 
     Network* n = new Network();
     n->from_json(network_json);
+    simulation_set_network(simulation, n);
     const int weight_idx = n->get_edge_property("Weight")->index;
     const size_t num_outputs = n->num_outputs();
     Processor* p = nullptr;
@@ -523,6 +609,8 @@ int main(int argc, char* argv[]) {
     n->make_sorted_node_vector();
 
     App* app = new Box();
+    const SpikeEncoder encoder(app->dmin.data(), app->dmax.data(),
+                               app->num_observations, num_bins);
 
     // double min_angle = grade_reservoir(p, app->num_observations, num_bins);
     // printf("Minimum angle between vectors: %f\n", min_angle);
@@ -537,6 +625,10 @@ int main(int argc, char* argv[]) {
         }
     }
 
+    // One optimizer per action row, stepped once per Q-update
+    vector<Optimizer> optimizers(w.size(), Optimizer(optimizer, w[0].size()));
+    vector<double> gradient(w[0].size());
+
     const double discount_factor = 0.95;
     double epsilon = 0.5;
     const double epsilon_decay_factor = 0.999;
@@ -546,6 +638,9 @@ int main(int argc, char* argv[]) {
     // Training Loop
     for (size_t epochs = 0; epochs < total_epochs; epochs++) {
         printf("Epoch %zu, epsilon: %f:\n", epochs, epsilon);
+        const double lr = scheduled_learning_rate(schedule, learning_rate,
+                                                  epochs, total_epochs);
+        double loss = 0;
 
         ObsReward o = app->reset();
         epsilon *= epsilon_decay_factor;
@@ -558,8 +653,8 @@ int main(int argc, char* argv[]) {
         while (!done) {
             // printf("\0331k\rStep: %zu", step++);
             size_t action = -1;
-            vector<double> reservoir_activations = activations(
-                o.obs, p, app->dmin, app->dmax, num_bins, num_outputs);
+            vector<double> reservoir_activations =
+                activations(o.obs, p, encoder, num_outputs);
             vector<double> model_prediction =
                 matrix_vector_multiply(w, reservoir_activations);
 
@@ -579,8 +674,8 @@ int main(int argc, char* argv[]) {
             done = new_o.done;
             epoch_reward += new_o.reward;
 
-            vector<double> next_activations = activations(
-                new_o.obs, p, app->dmin, app->dmax, num_bins, num_outputs);
+            vector<double> next_activations =
+                activations(new_o.obs, p, encoder, num_outputs);
             vector<double> next_prediction =
                 matrix_vector_multiply(w, next_activations);
             const double target =
@@ -595,17 +690,19 @@ int main(int argc, char* argv[]) {
 
             for (size_t i = 0; i < y.size(); i++) {
                 partial_gradient[i] = y_hat[i] - y[i];
+                loss += partial_gradient[i] * partial_gradient[i];
             }
 
             // Perform weight updates
             for (size_t row = 0; row < w.size(); row++) {
                 for (size_t col = 0; col < w[row].size(); col++) {
-                    const double gradient =
+                    gradient[col] =
                         partial_gradient[row] * reservoir_activations[col];
-
-                    w[row][col] -=
-                        (gradient * learning_rate) + (lambda * w[row][col]);
                 }
+
+                optimizers[row].advance(1);
+                optimizers[row].apply(w[row].data(), gradient.data(), 1, lr,
+                                      lambda, 0, w[row].size());
             }
 
             o = new_o;
@@ -616,6 +713,8 @@ int main(int argc, char* argv[]) {
         }
 
         training_reward.push_back(epoch_reward / (double)step);
+        printf(" Reward: %f, Loss: %f\n", epoch_reward / (double)step,
+               loss / (double)step);
     }
 
     // Testing loop
@@ -630,8 +729,8 @@ int main(int argc, char* argv[]) {
 
         while (!done) {
             size_t action = -1;
-            vector<double> reservoir_activations = activations(
-                o.obs, p, app->dmin, app->dmax, num_bins, num_outputs);
+            vector<double> reservoir_activations =
+                activations(o.obs, p, encoder, num_outputs);
             vector<double> model_prediction =
                 matrix_vector_multiply(w, reservoir_activations);
 
@@ -659,6 +758,10 @@ int main(int argc, char* argv[]) {
     delete p;
     delete n;
 
+    if (simulation.early_stop) {
+        steps.print(stdout);
+    }
+
     printf("Final weight matrix:\n");
     for (size_t i = 0; i < w.size(); i++) {
         for (size_t j = 0; j < w[i].size(); j++) {
@@ -1,12 +1,20 @@
+#include "dataset.hpp"
+#include "encoder.hpp"
 #include "framework.hpp"
+#include "grading.hpp"
+#include "simulation.hpp"
+#include "spike_cache.hpp"
+#include <algorithm>
 #include <atomic>
 #include <cassert>
 #include <cmath>
 #include <cstddef>
 #include <cstdlib>
 #include <fstream>
+#include <getopt.h>
 #include <math.h>
 #include <pthread.h>
+#include <random>
 #include <stddef.h>
 #include <string>
 #include <unistd.h>
@@ -15,35 +23,60 @@ using namespace std;
 using namespace neuro;
 using nlohmann::json;
 
-struct atom {
-    int label;
-    vector<int> v;
-};
-
-struct obs {
-    double total;
-    double count;
-};
-
-struct observation {
-    vector<double> features;
-    int label;
-};
-
-vector<observation> dataset;
+Dataset dataset;
 atomic_size_t dataset_idx = 0;
 
-pthread_mutex_t in_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t out_mutex = PTHREAD_MUTEX_INITIALIZER;
-vector<atom> outputs;
-
-fstream data_file;
-fstream labels;
-
-json d_min;
-json d_max;
+// Output counts of every row, num_outputs per row, unless grading is
+// approximate without limits, in which case they only go to the sampler
+size_t num_outputs;
+vector<double> outputs;
+SampledGrader* sampler = nullptr;
+
+// Rows are simulated in `order`, in stages ending at stage_ends. Between
+// stages the rows so far are checked against the limits. Without limits there
+// is a single stage in dataset order
+GradeLimits limits;
+vector<size_t> order;
+vector<size_t> stage_ends;
+pthread_barrier_t stage_barrier;
+bool rejected = false;
+size_t rejected_at;
+string reject_reason;
+
+vector<double> d_min;
+vector<double> d_max;
 size_t num_bins;
 size_t num_classes;
+SpikeEncoder encoder;
+// Input neuron of every spike of every row, encoder.width() per row
+vector<uint16_t> encoded;
+SpikeCache spike_cache;
+SimulationOptions simulation;
+StepHistogram steps(simulation.duration);
+
+// Simulates row idx into v and records it
+void simulate(Processor* p, size_t idx, vector<int>& v,
+              SampledGrader::Sums& sums) {
+    const uint16_t* row = &encoded[idx * encoder.width()];
+    const vector<uint16_t> spikes(row, row + encoder.width());
+
+    if (!spike_cache.lookup(spikes, v)) {
+        p->clear_activity();
+        for (uint16_t s : spikes) {
+            p->apply_spike({s, 0, 255}, false);
+        }
+
+        simulation_run(p, simulation, v, &steps);
+        spike_cache.insert(spikes, v);
+    }
+
+    if (sampler) {
+        sampler->add(idx, v, sums);
+    }
+    if (!outputs.empty()) {
+        copy(v.begin(), v.end(), &outputs[idx * num_outputs]);
+    }
+}
 
 void* worker(void* arg) {
     Network* n = (Network*)arg;
@@ -55,54 +88,148 @@ void* worker(void* arg) {
     p = Processor::make(proc_name, proc_params);
     p->load_network(n);
 
-    while (true) {
-        p->clear_activity();
+    vector<int> v;
+    SampledGrader::Sums sums;
+    if (sampler) {
+        sums = sampler->make_sums();
+    }
 
-        size_t idx = dataset_idx++;
-        if (idx > dataset.size() - 1) {
-            break;
+    for (size_t stage = 0; stage < stage_ends.size(); stage++) {
+        while (true) {
+            const size_t k = dataset_idx++;
+            if (k >= stage_ends[stage]) {
+                break;
+            }
+
+            simulate(p, order[k], v, sums);
         }
 
-        observation o = dataset[idx];
-        for (size_t i = 0; i < o.features.size(); i++) {
-            const double encoder_range =
-                (double)d_max.at(i) - (double)d_min.at(i);
-            const double bin_width = encoder_range / num_bins;
-            const double bin =
-                encoder_range == 0
-                    ? 0
-                    : min(floor((o.features[i] - (double)d_min.at(i)) /
-                                bin_width),
-                          (double)num_bins - 1);
-            const int idx = (num_bins * i) + bin;
-
-            p->apply_spike({idx, 0, 255}, false);
+        if (stage + 1 == stage_ends.size()) {
+            break;
         }
 
-        p->run(100);
+        if (pthread_barrier_wait(&stage_barrier) ==
+            PTHREAD_BARRIER_SERIAL_THREAD) {
+            dataset_idx = stage_ends[stage];
+            rejected = grade_reject_partial(
+                limits, dataset.y, order, stage_ends[stage],
+                [](size_t i) { return &outputs[i * num_outputs]; },
+                num_outputs, num_classes, reject_reason);
+            rejected_at = stage_ends[stage];
+        }
 
-        atom a;
-        a.label = o.label;
-        a.v = p->output_counts();
+        pthread_barrier_wait(&stage_barrier);
+        if (rejected) {
+            break;
+        }
+    }
 
-        pthread_mutex_lock(&out_mutex);
-        outputs.push_back(a);
-        pthread_mutex_unlock(&out_mutex);
+    if (sampler) {
+        sampler->merge(sums);
     }
 
     delete p;
     return nullptr;
 }
 
+void usage(const char* prog) {
+    fprintf(stderr,
+            "usage: %s [options] starting_resevoir.json data.csv labels.csv "
+            "threads [d_min]\n"
+            "       [d_max] num_bins num_classes\n"
+            "options:\n"
+            "      --bin-edges <file> Bin at the quantile edges written by "
+            "data_preprocessing -q\n"
+            "                         instead of uniformly, [d_min], [d_max] "
+            "and num_bins\n"
+            "                         are then ignored\n"
+            "      --approx <rows>    Estimate the table from up to rows "
+            "observations per\n"
+            "                         class in one linear pass instead of "
+            "comparing every\n"
+            "                         pair, and print 95%% confidence "
+            "intervals\n"
+            "      --seed <n>         Seed the choice of rows for --approx "
+            "and the order\n"
+            "                         rows are checked in (default: 0)\n"
+            "      --threshold <deg>  Give up as soon as the smallest delta "
+            "is safely below\n"
+            "                         deg, such as the best one found so "
+            "far\n"
+            "      --max-zeros <f>    Give up as soon as more than a "
+            "fraction f of the\n"
+            "                         outputs are safely all zeros\n"
+            "      --early-stop       Stop simulating an observation once the "
+            "network is\n"
+            "                         quiet. The counts are the same as the "
+            "full run's\n"
+            "      --chunk <steps>    Steps between checks for --early-stop "
+            "(default: the\n"
+            "                         network's max_delay)\n"
+            "data.csv may also be a dataset written by convert_dataset, in "
+            "which case\n"
+            "labels.csv may be - to use its labels. [d_min] and [d_max] may "
+            "be - to use\n"
+            "the ranges of the dataset\n",
+            prog);
+    exit(1);
+}
+
 int main(int argc, char* argv[]) {
-    if (argc != 9) {
-        fprintf(stderr,
-                "usage: %s starting_resevoir.json data.csv labels.csv threads "
-                "[d_min] [d_max] num_bins num_classes\n",
-                argv[0]);
-        exit(1);
+    const char* prog = argv[0];
+    string edges_path;
+    size_t approx_rows = 0;
+    uint64_t seed = 0;
+
+    static struct option long_options[] = {
+        {"bin-edges", required_argument, 0, 'E'},
+        {"approx", required_argument, 0, 'A'},
+        {"seed", required_argument, 0, 'S'},
+        {"threshold", required_argument, 0, 'T'},
+        {"max-zeros", required_argument, 0, 'Z'},
+        {"early-stop", no_argument, 0, 'Q'},
+        {"chunk", required_argument, 0, 'C'},
+        {0, 0, 0, 0},
+    };
+
+    int c;
+    while ((c = getopt_long(argc, argv, "", long_options, nullptr)) != -1) {
+        switch (c) {
+        case 'E':
+            edges_path = optarg;
+            break;
+        case 'A':
+            if (sscanf(optarg, "%zu", &approx_rows) != 1 || approx_rows < 2) {
+                usage(prog);
+            }
+            break;
+        case 'S':
+            seed = strtoull(optarg, nullptr, 0);
+            break;
+        case 'T':
+            limits.min_delta = strtod(optarg, nullptr) * M_PI / 180;
+            break;
+        case 'Z':
+            limits.max_zeros = strtod(optarg, nullptr);
+            break;
+        case 'Q':
+            simulation.early_stop = true;
+            break;
+        case 'C':
+            simulation.chunk = atoi(optarg);
+            break;
+        default:
+            usage(prog);
+        }
+    }
+
+    if (argc - optind != 8) {
+        usage(prog);
     }
 
+    // Line the positional arguments back up with argv[1..]
+    argv += optind - 1;
+
     json network_json;
     vector<string> json_source = {argv[1]};
 
@@ -111,49 +238,75 @@ int main(int argc, char* argv[]) {
 
     Network* n = new Network();
     n->from_json(network_json);
+    simulation_set_network(simulation, n);
 
-    fstream data(argv[2]);
-    fstream labels(argv[3]);
-
-    string line;
-
-    while (!data.eof() && !labels.eof()) {
-        getline(data, line);
-        if (line.length() == 0) {
-            break;
-        }
-
-        dataset.push_back({});
-
-        std::replace(line.begin(), line.end(), ',', ' ');
-        stringstream ss(line);
-        double data;
-        while (ss >> data) {
-            dataset.back().features.push_back(data);
-        }
+    size_t thread_count;
+    sscanf(argv[4], "%zu", &thread_count);
 
-        int label;
-        labels >> label;
+    string error;
+    if (!dataset_load(argv[2], argv[3], thread_count, dataset, error)) {
+        fprintf(stderr, "%s: main: %s\n", __FILE__, error.c_str());
+        exit(1);
+    }
 
-        dataset.back().label = label;
+    if (!dataset.y) {
+        fprintf(stderr, "%s: main: %s has no labels\n", __FILE__, argv[2]);
+        exit(1);
     }
 
-    size_t thread_count;
-    sscanf(argv[4], "%zu", &thread_count);
+    if (approx_rows && dataset.rows > SampledGrader::max_rows) {
+        fprintf(stderr, "%s: main: --approx takes at most %zu rows\n",
+                __FILE__, SampledGrader::max_rows);
+        exit(1);
+    }
 
-    stringstream dmin(argv[5]);
-    dmin >> d_min;
-    stringstream dmax(argv[6]);
-    dmax >> d_max;
+    if (!dataset_parse_range(argv[5], dataset.d_min, dataset.cols, d_min) ||
+        !dataset_parse_range(argv[6], dataset.d_max, dataset.cols, d_max)) {
+        fprintf(stderr,
+                "%s: main: Expected %zu values in [d_min] and [d_max]\n",
+                __FILE__, dataset.cols);
+        exit(1);
+    }
 
     sscanf(argv[7], "%zu", &num_bins);
 
     sscanf(argv[8], "%zu", &num_classes);
 
-    const size_t num_outputs = n->num_outputs();
-    bool done = false;
+    // The graders index their per-class state by label
+    if (dataset.num_classes > num_classes) {
+        fprintf(stderr, "%s: main: %s has label %zu, but num_classes is %zu\n",
+                __FILE__, argv[2], dataset.num_classes - 1, num_classes);
+        exit(1);
+    }
+
+    if (!encoder_make(edges_path, d_min.data(), d_max.data(), dataset.cols,
+                      num_bins, encoder, error)) {
+        fprintf(stderr, "%s: main: %s\n", __FILE__, error.c_str());
+        exit(1);
+    }
+    encoded = encoder.encode(dataset.x, dataset.rows);
+
+    num_outputs = n->num_outputs();
+    if (approx_rows) {
+        sampler = new SampledGrader(dataset.y, dataset.rows, num_outputs,
+                                    num_classes, approx_rows, seed);
+    }
+    if (!sampler || limits.any()) {
+        outputs.assign(dataset.rows * num_outputs, 0);
+    }
     n->make_sorted_node_vector();
 
+    // Checkpoints need the rows done so far to be a random sample
+    order.resize(dataset.rows);
+    for (size_t i = 0; i < dataset.rows; i++) {
+        order[i] = i;
+    }
+    if (limits.any()) {
+        shuffle(order.begin(), order.end(), mt19937_64(seed));
+    }
+    stage_ends = grade_stage_ends(dataset.rows, limits);
+    pthread_barrier_init(&stage_barrier, nullptr, thread_count);
+
     // SETUP Thread pool
     pthread_t* threads = (pthread_t*)calloc(thread_count, sizeof(pthread_t));
     for (std::size_t i = 0; i < thread_count; i++) {
@@ -165,108 +318,99 @@ int main(int argc, char* argv[]) {
     }
 
     free(threads);
+    pthread_barrier_destroy(&stage_barrier);
 
-    vector<vector<obs>> dunn(num_classes, vector<obs>(num_classes));
-    size_t total_zeros = 0;
-
-    for (size_t i = 0; i < outputs.size(); i++) {
-        // printf("%d: [", outputs[i].label);
-        // for (size_t j = 0; j < outputs[i].v.size(); j++) {
-        //     printf("%2d", outputs[i].v[j]);
+    fprintf(stderr, "Spike cache: %zu hits, %zu misses\n", spike_cache.hits(),
+            spike_cache.misses());
+    if (simulation.early_stop) {
+        steps.print(stderr);
+    }
 
-        //     if (j != outputs[i].v.size() - 1) {
-        //         printf(", ");
-        //     }
-        // }
-        // printf("]\n");
+    // Every output is known now, so the zero limit is exact
+    if (!rejected && limits.max_zeros < 1) {
         size_t zeros = 0;
-
-        for (auto a : outputs[i].v) {
-            zeros += a == 0;
+        for (size_t i = 0; i < dataset.rows; i++) {
+            const double* o = &outputs[i * num_outputs];
+            zeros += all_of(o, o + num_outputs,
+                            [](double x) { return x == 0; });
         }
 
-        if (zeros == outputs[i].v.size()) {
-            total_zeros++;
-            continue;
+        if (zeros > limits.max_zeros * dataset.rows) {
+            rejected = true;
+            rejected_at = dataset.rows;
+            reject_reason = to_string(zeros) + " of the outputs are all zeros";
         }
+    }
 
-        for (size_t j = 0; j < outputs.size(); j++) {
-            if (i == j) {
-                continue;
-            }
-
-            atom a = outputs[i];
-            atom b = outputs[j];
-            double dot = 0;
-            double a_norm = 0;
-            double b_norm = 0;
-            bool equal = true;
-            for (size_t k = 0; k < a.v.size(); k++) {
-                if (a.v[k] != b.v[k]) {
-                    equal = false;
-                }
-
-                if (a.v[k] == 0 || b.v[k] == 0) {
-                    // pass
-                } else {
-                    dot += a.v[k] * b.v[k];
-                }
-                if (a.v[k] != 0) {
-                    a_norm += pow(a.v[k], 2);
-                }
-                if (b.v[k] != 0) {
-                    b_norm += pow(b.v[k], 2);
-                }
-            }
+    if (rejected) {
+        printf("Rejected after %zu/%zu rows: %s\n", rejected_at, dataset.rows,
+               reject_reason.c_str());
+        printf("INVALID RESERVOIR\n");
+        delete sampler;
+        delete n;
+        return 0;
+    }
 
-            if (equal) {
-                dunn[a.label][b.label].total += 0;
-            } else if (a_norm != 0 && b_norm != 0) {
-                double val = dot / (sqrt(a_norm) * sqrt(b_norm));
-                dunn[a.label][b.label].total += acos(val);
-            } else {
-                dunn[a.label][b.label].total += 1;
+    // Mean angle between the outputs of each pair of classes, and the
+    // standard error of that and the pairs it is from when it is estimated
+    vector<vector<double>> vals;
+    vector<vector<double>> errors;
+    vector<vector<size_t>> pairs;
+    size_t total_zeros;
+    if (sampler) {
+        vals = sampler->grade(errors, true, &pairs);
+        total_zeros = sampler->zeros();
+        delete sampler;
+    } else {
+        PairwiseGrader grader(outputs.data(), dataset.y, dataset.rows,
+                              num_outputs, num_classes);
+        const GradeTable dunn = grader.grade(thread_count);
+        total_zeros = grader.zeros();
+
+        vals.assign(num_classes, vector<double>(num_classes));
+        for (size_t i = 0; i < num_classes; i++) {
+            for (size_t j = 0; j < num_classes; j++) {
+                vals[i][j] = dunn[i][j].total / dunn[i][j].count;
             }
-
-            dunn[a.label][b.label].count++;
         }
     }
 
-    vector<vector<double>> vals(num_classes, vector<double>(num_classes));
-
-    for (size_t i = 0; i < dunn.size(); i++) {
-        for (size_t j = 0; j < dunn[i].size(); j++) {
-            vals[i][j] = dunn[i][j].total / dunn[i][j].count;
-            printf("%10.3f ", dunn[i][j].total / dunn[i][j].count);
+    for (size_t i = 0; i < vals.size(); i++) {
+        for (size_t j = 0; j < vals[i].size(); j++) {
+            printf("%10.3f ", vals[i][j]);
         }
         puts("");
     }
     puts("");
-    printf("Total zeros: %zu/%zu\n", total_zeros, outputs.size());
-
-    bool valid = true;
+    printf("Total zeros: %zu/%zu\n", total_zeros, dataset.rows);
 
     // Calculate the smallest delta between each class and the others
-    for (size_t i = 0; i < vals.size(); i++) {
-        double smallest = 1;
-        double target = vals[i][i];
-
-        for (size_t j = 0; j < vals.size(); j++) {
-            if (i == j) {
-                continue;
-            }
-
-            if (abs(target - vals[i][j]) < smallest) {
-                smallest = abs(target - vals[i][j]);
-            }
-        }
-
-        if (smallest < 0) {
+    vector<size_t> nearest;
+    const vector<double> deltas = grade_deltas(vals, &nearest);
+    bool valid = true;
+    for (size_t i = 0; i < deltas.size(); i++) {
+        if (deltas[i] < 0) {
             valid = false;
         }
 
-        printf("Class %d smallest delta %f\n", (int)i + 1,
-               smallest * 180 / M_PI);
+        if (errors.empty()) {
+            printf("Class %d smallest delta %f\n", (int)i + 1,
+                   deltas[i] * 180 / M_PI);
+        } else {
+            // Both estimates' errors, as if they were independent, with a t
+            // quantile for the cell with fewer pairs
+            const size_t j = nearest[i];
+            const double error =
+                j == i ? 0
+                       : sqrt((errors[i][i] * errors[i][i]) +
+                              (errors[i][j] * errors[i][j]));
+            const double dof =
+                (double)std::min(pairs[i][i], pairs[i][j]) - 1;
+            const double margin =
+                error == 0 ? 0 : grade_t_quantile(0.025, dof) * error;
+            printf("Class %d smallest delta %f +- %f\n", (int)i + 1,
+                   deltas[i] * 180 / M_PI, margin * 180 / M_PI);
+        }
     }
 
     if (!valid) {
@@ -0,0 +1,233 @@
+#include "dataset.hpp"
+#include "encoder.hpp"
+#include "feature_cache.hpp"
+#include "framework.hpp"
+#include "model.hpp"
+#include "readout.hpp"
+#include "spike_cache.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <cstdlib>
+#include <fstream>
+#include <getopt.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <string>
+#include <unistd.h>
+
+using namespace std;
+using namespace neuro;
+using nlohmann::json;
+
+Dataset dataset;
+atomic_size_t dataset_idx = 0;
+FeatureMatrix features;
+Model model;
+SpikeEncoder encoder;
+// Input neuron of every spike of every row, encoder.width() per row
+vector<uint16_t> encoded;
+SpikeCache spike_cache;
+
+// Same encoding and simulation as the classify worker
+void* worker(void* arg) {
+    Network* n = (Network*)arg;
+    Processor* p = nullptr;
+
+    json proc_params = n->get_data("proc_params");
+    string proc_name = n->get_data("other")["proc_name"];
+
+    p = Processor::make(proc_name, proc_params);
+    p->load_network(n);
+
+    while (true) {
+        size_t work_idx = dataset_idx++;
+        if (work_idx >= dataset.rows) {
+            break;
+        }
+
+        const uint16_t* row = &encoded[work_idx * encoder.width()];
+        const vector<uint16_t> spikes(row, row + encoder.width());
+
+        vector<int> output_counts;
+        if (!spike_cache.lookup(spikes, output_counts)) {
+            p->clear_activity();
+            for (uint16_t s : spikes) {
+                p->apply_spike({s, 0, 255}, false);
+            }
+
+            p->run(100);
+            output_counts = p->output_counts();
+            spike_cache.insert(spikes, output_counts);
+        }
+
+        // 1 for bias
+        double* x = features.row(work_idx);
+        x[0] = 1;
+        for (size_t i = 0; i < output_counts.size(); i++) {
+            x[i + 1] = output_counts[i] / (double)100;
+        }
+        features.y[work_idx] = dataset.y ? dataset.y[work_idx] : -1;
+    }
+
+    delete p;
+    return nullptr;
+}
+
+void usage(const char* prog) {
+    fprintf(stderr,
+            "usage: %s [options] model.bin data.csv num_threads [labels.csv]\n"
+            "options:\n"
+            "  -n, --network <file>   Use this reservoir instead of the one "
+            "recorded in\n"
+            "                         the model\n"
+            "Prints one predicted class per row of data.csv, and the "
+            "accuracy on stderr\n"
+            "when labels are given. data.csv may also be a dataset written "
+            "by\n"
+            "convert_dataset, whose own labels are used unless labels.csv is "
+            "given\n",
+            prog);
+    exit(1);
+}
+
+int main(int argc, char* argv[]) {
+    const char* prog = argv[0];
+    string network_path;
+
+    static struct option long_options[] = {
+        {"network", required_argument, 0, 'n'},
+        {0, 0, 0, 0},
+    };
+
+    int c;
+    while ((c = getopt_long(argc, argv, "n:", long_options, nullptr)) != -1) {
+        switch (c) {
+        case 'n':
+            network_path = optarg;
+            break;
+        default:
+            usage(prog);
+        }
+    }
+
+    if (argc - optind != 3 && argc - optind != 4) {
+        usage(prog);
+    }
+
+    const bool have_labels = argc - optind == 4;
+
+    // Line the positional arguments back up with argv[1..]
+    argv += optind - 1;
+
+    if (!model_load(argv[1], model)) {
+        fprintf(stderr, "%s: main: Unable to load model %s\n", __FILE__,
+                argv[1]);
+        exit(1);
+    }
+
+    if (network_path.empty()) {
+        network_path = model.network_path;
+    }
+
+    if (network_file_hash(network_path) != model.network_hash) {
+        fprintf(stderr,
+                "%s: main: Warning: %s differs from the network the model was "
+                "trained on\n",
+                __FILE__, network_path.c_str());
+    }
+
+    json network_json;
+    ifstream fin(network_path);
+    fin >> network_json;
+
+    Network* n = new Network();
+    n->from_json(network_json);
+    n->make_sorted_node_vector();
+
+    if ((size_t)n->num_outputs() + 1 != model.num_features) {
+        fprintf(stderr,
+                "%s: main: Network has %d outputs but the model expects %zu\n",
+                __FILE__, n->num_outputs(), model.num_features - 1);
+        exit(1);
+    }
+
+    size_t thread_count;
+    sscanf(argv[3], "%zu", &thread_count);
+
+    string error;
+    if (!dataset_load(argv[2], have_labels ? argv[4] : "-", thread_count,
+                      dataset, error)) {
+        fprintf(stderr, "%s: main: %s\n", __FILE__, error.c_str());
+        exit(1);
+    }
+
+    if (dataset.rows > 0 && dataset.cols != model.d_min.size()) {
+        fprintf(stderr,
+                "%s: main: %s has %zu features but the model expects %zu\n",
+                __FILE__, argv[2], dataset.cols, model.d_min.size());
+        exit(1);
+    }
+
+    encoder = model_encoder(model);
+    encoded = encoder.encode(dataset.x, dataset.rows);
+
+    features.allocate(dataset.rows, model.num_features);
+
+    pthread_t* threads = (pthread_t*)calloc(thread_count, sizeof(pthread_t));
+    for (size_t i = 0; i < thread_count; i++) {
+        pthread_create(threads + i, nullptr, worker, n);
+    }
+
+    for (size_t i = 0; i < thread_count; i++) {
+        pthread_join(threads[i], nullptr);
+    }
+
+    free(threads);
+
+    Readout<double> r(model.num_classes, model.num_features);
+    r.w = model.w;
+
+    vector<vector<int>> conf(model.num_classes,
+                             vector<int>(model.num_classes, 0));
+    size_t correct = 0;
+    size_t labeled = 0;
+
+    const size_t chunk = 256;
+    vector<double> probs(chunk * model.num_classes);
+    for (size_t start = 0; start < features.rows; start += chunk) {
+        const size_t rows = min(chunk, features.rows - start);
+        r.forward(features.row(start), rows, probs.data());
+
+        for (size_t b = 0; b < rows; b++) {
+            const double* p = &probs[b * model.num_classes];
+            const int predicted = max_element(p, p + model.num_classes) - p;
+            const int label = features.y[start + b];
+
+            printf("%d\n", predicted);
+
+            if (label >= 0 && (size_t)label < model.num_classes) {
+                conf[label][predicted]++;
+                correct += predicted == label;
+                labeled++;
+            }
+        }
+    }
+
+    fprintf(stderr, "Spike cache: %zu hits, %zu misses\n", spike_cache.hits(),
+            spike_cache.misses());
+
+    if (labeled > 0) {
+        fprintf(stderr, "CONFUSION MATRIX:\n");
+        for (size_t i = 0; i < conf.size(); i++) {
+            for (size_t j = 0; j < conf[i].size(); j++) {
+                fprintf(stderr, "%4d ", conf[i][j]);
+            }
+            fprintf(stderr, "\n");
+        }
+        fprintf(stderr, "\n Accuracy: %.2f\n", correct / (double)labeled);
+    }
+
+    delete n;
+}
@@ -0,0 +1,350 @@
+#include "dataset.hpp"
+#include "encoder.hpp"
+#include "framework.hpp"
+#include "spike_cache.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <fstream>
+#include <getopt.h>
+#include <pthread.h>
+#include <string>
+#include <unistd.h>
+#include <unordered_map>
+
+using namespace std;
+using namespace neuro;
+using nlohmann::json;
+
+Dataset dataset;
+SpikeEncoder encoder;
+
+// Every distinct row of input spikes, encoder.width() each. Pruning only
+// depends on which inputs are seen, not how often
+vector<uint16_t> patterns;
+size_t num_patterns;
+
+// Output counts of every pattern, num_outputs each, and for every node in
+// sorted_node_vector order whether it fired on any of them
+Network* network;
+size_t num_outputs;
+vector<int> counts;
+vector<char> fired;
+
+atomic_size_t next_pattern = 0;
+pthread_mutex_t fired_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Runs every pattern on `network`, as grade would. Outputs go to counts and
+// the neurons that fired to `fired`
+void* worker(void*) {
+    json proc_params = network->get_data("proc_params");
+    string proc_name = network->get_data("other")["proc_name"];
+    Processor* p = Processor::make(proc_name, proc_params);
+    p->load_network(network);
+
+    vector<char> local(network->num_nodes(), 0);
+    while (true) {
+        const size_t k = next_pattern++;
+        if (k >= num_patterns) {
+            break;
+        }
+
+        p->clear_activity();
+        const uint16_t* spikes = &patterns[k * encoder.width()];
+        for (size_t s = 0; s < encoder.width(); s++) {
+            p->apply_spike({spikes[s], 0, 255}, false);
+        }
+
+        p->run(100);
+        const vector<int> v = p->output_counts();
+        copy(v.begin(), v.end(), &counts[k * num_outputs]);
+
+        const vector<int> neurons = p->neuron_counts();
+        for (size_t i = 0; i < local.size(); i++) {
+            local[i] |= neurons[i] > 0;
+        }
+    }
+    delete p;
+
+    pthread_mutex_lock(&fired_lock);
+    for (size_t i = 0; i < local.size(); i++) {
+        fired[i] |= local[i];
+    }
+    pthread_mutex_unlock(&fired_lock);
+
+    return nullptr;
+}
+
+void simulate(size_t thread_count) {
+    network->make_sorted_node_vector();
+    num_outputs = network->num_outputs();
+    counts.assign(num_patterns * num_outputs, 0);
+    fired.assign(network->num_nodes(), 0);
+    next_pattern = 0;
+
+    vector<pthread_t> threads(thread_count);
+    for (size_t i = 0; i < thread_count; i++) {
+        pthread_create(&threads[i], nullptr, worker, nullptr);
+    }
+
+    for (size_t i = 0; i < thread_count; i++) {
+        pthread_join(threads[i], nullptr);
+    }
+}
+
+void usage(const char* prog) {
+    fprintf(stderr,
+            "usage: %s [options] network.json data.csv threads [d_min] "
+            "[d_max] num_bins\n"
+            "Runs every row of the dataset through the network, as bin/grade "
+            "does, and\n"
+            "removes what cannot affect its outputs on them: neurons that "
+            "never fire,\n"
+            "edges out of them, and neurons and edges with no path to an "
+            "output that\n"
+            "fires. Output neurons that never fire are removed as well. The "
+            "pruned\n"
+            "network is checked to give the same output counts on every row "
+            "before it is\n"
+            "written. The dataset arguments are those of bin/grade, without "
+            "the labels.\n"
+            "options:\n"
+            "  -o, --output <file>    Where to write the pruned network "
+            "(default:\n"
+            "                         pruned.json)\n"
+            "      --bin-edges <file> Bin at the quantile edges written by "
+            "data_preprocessing -q\n"
+            "      --keep-outputs     Keep every output neuron, so the "
+            "outputs line up with\n"
+            "                         the original network's\n"
+            "      --drop-constant    Also remove output neurons whose count "
+            "is the same\n"
+            "                         non-zero value on every row. This "
+            "changes grades,\n"
+            "                         which compare whole output vectors\n",
+            prog);
+    exit(1);
+}
+
+int main(int argc, char* argv[]) {
+    const char* prog = argv[0];
+    string edges_path;
+    string output_path = "pruned.json";
+    bool keep_outputs = false;
+    bool drop_constant = false;
+
+    static struct option long_options[] = {
+        {"output", required_argument, 0, 'o'},
+        {"bin-edges", required_argument, 0, 'E'},
+        {"keep-outputs", no_argument, 0, 'K'},
+        {"drop-constant", no_argument, 0, 'D'},
+        {0, 0, 0, 0},
+    };
+
+    int c;
+    while ((c = getopt_long(argc, argv, "o:", long_options, nullptr)) != -1) {
+        switch (c) {
+        case 'o':
+            output_path = optarg;
+            break;
+        case 'E':
+            edges_path = optarg;
+            break;
+        case 'K':
+            keep_outputs = true;
+            break;
+        case 'D':
+            drop_constant = true;
+            break;
+        default:
+            usage(prog);
+        }
+    }
+
+    if (argc - optind != 6 || (keep_outputs && drop_constant)) {
+        usage(prog);
+    }
+
+    // Line the positional arguments back up with argv[1..]
+    argv += optind - 1;
+
+    json network_json;
+    ifstream fin(argv[1]);
+    fin >> network_json;
+    if (!fin) {
+        fprintf(stderr, "%s: main: Unable to read %s\n", __FILE__, argv[1]);
+        exit(1);
+    }
+
+    network = new Network();
+    network->from_json(network_json);
+
+    size_t thread_count;
+    sscanf(argv[3], "%zu", &thread_count);
+    thread_count = max<size_t>(1, thread_count);
+
+    string error;
+    if (!dataset_load(argv[2], "-", thread_count, dataset, error)) {
+        fprintf(stderr, "%s: main: %s\n", __FILE__, error.c_str());
+        exit(1);
+    }
+
+    // Nothing could be proven to fire, or to give the same counts
+    if (dataset.rows == 0) {
+        fprintf(stderr, "%s: main: %s has no rows\n", __FILE__, argv[2]);
+        exit(1);
+    }
+
+    vector<double> d_min;
+    vector<double> d_max;
+    if (!dataset_parse_range(argv[4], dataset.d_min, dataset.cols, d_min) ||
+        !dataset_parse_range(argv[5], dataset.d_max, dataset.cols, d_max)) {
+        fprintf(stderr,
+                "%s: main: Expected %zu values in [d_min] and [d_max]\n",
+                __FILE__, dataset.cols);
+        exit(1);
+    }
+
+    size_t num_bins;
+    sscanf(argv[6], "%zu", &num_bins);
+
+    if (!encoder_make(edges_path, d_min.data(), d_max.data(), dataset.cols,
+                      num_bins, encoder, error)) {
+        fprintf(stderr, "%s: main: %s\n", __FILE__, error.c_str());
+        exit(1);
+    }
+
+    if (encoder.num_inputs() > (size_t)network->num_inputs()) {
+        fprintf(stderr, "%s: main: The encoder needs %zu inputs, %s has %d\n",
+                __FILE__, encoder.num_inputs(), argv[1],
+                network->num_inputs());
+        exit(1);
+    }
+
+    const vector<uint16_t> encoded = encoder.encode(dataset.x, dataset.rows);
+    unordered_map<vector<uint16_t>, uint32_t, SpikePatternHash> pattern_ids;
+    for (size_t i = 0; i < dataset.rows; i++) {
+        const uint16_t* row = &encoded[i * encoder.width()];
+        vector<uint16_t> spikes(row, row + encoder.width());
+        if (pattern_ids.emplace(spikes, pattern_ids.size()).second) {
+            patterns.insert(patterns.end(), row, row + encoder.width());
+        }
+    }
+    num_patterns = pattern_ids.size();
+
+    simulate(thread_count);
+    const vector<int> original = counts;
+    const size_t original_outputs = num_outputs;
+    const size_t nodes_before = network->num_nodes();
+    const size_t edges_before = network->num_edges();
+
+    unordered_map<uint32_t, size_t> node_index;
+    for (size_t i = 0; i < network->sorted_node_vector.size(); i++) {
+        node_index[network->sorted_node_vector[i]->id] = i;
+    }
+    const auto has_fired = [&](const Node* node) {
+        return fired[node_index[node->id]] != 0;
+    };
+
+    // Outputs that stay, and where their counts were in the original network
+    vector<uint32_t> outputs;
+    vector<size_t> output_from;
+    for (size_t o = 0; o < original_outputs; o++) {
+        Node* node = network->get_output(o);
+        bool constant = true;
+        for (size_t k = 1; k < num_patterns && constant; k++) {
+            constant = original[k * original_outputs + o] == original[o];
+        }
+
+        if (keep_outputs ||
+            (has_fired(node) && !(drop_constant && constant))) {
+            outputs.push_back(node->id);
+            output_from.push_back(o);
+        }
+    }
+
+    // Neurons that matter are those a spike can travel from to an output that
+    // stays and fires, through neurons that fire
+    unordered_map<uint32_t, bool> live;
+    vector<Node*> stack;
+    for (uint32_t id : outputs) {
+        Node* node = network->get_node(id);
+        if (has_fired(node)) {
+            live[id] = true;
+            stack.push_back(node);
+        }
+    }
+    while (!stack.empty()) {
+        Node* node = stack.back();
+        stack.pop_back();
+        for (Edge* e : node->incoming) {
+            if (has_fired(e->from) && !live[e->from->id]) {
+                live[e->from->id] = true;
+                stack.push_back(e->from);
+            }
+        }
+    }
+
+    // An edge only delivers spikes if its source fires, and they only matter
+    // if its target is live
+    vector<pair<uint32_t, uint32_t>> dead_edges;
+    for (auto it = network->edges_begin(); it != network->edges_end(); ++it) {
+        const Edge* e = it->second.get();
+        if (!has_fired(e->from) || !live[e->to->id]) {
+            dead_edges.push_back({e->from->id, e->to->id});
+        }
+    }
+    for (const auto& e : dead_edges) {
+        network->remove_edge(e.first, e.second);
+    }
+
+    // Inputs stay whatever they do, so the encoder's input indices still hold
+    vector<uint32_t> dead_nodes;
+    for (auto it = network->begin(); it != network->end(); ++it) {
+        const Node* node = it->second.get();
+        const bool kept_output = find(outputs.begin(), outputs.end(),
+                                      node->id) != outputs.end();
+        if (!node->is_input() && !kept_output && !live[node->id]) {
+            dead_nodes.push_back(node->id);
+        }
+    }
+    for (uint32_t id : dead_nodes) {
+        network->remove_node(id, true);
+    }
+
+    // Check the pruned network against the original on every input
+    simulate(thread_count);
+    bool same = num_outputs == outputs.size();
+    for (size_t o = 0; o < num_outputs && same; o++) {
+        same = network->get_output(o)->id == outputs[o];
+    }
+    for (size_t k = 0; k < num_patterns && same; k++) {
+        for (size_t o = 0; o < num_outputs && same; o++) {
+            same = counts[k * num_outputs + o] ==
+                   original[k * original_outputs + output_from[o]];
+        }
+    }
+
+    if (!same) {
+        fprintf(stderr,
+                "%s: main: The pruned network's output counts differ, not "
+                "writing it\n",
+                __FILE__);
+        exit(1);
+    }
+
+    ofstream fout(output_path);
+    fout << network->to_json() << endl;
+    if (!fout) {
+        fprintf(stderr, "%s: main: Unable to write %s\n", __FILE__,
+                output_path.c_str());
+        exit(1);
+    }
+
+    printf("Nodes: %zu -> %zu\n", nodes_before, network->num_nodes());
+    printf("Edges: %zu -> %zu\n", edges_before, network->num_edges());
+    printf("Outputs: %zu -> %zu\n", original_outputs, num_outputs);
+    printf("Checked on %zu rows, %zu distinct inputs\n", dataset.rows,
+           num_patterns);
+}
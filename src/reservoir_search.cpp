@@ -0,0 +1,867 @@
+#include "dataset.hpp"
+#include "encoder.hpp"
+#include "framework.hpp"
+#include "generator.hpp"
+#include "grading.hpp"
+#include "spike_cache.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <cstdlib>
+#include <fstream>
+#include <getopt.h>
+#include <map>
+#include <pthread.h>
+#include <random>
+#include <string>
+#include <unistd.h>
+#include <unordered_map>
+
+using namespace std;
+using namespace neuro;
+using nlohmann::json;
+
+// One binning of the dataset: every distinct row of input spikes,
+// encoder.width() each, and which one each row of the dataset has. Rows that
+// bin the same are only simulated once
+struct Encoding {
+    SpikeEncoder encoder;
+    vector<uint16_t> patterns;
+    size_t num_patterns = 0;
+    vector<uint32_t> row_pattern;
+};
+
+struct Candidate {
+    ReservoirParams params;
+    const Encoding* encoding;
+    size_t num_bins;
+    unsigned seed;
+    // Set for mutants, which are not generated from their seed any more
+    const Reservoir* reservoir = nullptr;
+    size_t neurons;
+    size_t edges;
+    // Smallest of the per-class deltas, which candidates are ranked by
+    double min_delta;
+    vector<double> deltas;
+    size_t zeros;
+
+    // Candidates given up on part way are not graded at all
+    bool rejected = false;
+    string reason;
+};
+
+Dataset dataset;
+size_t num_classes;
+
+// Encodings by number of bins, only ever one of them with --bin-edges
+string edges_path;
+vector<double> d_min;
+vector<double> d_max;
+map<size_t, Encoding> encodings;
+
+// 0 for as many feature neurons as the encoding has inputs
+size_t feature_neurons;
+unsigned first_seed;
+size_t approx_rows;
+
+atomic_size_t next_candidate = 0;
+vector<Candidate> candidates;
+
+// Rows are simulated in this random order, in stages ending at stage_ends,
+// so every candidate can be checked against the limits between stages
+vector<size_t> order;
+vector<size_t> stage_ends;
+bool prune = true;
+double max_zeros = 1;
+
+pthread_mutex_t progress_lock = PTHREAD_MUTEX_INITIALIZER;
+size_t finished = 0;
+size_t rejected = 0;
+// Best smallest delta of any candidate graded so far
+double best_delta = 0;
+
+void grade(const vector<int>& counts, size_t num_outputs, Candidate& c) {
+    const vector<uint32_t>& row_pattern = c.encoding->row_pattern;
+    vector<vector<double>> vals;
+    if (approx_rows) {
+        // Every candidate is graded on the same sample of rows
+        SampledGrader sampler(dataset.y, dataset.rows, num_outputs,
+                              num_classes, approx_rows, 0);
+        SampledGrader::Sums sums = sampler.make_sums();
+        vector<int> v(num_outputs);
+        for (size_t i = 0; i < dataset.rows; i++) {
+            const int* row = &counts[row_pattern[i] * num_outputs];
+            v.assign(row, row + num_outputs);
+            sampler.add(i, v, sums);
+        }
+        sampler.merge(sums);
+
+        vector<vector<double>> errors;
+        vals = sampler.grade(errors);
+        c.zeros = sampler.zeros();
+    } else {
+        vector<double> outputs(dataset.rows * num_outputs);
+        for (size_t i = 0; i < dataset.rows; i++) {
+            const int* row = &counts[row_pattern[i] * num_outputs];
+            copy(row, row + num_outputs, &outputs[i * num_outputs]);
+        }
+
+        PairwiseGrader grader(outputs.data(), dataset.y, dataset.rows,
+                              num_outputs, num_classes);
+        const GradeTable dunn = grader.grade(1);
+        c.zeros = grader.zeros();
+
+        vals.assign(num_classes, vector<double>(num_classes));
+        for (size_t i = 0; i < num_classes; i++) {
+            for (size_t j = 0; j < num_classes; j++) {
+                vals[i][j] = dunn[i][j].total / dunn[i][j].count;
+            }
+        }
+    }
+
+    c.deltas = grade_deltas(vals);
+    c.min_delta = *min_element(c.deltas.begin(), c.deltas.end());
+}
+
+// Candidates are spread over the threads whole, each one generated, simulated
+// and graded on a single thread. Between stages a candidate is checked against
+// the best delta so far, and given up on once it safely cannot beat it
+void* worker(void*) {
+    Reservoir r;
+    vector<int> counts;
+    vector<bool> simulated;
+
+    while (true) {
+        const size_t idx = next_candidate++;
+        if (idx >= candidates.size()) {
+            break;
+        }
+
+        Candidate& c = candidates[idx];
+        const Encoding& e = *c.encoding;
+        const Reservoir* res = c.reservoir;
+        if (!res) {
+            reservoir_generate(c.params, c.seed, r);
+            res = &r;
+        }
+        c.neurons = res->num_nodes();
+        c.edges = res->edges.size();
+
+        Network n;
+        reservoir_to_network(*res, n);
+        json proc_params = n.get_data("proc_params");
+        string proc_name = n.get_data("other")["proc_name"];
+        Processor* p = Processor::make(proc_name, proc_params);
+        p->load_network(&n);
+
+        const size_t num_outputs = n.num_outputs();
+        counts.resize(e.num_patterns * num_outputs);
+        simulated.assign(e.num_patterns, false);
+        const auto row_counts = [&](size_t i) {
+            return &counts[e.row_pattern[i] * num_outputs];
+        };
+
+        size_t k = 0;
+        for (size_t stage = 0; stage < stage_ends.size() && !c.rejected;
+             stage++) {
+            for (; k < stage_ends[stage]; k++) {
+                const uint32_t pattern = e.row_pattern[order[k]];
+                if (simulated[pattern]) {
+                    continue;
+                }
+
+                p->clear_activity();
+                const size_t width = e.encoder.width();
+                const uint16_t* spikes = &e.patterns[pattern * width];
+                for (size_t s = 0; s < width; s++) {
+                    p->apply_spike({spikes[s], 0, 255}, false);
+                }
+
+                p->run(100);
+                const vector<int> v = p->output_counts();
+                copy(v.begin(), v.end(), &counts[pattern * num_outputs]);
+                simulated[pattern] = true;
+            }
+
+            if (stage + 1 < stage_ends.size()) {
+                GradeLimits limits;
+                limits.max_zeros = max_zeros;
+                if (prune) {
+                    pthread_mutex_lock(&progress_lock);
+                    limits.min_delta = best_delta;
+                    pthread_mutex_unlock(&progress_lock);
+                }
+
+                c.rejected = grade_reject_partial(
+                    limits, dataset.y, order, stage_ends[stage], row_counts,
+                    num_outputs, num_classes, c.reason);
+                if (c.rejected) {
+                    c.reason = "after " + to_string(stage_ends[stage]) +
+                               " rows " + c.reason;
+                }
+            }
+        }
+        delete p;
+
+        // Every output is known now, so the zero limit is exact
+        if (!c.rejected && max_zeros < 1) {
+            size_t zeros = 0;
+            for (size_t i = 0; i < dataset.rows; i++) {
+                const int* o = row_counts(i);
+                zeros += all_of(o, o + num_outputs,
+                                [](int x) { return x == 0; });
+            }
+
+            if (zeros > max_zeros * dataset.rows) {
+                c.rejected = true;
+                c.reason = to_string(zeros) + " of the outputs are all zeros";
+            }
+        }
+
+        if (!c.rejected) {
+            grade(counts, num_outputs, c);
+        }
+
+        pthread_mutex_lock(&progress_lock);
+        finished++;
+        if (c.rejected) {
+            rejected++;
+        } else {
+            best_delta = max(best_delta, c.min_delta);
+        }
+        fprintf(stderr, "\0331\rGraded %zu/%zu, %zu rejected early", finished,
+                candidates.size(), rejected);
+        pthread_mutex_unlock(&progress_lock);
+    }
+
+    return nullptr;
+}
+
+// Bins the dataset with `num_bins` bins, once per number of bins
+const Encoding& encoding_for(size_t num_bins) {
+    auto it = encodings.find(num_bins);
+    if (it != encodings.end()) {
+        return it->second;
+    }
+
+    Encoding& e = encodings[num_bins];
+    string error;
+    if (!encoder_make(edges_path, d_min.data(), d_max.data(), dataset.cols,
+                      num_bins, e.encoder, error)) {
+        fprintf(stderr, "%s: main: %s\n", __FILE__, error.c_str());
+        exit(1);
+    }
+
+    // Only distinct rows of spikes need simulating, and they are the same
+    // for every candidate
+    const size_t width = e.encoder.width();
+    const vector<uint16_t> encoded = e.encoder.encode(dataset.x, dataset.rows);
+    unordered_map<vector<uint16_t>, uint32_t, SpikePatternHash> pattern_ids;
+    e.row_pattern.resize(dataset.rows);
+    for (size_t i = 0; i < dataset.rows; i++) {
+        const uint16_t* row = &encoded[i * width];
+        vector<uint16_t> spikes(row, row + width);
+        auto id = pattern_ids.find(spikes);
+        if (id == pattern_ids.end()) {
+            id = pattern_ids.emplace(spikes, pattern_ids.size()).first;
+            e.patterns.insert(e.patterns.end(), row, row + width);
+        }
+        e.row_pattern[i] = id->second;
+    }
+    e.num_patterns = pattern_ids.size();
+
+    fprintf(stderr, "%zu bins: %zu rows, %zu distinct inputs\n", num_bins,
+            dataset.rows, e.num_patterns);
+    return e;
+}
+
+Candidate candidate_make(const ReservoirParams& params, size_t num_bins,
+                         unsigned seed) {
+    Candidate c;
+    c.params = params;
+    c.encoding = &encoding_for(num_bins);
+    c.num_bins = num_bins;
+    c.seed = seed;
+
+    const size_t inputs = c.encoding->encoder.num_inputs();
+    c.params.feature_neurons = feature_neurons ? feature_neurons : inputs;
+    if (c.params.feature_neurons < inputs) {
+        fprintf(stderr,
+                "%s: main: %zu feature neurons is fewer than the %zu inputs\n",
+                __FILE__, c.params.feature_neurons, inputs);
+        exit(1);
+    }
+
+    return c;
+}
+
+// Generates, simulates and grades every one of `candidates`
+void run_candidates(size_t thread_count) {
+    next_candidate = 0;
+    finished = 0;
+    rejected = 0;
+
+    thread_count = max<size_t>(1, min(thread_count, candidates.size()));
+    vector<pthread_t> threads(thread_count);
+    for (size_t i = 0; i < thread_count; i++) {
+        pthread_create(&threads[i], nullptr, worker, nullptr);
+    }
+
+    for (size_t i = 0; i < thread_count; i++) {
+        pthread_join(threads[i], nullptr);
+    }
+    fprintf(stderr, "\n");
+}
+
+void write_reservoir(const Candidate& c, const string& path) {
+    Reservoir r;
+    if (c.reservoir) {
+        r = *c.reservoir;
+    } else {
+        reservoir_generate(c.params, c.seed, r);
+    }
+    Network n;
+    reservoir_to_network(r, n);
+
+    ofstream fout(path);
+    fout << n.to_json() << endl;
+    if (!fout) {
+        fprintf(stderr, "%s: main: Unable to write %s\n", __FILE__,
+                path.c_str());
+        exit(1);
+    }
+}
+
+// Smallest delta in degrees, less the size cost per thousand neurons and edges
+double size_cost;
+
+double candidate_score(const Candidate& c) {
+    if (c.rejected) {
+        return -INFINITY;
+    }
+
+    return c.min_delta * 180 / M_PI -
+           size_cost * (c.neurons + c.edges) / 1000;
+}
+
+struct TuneConfig {
+    ReservoirParams params;
+    size_t num_bins;
+    // Best score of any seed so far
+    double score = -INFINITY;
+};
+
+// Successive halving over random configurations around `centre`: every rung
+// grades all surviving configurations on three times as many seeds as the
+// last, the same seeds for all of them, and keeps the best third by score.
+// The candidates that no other beats on delta, neurons and edges at once are
+// printed, and the best scoring one is returned
+Candidate tune(size_t num_configs, size_t max_seeds,
+               const ReservoirParams& centre, size_t num_bins,
+               size_t thread_count) {
+    mt19937_64 rng(first_seed);
+    const auto log_uniform = [&](double lo, double hi) {
+        return exp(uniform_real_distribution<double>(log(lo), log(hi))(rng));
+    };
+
+    vector<TuneConfig> configs(num_configs);
+    for (TuneConfig& t : configs) {
+        t.params = centre;
+        t.params.size =
+            max<size_t>(1, llround(log_uniform(centre.size / 4.0,
+                                               centre.size * 2.0)));
+        t.params.connection_chance = log_uniform(
+            centre.connection_chance / 4, centre.connection_chance * 4);
+        t.params.class_neurons =
+            max<size_t>(1, llround(log_uniform(centre.class_neurons / 4.0,
+                                               centre.class_neurons * 2.0)));
+        // -o is the fraction of neurons above output_height
+        const double outputs = 1 - centre.output_height;
+        if (outputs > 0) {
+            t.params.output_height =
+                1 - log_uniform(outputs / 4, min(1.0, outputs * 4));
+        }
+        // Quantile edges are for one number of bins only
+        t.num_bins = edges_path.empty()
+                         ? uniform_int_distribution<size_t>(
+                               max<size_t>(2, num_bins / 2), num_bins * 2)(rng)
+                         : num_bins;
+    }
+
+    vector<Candidate> evaluated;
+    vector<size_t> alive(num_configs);
+    for (size_t i = 0; i < num_configs; i++) {
+        alive[i] = i;
+    }
+
+    size_t seeds_done = 0;
+    for (size_t rung = 0, seeds = 1;; rung++, seeds *= 3) {
+        candidates.clear();
+        vector<size_t> owner;
+        for (size_t i : alive) {
+            for (size_t k = seeds_done; k < seeds; k++) {
+                candidates.push_back(candidate_make(
+                    configs[i].params, configs[i].num_bins, first_seed + k));
+                owner.push_back(i);
+            }
+        }
+        seeds_done = seeds;
+
+        run_candidates(thread_count);
+        for (size_t k = 0; k < candidates.size(); k++) {
+            TuneConfig& t = configs[owner[k]];
+            t.score = max(t.score, candidate_score(candidates[k]));
+            evaluated.push_back(candidates[k]);
+        }
+
+        stable_sort(alive.begin(), alive.end(), [&](size_t a, size_t b) {
+            return configs[a].score > configs[b].score;
+        });
+        fprintf(stderr,
+                "Rung %zu: %zu configurations on %zu seeds each, best score "
+                "%f\n",
+                rung, alive.size(), seeds, configs[alive[0]].score);
+
+        if (alive.size() == 1 || seeds * 3 > max_seeds) {
+            break;
+        }
+        alive.resize((alive.size() + 2) / 3);
+    }
+
+    size_t best = 0;
+    for (size_t i = 1; i < evaluated.size(); i++) {
+        if (candidate_score(evaluated[i]) > candidate_score(evaluated[best])) {
+            best = i;
+        }
+    }
+
+    if (evaluated[best].rejected) {
+        fprintf(stderr, "%s: main: Every candidate was rejected\n", __FILE__);
+        exit(1);
+    }
+
+    const auto dominates = [](const Candidate& a, const Candidate& b) {
+        return a.min_delta >= b.min_delta && a.neurons <= b.neurons &&
+               a.edges <= b.edges &&
+               (a.min_delta > b.min_delta || a.neurons < b.neurons ||
+                a.edges < b.edges);
+    };
+
+    vector<const Candidate*> front;
+    for (const Candidate& c : evaluated) {
+        if (c.rejected) {
+            continue;
+        }
+
+        bool dominated = false;
+        for (const Candidate& d : evaluated) {
+            if (!d.rejected && dominates(d, c)) {
+                dominated = true;
+                break;
+            }
+        }
+
+        if (!dominated) {
+            front.push_back(&c);
+        }
+    }
+
+    sort(front.begin(), front.end(),
+         [](const Candidate* a, const Candidate* b) {
+             return a->edges < b->edges;
+         });
+
+    printf("# min_delta neurons edges score seed size p c o num_bins\n");
+    for (const Candidate* c : front) {
+        printf("%f %zu %zu %f %u %zu %g %zu %g %zu\n",
+               c->min_delta * 180 / M_PI, c->neurons, c->edges,
+               candidate_score(*c), c->seed, c->params.size,
+               c->params.connection_chance, c->params.class_neurons,
+               1 - c->params.output_height, c->num_bins);
+    }
+
+    const Candidate& b = evaluated[best];
+    fprintf(stderr,
+            "Graded %zu candidates\nBest: -s %zu -p %g -c %zu -o %g, %zu "
+            "bins, seed %u\n",
+            evaluated.size(), b.params.size, b.params.connection_chance,
+            b.params.class_neurons, 1 - b.params.output_height, b.num_bins,
+            b.seed);
+    return b;
+}
+
+// Grades num_seeds consecutive seeds of `params`, prints their ranking and
+// returns the best one
+Candidate search_seeds(const ReservoirParams& params, size_t num_seeds,
+                       size_t num_bins, size_t thread_count) {
+    for (size_t i = 0; i < num_seeds; i++) {
+        candidates.push_back(candidate_make(params, num_bins, first_seed + i));
+    }
+    run_candidates(thread_count);
+
+    // Rejected candidates go last, in seed order
+    vector<Candidate> ranked = candidates;
+    stable_sort(ranked.begin(), ranked.end(),
+                [](const Candidate& a, const Candidate& b) {
+                    if (a.rejected || b.rejected) {
+                        return !a.rejected && b.rejected;
+                    }
+                    return a.min_delta > b.min_delta;
+                });
+
+    printf("# rank seed min_delta zeros class_deltas...\n");
+    for (size_t i = 0; i < ranked.size(); i++) {
+        if (ranked[i].rejected) {
+            printf("- %u rejected %s\n", ranked[i].seed,
+                   ranked[i].reason.c_str());
+            continue;
+        }
+
+        printf("%zu %u %f %zu", i + 1, ranked[i].seed,
+               ranked[i].min_delta * 180 / M_PI, ranked[i].zeros);
+        for (double d : ranked[i].deltas) {
+            printf(" %f", d * 180 / M_PI);
+        }
+        printf("\n");
+    }
+
+    if (ranked[0].rejected) {
+        fprintf(stderr, "%s: main: Every candidate was rejected\n", __FILE__);
+        exit(1);
+    }
+
+    fprintf(stderr, "Best seed: %u\n", ranked[0].seed);
+    return ranked[0];
+}
+
+// Hill climbs from `best`: every round grades num_mutants copies of the
+// current reservoir with `mutations` random changes each, on all threads, and
+// moves to the best scoring mutant if it beats the current reservoir. The
+// reservoir reached is kept in `current`
+void refine(Candidate& best, Reservoir& current, size_t rounds,
+            size_t num_mutants, size_t mutations, size_t thread_count) {
+    reservoir_generate(best.params, best.seed, current);
+    best.reservoir = &current;
+
+    // Only mutants that beat the current reservoir matter, so without a size
+    // cost the others can be given up on as soon as that is safely clear
+    prune = prune && size_cost == 0;
+
+    mt19937_64 rng(best.seed);
+    vector<Reservoir> mutants(num_mutants);
+    size_t kept = 0;
+    for (size_t round = 0; round < rounds; round++) {
+        candidates.assign(num_mutants, best);
+        for (size_t i = 0; i < num_mutants; i++) {
+            mutants[i] = current;
+            for (size_t k = 0; k < mutations; k++) {
+                reservoir_mutate(mutants[i], rng);
+            }
+            candidates[i].reservoir = &mutants[i];
+        }
+
+        best_delta = best.min_delta;
+        run_candidates(thread_count);
+
+        size_t top = num_mutants;
+        double top_score = candidate_score(best);
+        for (size_t i = 0; i < num_mutants; i++) {
+            if (candidate_score(candidates[i]) > top_score) {
+                top = i;
+                top_score = candidate_score(candidates[i]);
+            }
+        }
+
+        if (top < num_mutants) {
+            current = mutants[top];
+            best = candidates[top];
+            best.reservoir = &current;
+            kept++;
+        }
+
+        fprintf(stderr, "Round %zu: smallest delta %f, %zu edges\n", round,
+                best.min_delta * 180 / M_PI, best.edges);
+    }
+
+    printf("# refined over %zu rounds, %zu of them improved: min_delta %f "
+           "neurons %zu edges %zu\n",
+           rounds, kept, best.min_delta * 180 / M_PI, best.neurons,
+           best.edges);
+}
+
+void usage(const char* prog) {
+    fprintf(stderr,
+            "usage: %s [options] data.csv labels.csv threads [d_min] [d_max] "
+            "num_bins\n"
+            "       num_classes\n"
+            "Generates a reservoir for each of a range of seeds, grades them "
+            "all like\n"
+            "bin/grade and writes the best one. The ranking of every seed is "
+            "printed on\n"
+            "stdout. The dataset arguments are those of bin/grade.\n"
+            "options:\n"
+            "  -n, --seeds <n>        Number of seeds to try (default: 100)\n"
+            "  -r, --seed <n>         First seed (default: 0)\n"
+            "  -s <size>              Reservoir size (default: 250)\n"
+            "  -p <probability>       Connection probability (default: "
+            "0.025)\n"
+            "  -f <feature_neurons>   Number of feature neurons (default: "
+            "number of inputs)\n"
+            "  -c <class_neurons>     Number of class neurons (default: 64)\n"
+            "  -o <fraction>          Fraction of the reservoir connected to "
+            "the class\n"
+            "                         neurons (default: 0.3)\n"
+            "  -w, --output <file>    Where to write the best reservoir "
+            "(default:\n"
+            "                         best_reservoir.json)\n"
+            "      --grid             Generate like generate_reservoir --grid\n"
+            "      --radius <r>       With --grid, only connect reservoir "
+            "neurons up to r\n"
+            "                         apart\n"
+            "      --bin-edges <file> Bin at the quantile edges written by "
+            "data_preprocessing -q\n"
+            "      --approx <rows>    Grade approximately from up to rows "
+            "observations per\n"
+            "                         class, see bin/grade\n"
+            "      --max-zeros <f>    Reject candidates with more than a "
+            "fraction f of\n"
+            "                         all-zero outputs, early when that is "
+            "safely clear\n"
+            "      --exhaustive       Grade every candidate fully instead of "
+            "rejecting those\n"
+            "                         that safely cannot beat the best so "
+            "far\n"
+            "      --tune <configs>   Also search -s, -p, -c, -o and num_bins, "
+            "by successive\n"
+            "                         halving from configs random "
+            "configurations around\n"
+            "                         the given values, with up to -n seeds "
+            "each. Prints\n"
+            "                         the Pareto front of smallest delta "
+            "against neurons\n"
+            "                         and edges instead of the ranking\n"
+            "      --size-cost <deg>  With --tune, score candidates by their "
+            "smallest delta\n"
+            "                         less deg per thousand neurons and edges "
+            "(default: 0)\n"
+            "      --refine <rounds>  Hill climb from the best reservoir "
+            "found for rounds\n"
+            "                         rounds of random edge and threshold "
+            "changes\n"
+            "      --mutants <n>      Mutants graded per round (default: "
+            "32)\n"
+            "      --mutations <n>    Changes made to each mutant (default: "
+            "1)\n",
+            prog);
+    exit(1);
+}
+
+int main(int argc, char* argv[]) {
+    const char* prog = argv[0];
+    string output_path = "best_reservoir.json";
+    size_t num_seeds = 100;
+    size_t num_configs = 0;
+    size_t refine_rounds = 0;
+    size_t num_mutants = 32;
+    size_t mutations = 1;
+
+    ReservoirParams params;
+    params.size = 250;
+    params.connection_chance = 0.025;
+    params.class_neurons = 64;
+    params.output_height = 1 - 0.3;
+
+    static struct option long_options[] = {
+        {"seeds", required_argument, 0, 'n'},
+        {"seed", required_argument, 0, 'r'},
+        {"output", required_argument, 0, 'w'},
+        {"grid", no_argument, 0, 'G'},
+        {"radius", required_argument, 0, 'D'},
+        {"bin-edges", required_argument, 0, 'E'},
+        {"approx", required_argument, 0, 'A'},
+        {"max-zeros", required_argument, 0, 'Z'},
+        {"exhaustive", no_argument, 0, 'X'},
+        {"tune", required_argument, 0, 'T'},
+        {"size-cost", required_argument, 0, 'C'},
+        {"refine", required_argument, 0, 'R'},
+        {"mutants", required_argument, 0, 'M'},
+        {"mutations", required_argument, 0, 'U'},
+        {0, 0, 0, 0},
+    };
+
+    int c;
+    while ((c = getopt_long(argc, argv, "n:r:s:p:f:c:o:w:", long_options,
+                            nullptr)) != -1) {
+        switch (c) {
+        case 'n':
+            num_seeds = strtoull(optarg, nullptr, 0);
+            break;
+        case 'r':
+            first_seed = strtoul(optarg, nullptr, 0);
+            break;
+        case 's':
+            params.size = strtoull(optarg, nullptr, 0);
+            break;
+        case 'p':
+            params.connection_chance = strtod(optarg, nullptr);
+            break;
+        case 'f':
+            feature_neurons = strtoull(optarg, nullptr, 0);
+            break;
+        case 'c':
+            params.class_neurons = strtoull(optarg, nullptr, 0);
+            break;
+        case 'o':
+            params.output_height = 1 - strtod(optarg, nullptr);
+            break;
+        case 'w':
+            output_path = optarg;
+            break;
+        case 'G':
+            params.grid = true;
+            break;
+        case 'D':
+            params.radius = strtod(optarg, nullptr);
+            if (!(params.radius > 0)) {
+                usage(prog);
+            }
+            break;
+        case 'E':
+            edges_path = optarg;
+            break;
+        case 'A':
+            if (sscanf(optarg, "%zu", &approx_rows) != 1 || approx_rows < 2) {
+                usage(prog);
+            }
+            break;
+        case 'Z':
+            max_zeros = strtod(optarg, nullptr);
+            break;
+        case 'X':
+            prune = false;
+            break;
+        case 'T':
+            if (sscanf(optarg, "%zu", &num_configs) != 1 || num_configs == 0) {
+                usage(prog);
+            }
+            break;
+        case 'C':
+            size_cost = strtod(optarg, nullptr);
+            break;
+        case 'R':
+            refine_rounds = strtoull(optarg, nullptr, 0);
+            break;
+        case 'M':
+            if (sscanf(optarg, "%zu", &num_mutants) != 1 || num_mutants == 0) {
+                usage(prog);
+            }
+            break;
+        case 'U':
+            if (sscanf(optarg, "%zu", &mutations) != 1 || mutations == 0) {
+                usage(prog);
+            }
+            break;
+        default:
+            usage(prog);
+        }
+    }
+
+    if (argc - optind != 7 || num_seeds == 0 || params.class_neurons == 0) {
+        usage(prog);
+    }
+
+    if (!params.grid && params.radius != INFINITY) {
+        fprintf(stderr, "%s: main: --radius only applies to --grid\n",
+                __FILE__);
+        exit(1);
+    }
+
+    if (params.grid && (params.size == 0 || params.size > UINT32_MAX)) {
+        fprintf(stderr,
+                "%s: main: --grid needs a reservoir of 1 to %u neurons\n",
+                __FILE__, UINT32_MAX);
+        exit(1);
+    }
+
+    // Line the positional arguments back up with argv[1..]
+    argv += optind - 1;
+
+    size_t thread_count;
+    sscanf(argv[3], "%zu", &thread_count);
+
+    string error;
+    if (!dataset_load(argv[1], argv[2], thread_count, dataset, error)) {
+        fprintf(stderr, "%s: main: %s\n", __FILE__, error.c_str());
+        exit(1);
+    }
+
+    if (!dataset.y) {
+        fprintf(stderr, "%s: main: %s has no labels\n", __FILE__, argv[1]);
+        exit(1);
+    }
+
+    if (approx_rows && dataset.rows > SampledGrader::max_rows) {
+        fprintf(stderr, "%s: main: --approx takes at most %zu rows\n",
+                __FILE__, SampledGrader::max_rows);
+        exit(1);
+    }
+
+    if (!dataset_parse_range(argv[4], dataset.d_min, dataset.cols, d_min) ||
+        !dataset_parse_range(argv[5], dataset.d_max, dataset.cols, d_max)) {
+        fprintf(stderr,
+                "%s: main: Expected %zu values in [d_min] and [d_max]\n",
+                __FILE__, dataset.cols);
+        exit(1);
+    }
+
+    size_t num_bins;
+    sscanf(argv[6], "%zu", &num_bins);
+
+    sscanf(argv[7], "%zu", &num_classes);
+
+    // The graders index their per-class state by label
+    if (dataset.num_classes > num_classes) {
+        fprintf(stderr, "%s: main: %s has label %zu, but num_classes is %zu\n",
+                __FILE__, argv[1], dataset.num_classes - 1, num_classes);
+        exit(1);
+    }
+
+    // Pruning against the best so far would hide the smaller, weaker
+    // candidates the Pareto front is after
+    const bool pruning = prune;
+    if (num_configs) {
+        prune = false;
+    }
+
+    GradeLimits limits;
+    limits.min_delta = prune ? 1 : 0;
+    limits.max_zeros = max_zeros;
+    stage_ends = grade_stage_ends(dataset.rows, limits);
+    order.resize(dataset.rows);
+    for (size_t i = 0; i < dataset.rows; i++) {
+        order[i] = i;
+    }
+    shuffle(order.begin(), order.end(), mt19937_64(first_seed));
+
+    Candidate best;
+    if (num_configs) {
+        best = tune(num_configs, num_seeds, params, num_bins, thread_count);
+    } else {
+        best = search_seeds(params, num_seeds, num_bins, thread_count);
+    }
+
+    Reservoir refined;
+    if (refine_rounds) {
+        prune = pruning;
+        refine(best, refined, refine_rounds, num_mutants, mutations,
+               thread_count);
+    }
+
+    write_reservoir(best, output_path);
+
+    fprintf(stderr, "\nSmallest Deltas:\n");
+    for (size_t i = 0; i < best.deltas.size(); i++) {
+        fprintf(stderr, "Class %zu: %f\n", i, best.deltas[i] * 180 / M_PI);
+    }
+}
@@ -0,0 +1,537 @@
+#include "csv.hpp"
+#include "encoder.hpp"
+#include "feature_cache.hpp"
+#include "framework.hpp"
+#include "model.hpp"
+#include "readout.hpp"
+#include "spike_cache.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <csignal>
+#include <cstddef>
+#include <cstdlib>
+#include <deque>
+#include <fstream>
+#include <getopt.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace std;
+using namespace neuro;
+using nlohmann::json;
+
+struct Connection;
+
+struct Request {
+    vector<double> features;
+    chrono::steady_clock::time_point received;
+    Connection* conn;
+    int label = -1;
+    bool done = false;
+};
+
+// One client stream. A reader submits every line it receives and a writer
+// sends the answers back in the same order, so clients may pipeline requests
+struct Connection {
+    int in_fd;
+    int out_fd;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    deque<Request*> pending;
+    bool closed = false;
+    // The socket connection's own thread, and whether it is done with the
+    // client
+    pthread_t thread;
+    atomic_bool finished{false};
+};
+
+Model model;
+SpikeEncoder encoder;
+Network* network = nullptr;
+SpikeCache spike_cache;
+// Most distinct input patterns kept in spike_cache, 0 for no caching
+size_t cache_size = 65536;
+size_t max_batch = 32;
+
+// Requests waiting for a worker
+pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+deque<Request*> queue;
+bool shutting_down = false;
+
+// Socket connections that have not been joined yet, only used by main
+vector<Connection*> connections;
+
+// Request latencies in microseconds, from the line being read to the answer
+// being ready. They are counted in buckets a sixteenth of a doubling wide, up
+// to 2^40 us, so a long-lived server keeps a fixed amount of memory and the
+// percentiles come out within about 2% of the exact ones
+const size_t latency_buckets_per_doubling = 16;
+const size_t latency_buckets = 40 * latency_buckets_per_doubling;
+pthread_mutex_t latency_lock = PTHREAD_MUTEX_INITIALIZER;
+size_t latency_counts[latency_buckets];
+
+size_t latency_bucket(double us) {
+    if (!(us > 1)) {
+        return 0;
+    }
+    return min((size_t)(log2(us) * latency_buckets_per_doubling),
+               latency_buckets - 1);
+}
+
+// Geometric middle of bucket b
+double bucket_latency(size_t b) {
+    return exp2((b + 0.5) / latency_buckets_per_doubling);
+}
+
+volatile sig_atomic_t interrupted = 0;
+
+void on_signal(int) { interrupted = 1; }
+
+// Starts a thread that never takes SIGINT or SIGTERM, so they always interrupt
+// the main thread's blocking read or accept()
+void start_thread(pthread_t* thread, void* (*fn)(void*), void* arg) {
+    sigset_t block, old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+    pthread_create(thread, nullptr, fn, arg);
+    pthread_sigmask(SIG_SETMASK, &old, nullptr);
+}
+
+// Each worker keeps its own Processor loaded with the network for the life of
+// the server, and answers up to max_batch queued requests at a time
+void* worker(void*) {
+    json proc_params = network->get_data("proc_params");
+    string proc_name = network->get_data("other")["proc_name"];
+
+    Processor* p = Processor::make(proc_name, proc_params);
+    p->load_network(network);
+
+    Readout<double> r(model.num_classes, model.num_features);
+    r.w = model.w;
+
+    FeatureMatrix features;
+    features.allocate(max_batch, model.num_features);
+    vector<double> probs(max_batch * model.num_classes);
+    vector<Request*> batch;
+    vector<size_t> batch_latencies;
+    vector<uint16_t> spikes(encoder.width());
+    vector<int> output_counts;
+
+    while (true) {
+        batch.clear();
+
+        pthread_mutex_lock(&queue_lock);
+        while (queue.empty() && !shutting_down) {
+            pthread_cond_wait(&queue_cond, &queue_lock);
+        }
+        while (!queue.empty() && batch.size() < max_batch) {
+            batch.push_back(queue.front());
+            queue.pop_front();
+        }
+        pthread_mutex_unlock(&queue_lock);
+
+        if (batch.empty()) {
+            break;
+        }
+
+        for (size_t b = 0; b < batch.size(); b++) {
+            encoder.encode(batch[b]->features.data(), spikes.data());
+
+            if (cache_size == 0 ||
+                !spike_cache.lookup(spikes, output_counts)) {
+                p->clear_activity();
+                for (uint16_t s : spikes) {
+                    p->apply_spike({s, 0, 255}, false);
+                }
+
+                p->run(100);
+                output_counts = p->output_counts();
+                if (cache_size > 0) {
+                    spike_cache.insert(spikes, output_counts);
+                }
+            }
+
+            // 1 for bias
+            double* x = features.row(b);
+            x[0] = 1;
+            for (size_t i = 0; i < output_counts.size(); i++) {
+                x[i + 1] = output_counts[i] / (double)100;
+            }
+        }
+
+        r.forward(features.row(0), batch.size(), probs.data());
+
+        const auto now = chrono::steady_clock::now();
+        batch_latencies.clear();
+        for (size_t b = 0; b < batch.size(); b++) {
+            const double* pr = &probs[b * model.num_classes];
+            Request* req = batch[b];
+            Connection* conn = req->conn;
+
+            batch_latencies.push_back(latency_bucket(
+                chrono::duration<double, micro>(now - req->received).count()));
+
+            pthread_mutex_lock(&conn->lock);
+            req->label = max_element(pr, pr + model.num_classes) - pr;
+            req->done = true;
+            pthread_cond_broadcast(&conn->cond);
+            pthread_mutex_unlock(&conn->lock);
+        }
+
+        pthread_mutex_lock(&latency_lock);
+        for (size_t b : batch_latencies) {
+            latency_counts[b]++;
+        }
+        pthread_mutex_unlock(&latency_lock);
+    }
+
+    delete p;
+    return nullptr;
+}
+
+// Writes answers back in request order. Malformed requests are answered with
+// -1 without ever reaching a worker
+void* connection_writer(void* arg) {
+    Connection* conn = (Connection*)arg;
+    FILE* out = fdopen(dup(conn->out_fd), "w");
+
+    pthread_mutex_lock(&conn->lock);
+    while (true) {
+        while (conn->pending.empty() && !conn->closed) {
+            pthread_cond_wait(&conn->cond, &conn->lock);
+        }
+        if (conn->pending.empty()) {
+            break;
+        }
+
+        Request* req = conn->pending.front();
+        while (!req->done) {
+            pthread_cond_wait(&conn->cond, &conn->lock);
+        }
+        conn->pending.pop_front();
+        const bool more = !conn->pending.empty() && conn->pending.front()->done;
+        pthread_mutex_unlock(&conn->lock);
+
+        fprintf(out, "%d\n", req->label);
+        // Only flush once nothing else is ready to go out
+        if (!more) {
+            fflush(out);
+        }
+        delete req;
+
+        pthread_mutex_lock(&conn->lock);
+    }
+    pthread_mutex_unlock(&conn->lock);
+
+    fclose(out);
+    return nullptr;
+}
+
+void serve_connection(Connection* conn) {
+    pthread_mutex_init(&conn->lock, nullptr);
+    pthread_cond_init(&conn->cond, nullptr);
+
+    pthread_t writer;
+    start_thread(&writer, connection_writer, conn);
+
+    FILE* in = fdopen(dup(conn->in_fd), "r");
+    char* line = nullptr;
+    size_t capacity = 0;
+    ssize_t length;
+    while (!interrupted && (length = getline(&line, &capacity, in)) > 0) {
+        Request* req = new Request();
+        req->received = chrono::steady_clock::now();
+        req->conn = conn;
+
+        const bool valid =
+            csv_parse_line(line, line + length - (line[length - 1] == '\n'),
+                           req->features) &&
+            req->features.size() == model.d_min.size();
+        if (!valid) {
+            req->done = true;
+        }
+
+        pthread_mutex_lock(&conn->lock);
+        conn->pending.push_back(req);
+        pthread_cond_broadcast(&conn->cond);
+        pthread_mutex_unlock(&conn->lock);
+
+        if (valid) {
+            pthread_mutex_lock(&queue_lock);
+            queue.push_back(req);
+            pthread_cond_signal(&queue_cond);
+            pthread_mutex_unlock(&queue_lock);
+        }
+    }
+    free(line);
+    fclose(in);
+
+    pthread_mutex_lock(&conn->lock);
+    conn->closed = true;
+    pthread_cond_broadcast(&conn->cond);
+    pthread_mutex_unlock(&conn->lock);
+
+    pthread_join(writer, nullptr);
+
+    pthread_mutex_destroy(&conn->lock);
+    pthread_cond_destroy(&conn->cond);
+}
+
+void* socket_connection(void* arg) {
+    Connection* conn = (Connection*)arg;
+    serve_connection(conn);
+    conn->finished = true;
+    return nullptr;
+}
+
+// Joins and frees the socket connections that are done with their clients, or
+// all of them, which waits for every request they read to be answered
+void reap_connections(bool all) {
+    size_t kept = 0;
+    for (Connection* conn : connections) {
+        if (!all && !conn->finished) {
+            connections[kept++] = conn;
+            continue;
+        }
+
+        pthread_join(conn->thread, nullptr);
+        close(conn->in_fd);
+        delete conn;
+    }
+    connections.resize(kept);
+}
+
+void report_latency() {
+    pthread_mutex_lock(&latency_lock);
+    const vector<size_t> counts(latency_counts,
+                                latency_counts + latency_buckets);
+    pthread_mutex_unlock(&latency_lock);
+
+    size_t n = 0;
+    for (size_t c : counts) {
+        n += c;
+    }
+    if (n == 0) {
+        fprintf(stderr, "No requests served\n");
+        return;
+    }
+
+    // Buckets holding the requests of rank p50 and p99
+    const size_t p50 = n / 2;
+    const size_t p99 = min(n - 1, (size_t)(n * 0.99));
+    double l50 = 0;
+    double l99 = 0;
+    size_t seen = 0;
+    for (size_t b = 0; b < latency_buckets; b++) {
+        if (seen <= p50 && p50 < seen + counts[b]) {
+            l50 = bucket_latency(b);
+        }
+        if (seen <= p99 && p99 < seen + counts[b]) {
+            l99 = bucket_latency(b);
+        }
+        seen += counts[b];
+    }
+
+    fprintf(stderr, "Requests: %zu, p50: %.1f us, p99: %.1f us\n", n, l50,
+            l99);
+    if (cache_size > 0) {
+        fprintf(stderr, "Spike cache: %zu hits, %zu misses\n",
+                spike_cache.hits(), spike_cache.misses());
+    }
+}
+
+void usage(const char* prog) {
+    fprintf(stderr,
+            "usage: %s [options] model.bin num_threads\n"
+            "options:\n"
+            "  -n, --network <file>     Use this reservoir instead of the one "
+            "recorded in\n"
+            "                           the model\n"
+            "  -s, --socket <path>      Listen on a Unix domain socket "
+            "instead of stdin\n"
+            "  -b, --batch-size <n>     Most requests a worker answers at "
+            "once (default 32)\n"
+            "  -c, --cache-size <n>     Most distinct input patterns to keep "
+            "the simulated\n"
+            "                           outputs of (default 65536, 0 to not "
+            "cache)\n"
+            "Reads one comma separated observation per line and answers each "
+            "with its\n"
+            "predicted class on its own line, in order\n",
+            prog);
+    exit(1);
+}
+
+int main(int argc, char* argv[]) {
+    const char* prog = argv[0];
+    string network_path;
+    string socket_path;
+
+    static struct option long_options[] = {
+        {"network", required_argument, 0, 'n'},
+        {"socket", required_argument, 0, 's'},
+        {"batch-size", required_argument, 0, 'b'},
+        {"cache-size", required_argument, 0, 'c'},
+        {0, 0, 0, 0},
+    };
+
+    int c;
+    while ((c = getopt_long(argc, argv, "n:s:b:c:", long_options, nullptr)) !=
+           -1) {
+        switch (c) {
+        case 'n':
+            network_path = optarg;
+            break;
+        case 's':
+            socket_path = optarg;
+            break;
+        case 'b':
+            if (sscanf(optarg, "%zu", &max_batch) != 1 || max_batch == 0) {
+                usage(prog);
+            }
+            break;
+        case 'c':
+            if (sscanf(optarg, "%zu", &cache_size) != 1) {
+                usage(prog);
+            }
+            break;
+        default:
+            usage(prog);
+        }
+    }
+
+    if (argc - optind != 2) {
+        usage(prog);
+    }
+
+    // Line the positional arguments back up with argv[1..]
+    argv += optind - 1;
+
+    if (!model_load(argv[1], model)) {
+        fprintf(stderr, "%s: main: Unable to load model %s\n", __FILE__,
+                argv[1]);
+        exit(1);
+    }
+
+    encoder = model_encoder(model);
+    spike_cache.set_capacity(cache_size);
+
+    if (network_path.empty()) {
+        network_path = model.network_path;
+    }
+
+    if (network_file_hash(network_path) != model.network_hash) {
+        fprintf(stderr,
+                "%s: main: Warning: %s differs from the network the model was "
+                "trained on\n",
+                __FILE__, network_path.c_str());
+    }
+
+    json network_json;
+    ifstream fin(network_path);
+    fin >> network_json;
+
+    network = new Network();
+    network->from_json(network_json);
+    network->make_sorted_node_vector();
+
+    if ((size_t)network->num_outputs() + 1 != model.num_features) {
+        fprintf(stderr,
+                "%s: main: Network has %d outputs but the model expects %zu\n",
+                __FILE__, network->num_outputs(), model.num_features - 1);
+        exit(1);
+    }
+
+    size_t thread_count;
+    sscanf(argv[2], "%zu", &thread_count);
+
+    // No SA_RESTART so reading stdin or accept() returns once we are asked to
+    // stop
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+
+    pthread_t* threads = (pthread_t*)calloc(thread_count, sizeof(pthread_t));
+    for (size_t i = 0; i < thread_count; i++) {
+        start_thread(threads + i, worker, nullptr);
+    }
+
+    if (socket_path.empty()) {
+        Connection conn;
+        conn.in_fd = STDIN_FILENO;
+        conn.out_fd = STDOUT_FILENO;
+        serve_connection(&conn);
+    } else {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (fd < 0 || socket_path.size() >= sizeof(addr.sun_path)) {
+            fprintf(stderr, "%s: main: Unable to create socket %s\n", __FILE__,
+                    socket_path.c_str());
+            exit(1);
+        }
+        strcpy(addr.sun_path, socket_path.c_str());
+
+        unlink(socket_path.c_str());
+        if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+            listen(fd, 64) < 0) {
+            fprintf(stderr, "%s: main: Unable to listen on %s: %s\n",
+                    __FILE__, socket_path.c_str(), strerror(errno));
+            exit(1);
+        }
+
+        signal(SIGPIPE, SIG_IGN);
+
+        fprintf(stderr, "Listening on %s\n", socket_path.c_str());
+
+        while (!interrupted) {
+            int client = accept(fd, nullptr, nullptr);
+            reap_connections(false);
+            if (client < 0) {
+                continue;
+            }
+
+            Connection* conn = new Connection();
+            conn->in_fd = client;
+            conn->out_fd = client;
+            start_thread(&conn->thread, socket_connection, conn);
+            connections.push_back(conn);
+        }
+
+        close(fd);
+        unlink(socket_path.c_str());
+
+        // Stop reading from the clients, but still answer what they sent
+        for (Connection* conn : connections) {
+            shutdown(conn->in_fd, SHUT_RD);
+        }
+        reap_connections(true);
+    }
+
+    // Workers only exit once the queue has drained
+    pthread_mutex_lock(&queue_lock);
+    shutting_down = true;
+    pthread_cond_broadcast(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+
+    for (size_t i = 0; i < thread_count; i++) {
+        pthread_join(threads[i], nullptr);
+    }
+    delete network;
+    free(threads);
+
+    report_latency();
+}
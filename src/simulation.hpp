@@ -0,0 +1,160 @@
+#pragma once
+
+// Simulates one observation whose input spikes have already been applied and
+// returns its output counts. By default the processor runs for the whole
+// duration in one call, as the tools always have. With early stopping it runs
+// in chunks and stops once no neuron has fired for max_delay steps: by then
+// every spike in flight has been delivered, and a neuron that gets no spikes
+// never fires, so nothing would happen in the remaining steps. The counts are
+// exactly those of the full run and are still normalized by the full
+// duration, so features, caches and grades do not change.
+//
+// A single run can also be snapshotted at several horizons on its way to the
+// full duration, to see how much shorter simulations lose.
+
+#include "framework.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdio>
+#include <memory>
+#include <vector>
+
+struct SimulationOptions {
+    int duration = 100;
+    bool early_stop = false;
+    // Steps per run() call when stopping early, 0 for max_delay
+    int chunk = 0;
+    // Longest edge delay of the network
+    int max_delay = 100;
+};
+
+// Reads max_delay from the network's processor parameters. Without it the
+// network can never be proven quiet, so it only stops at the full duration
+static inline void simulation_set_network(SimulationOptions& opt,
+                                          neuro::Network* n) {
+    nlohmann::json proc_params = n->get_data("proc_params");
+    opt.max_delay = proc_params.contains("max_delay")
+                        ? proc_params["max_delay"].get<int>()
+                        : opt.duration;
+    if (opt.chunk <= 0) {
+        opt.chunk = opt.max_delay;
+    }
+}
+
+// How many steps each simulation took, safe to add to from many threads
+class StepHistogram {
+  public:
+    explicit StepHistogram(int duration) { reset(duration); }
+
+    // Empties it for simulations of up to `duration` steps
+    void reset(int duration) {
+        this->duration = duration;
+        counts.reset(new std::atomic_size_t[duration + 1]());
+    }
+
+    void add(int steps) { counts[std::min(steps, duration)]++; }
+
+    size_t total() const {
+        size_t n = 0;
+        for (int s = 0; s <= duration; s++) {
+            n += counts[s];
+        }
+        return n;
+    }
+
+    // Prints min, median, mean, 90th percentile and max, and the share of
+    // the full duration's steps that was simulated
+    void print(FILE* f) const {
+        const size_t n = total();
+        if (n == 0) {
+            return;
+        }
+
+        size_t seen = 0;
+        double sum = 0;
+        int min = -1;
+        int median = 0;
+        int p90 = 0;
+        int max = 0;
+        for (int s = 0; s <= duration; s++) {
+            const size_t c = counts[s];
+            if (c == 0) {
+                continue;
+            }
+
+            if (min < 0) {
+                min = s;
+            }
+            if (seen < (n + 1) / 2 && seen + c >= (n + 1) / 2) {
+                median = s;
+            }
+            if (seen < (n * 9 + 9) / 10 && seen + c >= (n * 9 + 9) / 10) {
+                p90 = s;
+            }
+            seen += c;
+            sum += (double)s * c;
+            max = s;
+        }
+
+        fprintf(f,
+                "Steps: min %d, median %d, mean %.1f, p90 %d, max %d over %zu "
+                "simulations (%.1f%% of %d)\n",
+                min, median, sum / n, p90, max, n,
+                100 * sum / ((double)n * duration), duration);
+    }
+
+  private:
+    int duration;
+    std::unique_ptr<std::atomic_size_t[]> counts;
+};
+
+// Runs `p` up to each of the increasing, positive `horizons` in turn and
+// appends the output counts so far at each one to `counts`, adding the steps
+// taken to `steps` if it is set
+static inline void simulation_run(neuro::Processor* p,
+                                  const SimulationOptions& opt,
+                                  const std::vector<int>& horizons,
+                                  std::vector<int>& counts,
+                                  StepHistogram* steps = nullptr) {
+    // Counts are those of the last run() call, so chunks are summed
+    std::vector<int> sum;
+    int t = 0;
+    int quiet = 0;
+    counts.clear();
+    for (int horizon : horizons) {
+        while (t < horizon && (!opt.early_stop || quiet < opt.max_delay)) {
+            const int left = horizon - t;
+            const int chunk = opt.early_stop ? std::min(opt.chunk, left) : left;
+            p->run(chunk);
+            t += chunk;
+
+            const std::vector<int> out = p->output_counts();
+            sum.resize(out.size(), 0);
+            for (size_t i = 0; i < out.size(); i++) {
+                sum[i] += out[i];
+            }
+
+            if (opt.early_stop) {
+                const std::vector<int> fired = p->neuron_counts();
+                const bool any = std::any_of(fired.begin(), fired.end(),
+                                             [](int c) { return c > 0; });
+                quiet = any ? 0 : quiet + chunk;
+            }
+        }
+
+        counts.insert(counts.end(), sum.begin(), sum.end());
+    }
+
+    if (steps) {
+        steps->add(t);
+    }
+}
+
+// Runs `p` for the full duration and puts its output counts in `counts`
+static inline void simulation_run(neuro::Processor* p,
+                                  const SimulationOptions& opt,
+                                  std::vector<int>& counts,
+                                  StepHistogram* steps = nullptr) {
+    simulation_run(p, opt, {opt.duration}, counts, steps);
+}
@@ -0,0 +1,107 @@
+#pragma once
+
+// Memoizes reservoir simulations by their encoded input spikes. Binning
+// collapses many observations onto the exact same set of input neurons, and a
+// freshly cleared processor always produces the same output_counts() for the
+// same spikes, so repeated patterns only need to be simulated once.
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <pthread.h>
+#include <unordered_map>
+#include <vector>
+
+struct SpikePatternHash {
+    size_t operator()(const std::vector<uint16_t>& spikes) const {
+        // FNV-1a over the spike indices
+        uint64_t h = 14695981039346656037ULL;
+        for (uint16_t s : spikes) {
+            h ^= s;
+            h *= 1099511628211ULL;
+        }
+
+        return h;
+    }
+};
+
+class SpikeCache {
+  public:
+    SpikeCache() {
+        for (size_t i = 0; i < num_shards; i++) {
+            pthread_mutex_init(&shards[i].lock, nullptr);
+        }
+    }
+
+    ~SpikeCache() {
+        for (size_t i = 0; i < num_shards; i++) {
+            pthread_mutex_destroy(&shards[i].lock);
+        }
+    }
+
+    SpikeCache(const SpikeCache&) = delete;
+    SpikeCache& operator=(const SpikeCache&) = delete;
+
+    // Keeps at most about `entries` patterns, 0 for no limit. Once a shard is
+    // full, inserting into it evicts one of its patterns
+    void set_capacity(size_t entries) {
+        shard_capacity = (entries + num_shards - 1) / num_shards;
+    }
+
+    // Copies the cached output counts for `spikes` into `counts`, returning
+    // false (and counting a miss) if the pattern has not been simulated yet
+    bool lookup(const std::vector<uint16_t>& spikes,
+                std::vector<int>& counts) {
+        const size_t h = SpikePatternHash()(spikes);
+        Shard& s = shards[h % num_shards];
+
+        pthread_mutex_lock(&s.lock);
+        auto it = s.map.find(spikes);
+        const bool found = it != s.map.end();
+        if (found) {
+            counts = it->second;
+        }
+        pthread_mutex_unlock(&s.lock);
+
+        if (found) {
+            n_hits++;
+        } else {
+            n_misses++;
+        }
+
+        return found;
+    }
+
+    void insert(const std::vector<uint16_t>& spikes,
+                const std::vector<int>& counts) {
+        const size_t h = SpikePatternHash()(spikes);
+        Shard& s = shards[h % num_shards];
+
+        pthread_mutex_lock(&s.lock);
+        if (shard_capacity > 0 && s.map.size() >= shard_capacity &&
+            s.map.find(spikes) == s.map.end()) {
+            s.map.erase(s.map.begin());
+        }
+        s.map.emplace(spikes, counts);
+        pthread_mutex_unlock(&s.lock);
+    }
+
+    size_t hits() const { return n_hits; }
+    size_t misses() const { return n_misses; }
+
+  private:
+    // Sharded so worker threads rarely contend on the same lock
+    static const size_t num_shards = 64;
+
+    struct Shard {
+        pthread_mutex_t lock;
+        std::unordered_map<std::vector<uint16_t>, std::vector<int>,
+                           SpikePatternHash>
+            map;
+    };
+
+    Shard shards[num_shards];
+    size_t shard_capacity = 0;
+    std::atomic_size_t n_hits{0};
+    std::atomic_size_t n_misses{0};
+};